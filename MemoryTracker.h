@@ -21,6 +21,7 @@
 #if MEMORY_CHECK == 1
 
 
+#include <atomic>
 #include <unordered_map>
 #include <mutex>
 #include <cinttypes>
@@ -88,8 +89,26 @@ public:
 
 		//! The allocation ID. Use with the "break on allocation" feature.
 		int64_t AllocationID;
+
+		//! User tag returned by the track hook (see SetHooks)
+		uint32_t Tag;
 	};
 
+	//!
+	//! Hook called when a chunk is tracked. The returned tag is stored with the chunk. Return
+	//! #NoTag if the chunk wasn't accounted, so that the untrack hook isn't called for it.
+	//!
+	typedef uint32_t (*TrackHook)(size_t bytes);
+
+	//!
+	//! Hook called when a chunk is untracked, with the tag returned by the track hook. It's
+	//! not called for the chunks tracked without hook, or tagged #NoTag.
+	//!
+	typedef void (*UntrackHook)(uint32_t tag, size_t bytes);
+
+	//! Tag of the chunks which weren't accounted by the track hook
+	static const uint32_t NoTag = static_cast< uint32_t >(-1);
+
 	//!
 	//! Define our custom hash map (using a malloc/free allocator to avoid recursive new)
 	//!
@@ -151,6 +170,18 @@ public:
 		m_BreakOnAlloc = count;
 	}
 
+	//!
+	//! Set hooks notified of every tracked / untracked chunk. This can for instance be used
+	//! to attribute allocations to the code being profiled. The hooks are called outside of
+	//! the tracker's lock, and can be nullptr.
+	//!
+	inline void SetHooks(TrackHook track, UntrackHook untrack)
+	{
+		std::lock_guard< std::mutex > lock(m_Mutex);
+		m_TrackHook = track;
+		m_UntrackHook = untrack;
+	}
+
 	//!
 	//! Get the tracked memory size in bytes.
 	//!
@@ -181,6 +212,9 @@ public:
 	{
 		if (m_Enabled == true)
 		{
+			TrackHook hook = m_TrackHook;
+			uint32_t tag = hook != nullptr ? hook(size) : NoTag;
+
 			std::lock_guard< std::mutex > lock(m_Mutex);
 
 			// break if the allocation count was set, and it's the current one
@@ -191,7 +225,7 @@ public:
 			}
 
 			// update the chunks
-			m_Chunks.insert(std::make_pair(pointer, Chunk{ size, filename, line, m_AllocationCount++ }));
+			m_Chunks.insert(std::make_pair(pointer, Chunk{ size, filename, line, m_AllocationCount++, tag }));
 		}
 	}
 
@@ -202,11 +236,21 @@ public:
 	{
 		if (m_Enabled == true)
 		{
-			std::lock_guard<std::mutex> lock(m_Mutex);
-			auto entry = m_Chunks.find(pointer);
-			if (entry != m_Chunks.end())
+			UntrackHook hook = nullptr;
+			Chunk chunk;
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				auto entry = m_Chunks.find(pointer);
+				if (entry != m_Chunks.end())
+				{
+					hook = entry->second.Tag != NoTag ? m_UntrackHook.load() : nullptr;
+					chunk = entry->second;
+					m_Chunks.erase(entry);
+				}
+			}
+			if (hook != nullptr)
 			{
-				m_Chunks.erase(entry);
+				hook(chunk.Tag, chunk.Bytes);
 			}
 		}
 	}
@@ -220,6 +264,8 @@ private:
 		: m_AllocationCount(0)
 		, m_BreakOnAlloc(-1)
 		, m_Enabled(true)
+		, m_TrackHook(nullptr)
+		, m_UntrackHook(nullptr)
 	{
 	}
 
@@ -245,6 +291,12 @@ private:
 	//! enable the tracking
 	bool m_Enabled;
 
+	//! hook called when tracking a chunk
+	std::atomic< TrackHook > m_TrackHook;
+
+	//! hook called when untracking a chunk
+	std::atomic< UntrackHook > m_UntrackHook;
+
 };
 
 //!
@@ -337,6 +389,14 @@ void operator delete [] (void * pointer) noexcept;
 //!
 #define MT_GET_ALLOCATED_CHUNKS() MemoryTracker::Instance().GetTrackedChunks()
 
+//!
+//! @def MT_SET_HOOKS(track, untrack)
+//!		Set the functions notified of every tracked / untracked chunk. For instance
+//!		`MT_SET_HOOKS(Profiler::OnAllocation, Profiler::OnDeallocation)` attributes the
+//!		tracked memory to the profiled scopes.
+//!
+#define MT_SET_HOOKS(track, untrack) MemoryTracker::Instance().SetHooks(track, untrack)
+
 //!
 //! @def MT_SHUTDOWN(log)
 //!		This can be called when you're leaving your application to disable memory
@@ -385,6 +445,7 @@ void operator delete [] (void * pointer) noexcept;
 #	define MT_BREAK_ON_ALLOC(count)		(void)0
 #	define MT_GET_ALLOCATED_MEMORY()	0
 #	define MT_GET_ALLOCATED_CHUNKS()	0
+#	define MT_SET_HOOKS(track, untrack)	(void)0
 #	define MT_SHUTDOWN(log)				(void)0
 
 #endif
@@ -9,13 +9,83 @@
 #	define PROFILER_ENABLE 0
 #endif
 
+//!
+//! Use @a PROFILER_MAX_STRINGS to set the capacity of the profiler's string table, which
+//! stores the scope names, filenames and string arguments. Must be a power of 2.
+//!
+#if !defined(PROFILER_MAX_STRINGS)
+#	define PROFILER_MAX_STRINGS 65536
+#endif
+
+//!
+//! Use @a PROFILER_MAX_ARGUMENTS to set the maximum number of arguments that can be
+//! attached to a single profiled scope (see #PROFILE_ARG) Additional ones are ignored.
+//! Set it to 0 to compile the arguments out.
+//!
+#if !defined(PROFILER_MAX_ARGUMENTS)
+#	define PROFILER_MAX_ARGUMENTS 4
+#endif
+
+//!
+//! Use @a PROFILER_CLOCK to set the clock used to time the scopes. This can be any clock
+//! meeting the std::chrono TrivialClock requirements, for instance `std::chrono::steady_clock`
+//! or a custom cycle counter based one. Cross-process captures (see ProfilerSharedMemory.h)
+//! need a clock whose epoch is shared by all processes.
+//!
+#if !defined(PROFILER_CLOCK)
+#	define PROFILER_CLOCK std::chrono::high_resolution_clock
+#endif
+
+//!
+//! Use @a PROFILER_THREAD_ID to set how threads are identified in the outputs: either
+//! `Profiler::StandardThreadID` (`std::thread::id`) or `Profiler::NativeThreadID` (the
+//! OS thread ID, as shown by debuggers and system tools) Any type with a `Type` typedef
+//! and a static `Get` function returning the current thread's ID can be used.
+//!
+#if !defined(PROFILER_THREAD_ID)
+#	define PROFILER_THREAD_ID Profiler::StandardThreadID
+#endif
 
+//!
+//! Use @a PROFILER_MUTEX to set the mutex protecting the marker lists: either `std::mutex`
+//! or `Profiler::SpinMutex`, which avoids system calls when the lock is rarely contended.
+//!
+#if !defined(PROFILER_MUTEX)
+#	define PROFILER_MUTEX std::mutex
+#endif
+
+//!
+//! Use @a PROFILER_ALLOCATOR to set the allocator template used by the profiler's vectors,
+//! which store the markers, their arguments, etc.
+//!
+#if !defined(PROFILER_ALLOCATOR)
+#	define PROFILER_ALLOCATOR std::allocator
+#endif
+
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "Hash.h"
+
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#elif defined(__APPLE__)
+#	include <pthread.h>
+#elif defined(_WIN32)
+extern "C" __declspec(dllimport) unsigned long __stdcall GetCurrentThreadId(void);
+#endif
+
 
 //!
 //! Fix for f***ing Windows headers defining GetCurrentTime ...
@@ -28,18 +98,73 @@
 namespace Profiler
 {
 
+	//!
+	//! Thread ID policy using `std::thread::id`
+	//!
+	struct StandardThreadID
+	{
+		typedef std::thread::id Type;
+
+		static inline Type Get(void)
+		{
+			return std::this_thread::get_id();
+		}
+	};
+
+	//!
+	//! Thread ID policy using the OS thread ID. Platforms without one use a hash of the
+	//! `std::thread::id`
+	//!
+	struct NativeThreadID
+	{
+#if defined(__linux__)
+		typedef long Type;
+
+		static inline Type Get(void)
+		{
+			return syscall(SYS_gettid);
+		}
+#elif defined(__APPLE__)
+		typedef uint64_t Type;
+
+		static inline Type Get(void)
+		{
+			uint64_t id = 0;
+			pthread_threadid_np(nullptr, &id);
+			return id;
+		}
+#elif defined(_WIN32)
+		typedef unsigned long Type;
+
+		static inline Type Get(void)
+		{
+			return GetCurrentThreadId();
+		}
+#else
+		typedef size_t Type;
+
+		static inline Type Get(void)
+		{
+			return std::hash< std::thread::id >()(std::this_thread::get_id());
+		}
+#endif
+	};
+
+	//! The clock
+	typedef PROFILER_CLOCK Clock;
+
 	//! Define a precise time point
-	typedef std::chrono::high_resolution_clock::time_point TimePoint;
+	typedef Clock::time_point TimePoint;
 
 	//! Defines a thread ID
-	typedef std::thread::id ThreadID;
+	typedef PROFILER_THREAD_ID::Type ThreadID;
 
 	//!
 	//! Get the current thread ID
 	//!
 	inline ThreadID GetCurrentThreadID(void)
 	{
-		return std::this_thread::get_id();
+		return PROFILER_THREAD_ID::Get();
 	}
 
 	//!
@@ -47,7 +172,7 @@ namespace Profiler
 	//!
 	inline TimePoint GetCurrentTime(void)
 	{
-		return std::chrono::high_resolution_clock::now();
+		return Clock::now();
 	}
 
 	//!
@@ -74,27 +199,537 @@ namespace Profiler
 		return std::chrono::duration_cast< std::chrono::milliseconds >(end - start).count();
 	}
 
+	//!
+	//! Get the overhead of timing something, in nanoseconds. This is the smallest time
+	//! measured between 2 consecutive calls to GetCurrentTime, and is computed once.
+	//!
+	inline uint64_t GetTimingOverhead(void)
+	{
+		static const uint64_t overhead = [] (void) {
+			uint64_t result = uint64_t(-1);
+			for (int i = 0; i < 1000; ++i)
+			{
+				TimePoint start = GetCurrentTime();
+				result = std::min(result, GetNanoSeconds(start, GetCurrentTime()));
+			}
+			return result;
+		}();
+		return overhead;
+	}
+
+	//! Define a string
+	typedef std::string String;
+
+	//! Magic number and version of the raw captures (see Output::Raw)
+	enum : uint32_t { RawMagic = 0x57415250, RawVersion = 1 };
+
+	//!
+	//! Header of a raw capture. The markers and arguments are written with fixed sizes and times
+	//! in nanoseconds, so that captures don't depend on the build, and can be compared by other
+	//! builds (see Compare::LoadRaw) which check this header.
+	//!
+	struct RawHeader
+	{
+
+		//! RawMagic
+		uint32_t Magic;
+
+		//! RawVersion
+		uint32_t Version;
+
+		//! Size of a RawMarker
+		uint32_t MarkerSize;
+
+		//! Size of a RawArgument
+		uint32_t ArgumentSize;
+
+		//! Start time of the capture
+		int64_t StartTime;
+
+	};
+
+	//!
+	//! A marker in a raw capture
+	//!
+	struct RawMarker
+	{
+
+		//! The ID of the parent scope
+		uint32_t ParentScope;
+
+		//! The ID of the scope
+		uint32_t Scope;
+
+		//! Index of the first argument of the marker in its thread's arguments, -1 if it has none
+		uint32_t FirstArgument;
+
+		//! Unused
+		uint32_t Padding;
+
+		//! Start time
+		int64_t Start;
+
+		//! End time
+		int64_t End;
+
+	};
+
+	//!
+	//! An argument in a raw capture
+	//!
+	struct RawArgument
+	{
+
+		//! Name of the argument
+		uint32_t Name;
+
+		//! Type of the argument (see ArgumentType)
+		uint8_t Type;
+
+		//! Number of arguments of the marker this one belongs to
+		uint8_t Count;
+
+		//! Unused
+		uint16_t Padding;
+
+		//! The value: an integer, the bits of a double, or a string ID
+		int64_t Value;
+
+	};
+
+	//!
+	//! Get a time point in nanoseconds since the clock's epoch, as stored in raw captures
+	//!
+	inline int64_t GetRawTime(TimePoint time)
+	{
+		return std::chrono::duration_cast< std::chrono::nanoseconds >(time.time_since_epoch()).count();
+	}
+
 #if PROFILER_ENABLE == 1
 
 	// forward definitions
 	struct MarkerList;
+	struct MarkerBuffer;
 	struct MarkerData;
-	struct ScopeData;
+	struct CounterValues;
+	class ProfileScope;
+	class Counter;
 
 	//! Define a scope ID
-	typedef uint16_t ScopeID;
+	typedef uint32_t ScopeID;
 
-	//! Define a string
-	typedef std::string String;
+	//! Define the ID of an interned string
+	typedef uint32_t StringID;
+
+	//!
+	//! Mutex spinning until it gets the lock, yielding between attempts. See #PROFILER_MUTEX
+	//!
+	class SpinMutex
+	{
+
+	public:
+
+		//! Constructor
+		inline SpinMutex(void)
+		{
+			m_Flag.clear();
+		}
+
+		//! Lock the mutex
+		inline void lock(void)
+		{
+			while (m_Flag.test_and_set(std::memory_order_acquire) == true)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		//! Try to lock the mutex, without waiting
+		inline bool try_lock(void)
+		{
+			return m_Flag.test_and_set(std::memory_order_acquire) == false;
+		}
+
+		//! Unlock the mutex
+		inline void unlock(void)
+		{
+			m_Flag.clear(std::memory_order_release);
+		}
+
+	private:
+
+		//! The lock
+		std::atomic_flag m_Flag;
+
+	};
 
 	//! Define a mutex
-	typedef std::mutex Mutex;
+	typedef PROFILER_MUTEX Mutex;
 
 	//! Define scope based lock on a mutex
 	template < typename Type > using ScopedLock = std::lock_guard< Type >;
 
 	//! Define a dynamically allocated vector
-	template < typename Type > using Vector = std::vector< Type >;
+	template < typename Type > using Vector = std::vector< Type, PROFILER_ALLOCATOR< Type > >;
+
+	//!
+	//! Get the base 2 logarithm of an integer, rounded down
+	//!
+	inline uint32_t Log2(uint32_t value)
+	{
+		uint32_t result = 0;
+		while (value >>= 1)
+		{
+			++result;
+		}
+		return result;
+	}
+
+	//!
+	//! Append only vector which can be grown concurrently without locking. Elements are
+	//! stored in segments of increasing sizes which are never moved, so references stay
+	//! valid. Elements are value-initialized, and each one is flagged once published, so
+	//! that publishing an element never waits for the others.
+	//!
+	template< typename Type >
+	class ConcurrentVector
+	{
+
+	public:
+
+		//!
+		//! Constructor
+		//!
+		inline ConcurrentVector(void)
+			: m_Size(0)
+		{
+			for (auto & segment : m_Segments)
+			{
+				segment.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		//!
+		//! Destructor
+		//!
+		inline ~ConcurrentVector(void)
+		{
+			for (auto & segment : m_Segments)
+			{
+				delete [] segment.load(std::memory_order_relaxed);
+			}
+		}
+
+		//!
+		//! Allocate @p count consecutive elements, and return the index of the first one. Call
+		//! Publish once they're initialized.
+		//!
+		inline uint32_t Allocate(uint32_t count = 1)
+		{
+			// the segments are allocated before the size is increased, so that all the elements
+			// below the size can be accessed
+			uint32_t index = m_Size.load(std::memory_order_acquire);
+			do
+			{
+				for (uint32_t segment = GetSegment(index), last = GetSegment(index + count - 1); segment <= last; ++segment)
+				{
+					if (m_Segments[segment].load(std::memory_order_acquire) == nullptr)
+					{
+						Element * data = new Element[BaseSize << segment]();
+						Element * expected = nullptr;
+						if (m_Segments[segment].compare_exchange_strong(expected, data, std::memory_order_acq_rel) == false)
+						{
+							delete [] data;
+						}
+					}
+				}
+			} while (m_Size.compare_exchange_weak(index, index + count, std::memory_order_acq_rel, std::memory_order_acquire) == false);
+			return index;
+		}
+
+		//!
+		//! Access an allocated element
+		//!
+		inline Type & operator [] (uint32_t index)
+		{
+			return this->GetElement(index).Value;
+		}
+
+		//!
+		//! Access an allocated element
+		//!
+		inline const Type & operator [] (uint32_t index) const
+		{
+			return this->GetElement(index).Value;
+		}
+
+		//!
+		//! Publish the @p count elements allocated at @p index, once initialized
+		//!
+		inline void Publish(uint32_t index, uint32_t count = 1)
+		{
+			for (uint32_t i = index; i < index + count; ++i)
+			{
+				this->GetElement(i).Published.store(true, std::memory_order_release);
+			}
+		}
+
+		//!
+		//! Check if an element was published. Unpublished elements can be accessed, but only
+		//! their atomic members are meaningful.
+		//!
+		inline bool IsPublished(uint32_t index) const
+		{
+			return index < this->GetSize() && this->GetElement(index).Published.load(std::memory_order_acquire) == true;
+		}
+
+		//!
+		//! Get the number of allocated elements, published or not (see IsPublished)
+		//!
+		inline uint32_t GetSize(void) const
+		{
+			return m_Size.load(std::memory_order_acquire);
+		}
+
+	private:
+
+		//! Size of the first segment. Segment n contains BaseSize * 2^n elements.
+		static const uint32_t BaseSize = 256;
+
+		//!
+		//! An element, and its publication flag
+		//!
+		struct Element
+		{
+			//! The element
+			Type Value;
+
+			//! True once the element is initialized
+			std::atomic< bool > Published;
+		};
+
+		//!
+		//! Get the segment containing an element
+		//!
+		static inline uint32_t GetSegment(uint32_t index)
+		{
+			return Log2(index / BaseSize + 1);
+		}
+
+		//!
+		//! Get an allocated element
+		//!
+		inline Element & GetElement(uint32_t index) const
+		{
+			uint32_t segment = GetSegment(index);
+			return m_Segments[segment].load(std::memory_order_acquire)[index - BaseSize * ((1u << segment) - 1)];
+		}
+
+		//! The segments
+		std::atomic< Element * > m_Segments[32];
+
+		//! Number of allocated elements
+		std::atomic< uint32_t > m_Size;
+
+	};
+
+	//!
+	//! Table of interned strings. Lookups and insertions are lock-free: this is an open
+	//! addressing hash table of immutable entries, and the ID of a string is the index
+	//! of its slot. Its capacity is fixed (see #PROFILER_MAX_STRINGS)
+	//!
+	class StringTable
+	{
+
+	public:
+
+		//! ID returned when the table is full
+		enum : StringID { Invalid = static_cast< StringID >(-1) };
+
+		//!
+		//! An interned string
+		//!
+		struct Entry
+		{
+			//! Constructor
+			inline Entry(uint32_t hash, const char * data, size_t size)
+				: Hash(hash)
+				, Value(data, size)
+				, Scope(static_cast< ScopeID >(-1))
+			{
+			}
+
+			//! The hash of the string
+			uint32_t Hash;
+
+			//! The string
+			String Value;
+
+			//! The scope used when this string is the name of a dynamic scope
+			std::atomic< ScopeID > Scope;
+		};
+
+		//!
+		//! Constructor
+		//!
+		inline StringTable(void)
+			: m_Slots(new std::atomic< Entry * >[PROFILER_MAX_STRINGS])
+		{
+			static_assert((PROFILER_MAX_STRINGS & (PROFILER_MAX_STRINGS - 1)) == 0, "PROFILER_MAX_STRINGS must be a power of 2");
+			for (uint32_t i = 0; i < PROFILER_MAX_STRINGS; ++i)
+			{
+				m_Slots[i].store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		//!
+		//! Destructor
+		//!
+		inline ~StringTable(void)
+		{
+			for (uint32_t i = 0; i < PROFILER_MAX_STRINGS; ++i)
+			{
+				delete m_Slots[i].load(std::memory_order_relaxed);
+			}
+			delete [] m_Slots;
+		}
+
+		//!
+		//! Get the ID of a string, inserting it if needed.
+		//!
+		//! @return
+		//!		The ID of the string, or Invalid if the table is full.
+		//!
+		inline StringID Intern(const char * data, size_t size)
+		{
+			return this->Lookup(data, size, true);
+		}
+
+		//!
+		//! Get the ID of a string, or Invalid if it wasn't interned.
+		//!
+		inline StringID Find(const char * data, size_t size) const
+		{
+			return const_cast< StringTable * >(this)->Lookup(data, size, false);
+		}
+
+		//!
+		//! Get an interned string entry. Returns nullptr for unused IDs.
+		//!
+		inline Entry * GetEntry(StringID id) const
+		{
+			return id < PROFILER_MAX_STRINGS ? m_Slots[id].load(std::memory_order_acquire) : nullptr;
+		}
+
+		//!
+		//! Get an interned string. Returns an empty string for unused IDs.
+		//!
+		inline const char * Get(StringID id) const
+		{
+			Entry * entry = this->GetEntry(id);
+			return entry != nullptr ? entry->Value.c_str() : "";
+		}
+
+		//!
+		//! Get the capacity of the table. IDs are lower than this.
+		//!
+		inline uint32_t GetCapacity(void) const
+		{
+			return PROFILER_MAX_STRINGS;
+		}
+
+	private:
+
+		//!
+		//! Find a string, and optionally insert it.
+		//!
+		inline StringID Lookup(const char * data, size_t size, bool insert)
+		{
+			uint32_t hash = Hash::Jenkins(data, size);
+			Entry * created = nullptr;
+			for (uint32_t i = 0; i < PROFILER_MAX_STRINGS; ++i)
+			{
+				uint32_t slot = (hash + i) & (PROFILER_MAX_STRINGS - 1);
+				Entry * entry = m_Slots[slot].load(std::memory_order_acquire);
+
+				// free slot: the string is not in the table, try to take it
+				if (entry == nullptr)
+				{
+					if (insert == false)
+					{
+						return Invalid;
+					}
+					if (created == nullptr)
+					{
+						created = new Entry(hash, data, size);
+					}
+					if (m_Slots[slot].compare_exchange_strong(entry, created, std::memory_order_acq_rel) == true)
+					{
+						return slot;
+					}
+					// another thread took the slot, entry is now its string
+				}
+
+				// check if this slot holds our string
+				if (entry->Hash == hash && entry->Value.size() == size && memcmp(entry->Value.data(), data, size) == 0)
+				{
+					delete created;
+					return slot;
+				}
+			}
+			delete created;
+			return Invalid;
+		}
+
+		//! The slots
+		std::atomic< Entry * > * m_Slots;
+
+	};
+
+	//!
+	//! Memory statistics of a scope, fed by the MemoryTracker hooks (see #OnAllocation)
+	//!
+	struct ScopeMemory
+	{
+
+		//! Constructor
+		inline ScopeMemory(void)
+			: Allocations(0)
+			, AllocatedBytes(0)
+			, LiveBytes(0)
+		{
+		}
+
+		//! Number of allocations made in the scope
+		std::atomic< uint64_t > Allocations;
+
+		//! Number of bytes allocated in the scope
+		std::atomic< uint64_t > AllocatedBytes;
+
+		//! Number of bytes allocated in the scope and not yet freed
+		std::atomic< int64_t > LiveBytes;
+
+	};
+
+	//!
+	//! Define a scope data
+	//!
+	struct ScopeData
+	{
+
+		//! Name of the scope
+		const char * Name;
+
+		//! The source file
+		const char * Filename;
+
+		//! The line
+		uint32_t Line;
+
+		//! The memory allocated while the scope was the innermost one
+		ScopeMemory Memory;
+
+	};
 
 	//! Data that might need to be shared
 	struct SharedData
@@ -103,6 +738,8 @@ namespace Profiler
 		inline SharedData(void)
 			: Started(true)
 			, StartTime(GetCurrentTime())
+			, ThreadCount(0)
+			, TrackedMemory(0)
 		{
 		}
 
@@ -113,17 +750,33 @@ namespace Profiler
 		TimePoint StartTime;
 
 		//! The list of registered scopes
-		Vector< ScopeData > Scopes;
+		ConcurrentVector< ScopeData > Scopes;
+
+		//! The global marker lists. This contains the lists of running threads, and
+		//! the retired lists of exited threads that still hold markers
+		Vector< MarkerBuffer * > MarkerLists;
+
+		//! Retired and cleared marker lists, ready to be reused by new threads
+		Vector< MarkerBuffer * > FreeLists;
+
+		//! Number of threads which registered a marker list so far
+		uint32_t ThreadCount;
 
-		//! Mutex to protect scope vector access
-		Mutex ScopeMutex;
+		//! The live per-thread call counters (see #PROFILE_COUNT_SCOPE)
+		Vector< Counter * > Counters;
 
-		//! The global marker lists
-		Vector< Vector< MarkerData > * > MarkerLists;
+		//! Values of the counters of exited threads, indexed by scope ID
+		Vector< CounterValues > RetiredCounters;
 
-		//! Mutex to protect Markers access
+		//! Mutex to protect Markers and Counters access
 		Mutex MarkerMutex;
 
+		//! The interned strings, used by the scopes and their arguments
+		StringTable Strings;
+
+		//! Number of bytes currently allocated, as reported by the MemoryTracker hooks
+		std::atomic< int64_t > TrackedMemory;
+
 	};
 
 	//! The data
@@ -135,66 +788,326 @@ namespace Profiler
 	//! The per-thread current scope ID
 	extern thread_local ScopeID CurrentScope;
 
+	//! The per-thread innermost profiled scope
+	extern thread_local ProfileScope * CurrentProfile;
+
 	//!
-	//! Define a scope data
+	//! Type of a scope argument
 	//!
-	struct ScopeData
+	enum class ArgumentType
+		: uint8_t
 	{
+		//! Signed integer
+		Integer = 0,
 
-		//! Name of the scope
-		String Name;
+		//! Double precision float
+		Double,
 
-		//! The source file
-		String Filename;
+		//! Interned string
+		String
+	};
+
+	//!
+	//! An argument attached to a marker
+	//!
+	struct ArgumentData
+	{
+
+		//! Name of the argument
+		StringID Name;
+
+		//! Type of the argument
+		ArgumentType Type;
+
+		//! Number of arguments of the marker this one belongs to
+		uint8_t Count;
+
+		//! The value
+		union
+		{
+			int64_t Integer;
+			double Double;
+			StringID String;
+		};
+
+	};
+
+	//!
+	//! A raw input data
+	//!
+	struct MarkerData
+	{
+
+		//! The ID of the parent scope
+		ScopeID ParentScope;
+
+		//! The ID of the scope
+		ScopeID Scope;
+
+		//! Index of the first argument of the marker in its buffer, -1 if it has none
+		uint32_t FirstArgument;
+
+		//! Start point
+		TimePoint Start;
+
+		//! End point
+		TimePoint End;
+
+	};
+
+	//!
+	//! Values of a call counter
+	//!
+	struct CounterValues
+	{
+
+		//! Number of calls
+		uint64_t Count;
+
+		//! Number of timed calls
+		uint64_t SampleCount;
+
+		//! Total duration of the timed calls, in nanoseconds
+		uint64_t SampleTime;
+
+	};
+
+	//!
+	//! A sample of the tracked memory, recorded on each allocation and deallocation
+	//!
+	struct MemorySample
+	{
+
+		//! The time of the sample
+		TimePoint Time;
+
+		//! The number of bytes allocated at that time
+		int64_t Bytes;
+
+	};
+
+	//!
+	//! A marker list, along with the metadata of the thread which recorded it. Those are
+	//! never deleted: when a thread exits its buffer is retired, and once its markers
+	//! have been cleared, it is recycled for the next new thread.
+	//!
+	struct MarkerBuffer
+	{
+
+		//! The markers
+		Vector< MarkerData > List;
+
+		//! The markers' arguments
+		Vector< ArgumentData > Arguments;
+
+		//! The tracked memory samples
+		Vector< MemorySample > MemorySamples;
+
+		//! ID of the thread which recorded the markers
+		ThreadID Thread;
+
+		//! Index of the thread, in registration order. Unlike thread IDs which can be
+		//! reused by the system once a thread exits, this one is unique.
+		uint32_t ThreadIndex;
+
+		//! True when the thread exited
+		bool Retired;
+
+	};
+
+	//!
+	//! Structure used to register per-thread marker lists to the global markers one.
+	//!
+	struct MarkerList
+	{
+
+		//!
+		//! Constructor. This will get a marker buffer (a recycled one if available) and
+		//! register it to the global list of marker lists
+		//!
+		inline MarkerList(void)
+			: Buffer(nullptr)
+		{
+			ScopedLock< Mutex > lock(Data->MarkerMutex);
+			if (Data->FreeLists.empty() == false)
+			{
+				Buffer = Data->FreeLists.back();
+				Data->FreeLists.pop_back();
+			}
+			else
+			{
+				Buffer = new MarkerBuffer();
+				Buffer->List.reserve(10000000);
+				Buffer->Arguments.reserve(1000000);
+				Buffer->MemorySamples.reserve(100000);
+			}
+			Buffer->Thread		= GetCurrentThreadID();
+			Buffer->ThreadIndex	= Data->ThreadCount++;
+			Buffer->Retired		= false;
+			Data->MarkerLists.push_back(Buffer);
+		}
+
+		//!
+		//! Destructor. Retire the buffer : it's kept until its markers are cleared, or
+		//! directly recycled if it doesn't contain any. The thread might still profile
+		//! while its other thread locals are destroyed, so the buffer is forgotten and
+		//! those markers are dropped.
+		//!
+		inline ~MarkerList(void)
+		{
+			ScopedLock< Mutex > lock(Data->MarkerMutex);
+			Buffer->Retired = true;
+			if (Buffer->List.empty() == true && Buffer->MemorySamples.empty() == true)
+			{
+				Buffer->Arguments.clear();
+				Data->MarkerLists.erase(std::find(Data->MarkerLists.begin(), Data->MarkerLists.end(), Buffer));
+				Data->FreeLists.push_back(Buffer);
+			}
+			Buffer = nullptr;
+		}
+
+		//! The marker buffer, nullptr once the thread's marker list is destroyed
+		MarkerBuffer * Buffer;
+
+	};
+
+	//!
+	//! Per-thread call counter of a scope. This is used by #PROFILE_COUNT_SCOPE for scopes
+	//! that are too hot to record markers: only the owning thread writes it, and it's padded
+	//! to a cache line to avoid false sharing with other threads' counters.
+	//!
+	class alignas(64) Counter
+	{
+
+	public:
+
+		//!
+		//! Constructor. Register the counter.
+		//!
+		//! @param scope
+		//!		The counted scope.
+		//!
+		//! @param period
+		//!		If not 0, one call every @p period calls is timed.
+		//!
+		inline Counter(ScopeID scope, uint32_t period)
+			: m_Count(0)
+			, m_SampleCount(0)
+			, m_SampleTime(0)
+			, m_Scope(scope)
+			, m_Period(period)
+			, m_Countdown(period)
+		{
+			ScopedLock< Mutex > lock(Data->MarkerMutex);
+			Data->Counters.push_back(this);
+		}
+
+		//!
+		//! Destructor. Unregister the counter, and keep its values.
+		//!
+		inline ~Counter(void)
+		{
+			ScopedLock< Mutex > lock(Data->MarkerMutex);
+			if (Data->RetiredCounters.size() <= m_Scope)
+			{
+				Data->RetiredCounters.resize(m_Scope + 1, CounterValues{ 0, 0, 0 });
+			}
+			CounterValues & values = Data->RetiredCounters[m_Scope];
+			values.Count		+= m_Count.load(std::memory_order_relaxed);
+			values.SampleCount	+= m_SampleCount.load(std::memory_order_relaxed);
+			values.SampleTime	+= m_SampleTime.load(std::memory_order_relaxed);
+			Data->Counters.erase(std::find(Data->Counters.begin(), Data->Counters.end(), this));
+		}
+
+		//!
+		//! Count a call. Since only the owning thread writes the counter, this doesn't
+		//! need an atomic read-modify-write.
+		//!
+		//! @return
+		//!		true if the call should be timed.
+		//!
+		inline bool Increment(void)
+		{
+			if (Data->Started == false)
+			{
+				return false;
+			}
+			m_Count.store(m_Count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			if (m_Period != 0 && --m_Countdown == 0)
+			{
+				m_Countdown = m_Period;
+				return true;
+			}
+			return false;
+		}
 
-		//! The line
-		uint32_t Line;
+		//!
+		//! Add a timed call
+		//!
+		inline void AddSample(uint64_t nanoseconds)
+		{
+			m_SampleCount.store(m_SampleCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			m_SampleTime.store(m_SampleTime.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+		}
 
-	};
+		//!
+		//! Reset the counter. This can be called from any thread, but a concurrent increment
+		//! by the owning thread might be lost.
+		//!
+		inline void Reset(void)
+		{
+			m_Count.store(0, std::memory_order_relaxed);
+			m_SampleCount.store(0, std::memory_order_relaxed);
+			m_SampleTime.store(0, std::memory_order_relaxed);
+		}
 
-	//!
-	//! A raw input data
-	//!
-	struct MarkerData
-	{
+		//!
+		//! Get the counter's values
+		//!
+		inline CounterValues GetValues(void) const
+		{
+			return {
+				m_Count.load(std::memory_order_relaxed),
+				m_SampleCount.load(std::memory_order_relaxed),
+				m_SampleTime.load(std::memory_order_relaxed)
+			};
+		}
 
-		//! The ID of the parent scope
-		ScopeID ParentScope;
+		//!
+		//! Get the counted scope
+		//!
+		inline ScopeID GetScope(void) const
+		{
+			return m_Scope;
+		}
 
-		//! The ID of the scope
-		ScopeID Scope;
+		//!
+		//! Offset the counted scope ID. Used when merging shared data.
+		//!
+		inline void OffsetScope(ScopeID offset)
+		{
+			m_Scope += offset;
+		}
 
-		//! Thread ID
-		ThreadID Thread;
+	private:
 
-		//! Start point
-		TimePoint Start;
+		//! Number of calls
+		std::atomic< uint64_t > m_Count;
 
-		//! End point
-		TimePoint End;
+		//! Number of timed calls
+		std::atomic< uint64_t > m_SampleCount;
 
-	};
+		//! Total time of the timed calls, in nanoseconds
+		std::atomic< uint64_t > m_SampleTime;
 
-	//!
-	//! Structure used to register per-thread marker lists to the global markers one.
-	//!
-	struct MarkerList
-	{
+		//! The counted scope
+		ScopeID m_Scope;
 
-		//!
-		//! Constructor. This will allocate a vector of MarkerData, and register it
-		//! to the global list of marker lists
-		//!
-		inline MarkerList(void)
-			: List(new Vector< MarkerData >())
-		{
-			List->reserve(10000000);
-			ScopedLock< Mutex > lock(Data->MarkerMutex);
-			Data->MarkerLists.push_back(List);
-		}
+		//! Sampling period
+		uint32_t m_Period;
 
-		//! The marker list
-		Vector< MarkerData > * List;
+		//! Number of calls until the next timed one
+		uint32_t m_Countdown;
 
 	};
 
@@ -229,24 +1142,113 @@ namespace Profiler
 	}
 
 	//!
-	//! Clear the profiler data
+	//! Clear the profiler data. Retired marker lists are recycled.
 	//!
 	inline void Clear(void)
 	{
-		for (auto * markers : Data->MarkerLists)
+		ScopedLock< Mutex > lock(Data->MarkerMutex);
+		size_t count = 0;
+		for (auto * buffer : Data->MarkerLists)
+		{
+			buffer->List.clear();
+			buffer->Arguments.clear();
+			buffer->MemorySamples.clear();
+			if (buffer->Retired == true)
+			{
+				Data->FreeLists.push_back(buffer);
+			}
+			else
+			{
+				Data->MarkerLists[count++] = buffer;
+			}
+		}
+		Data->MarkerLists.resize(count);
+
+		// reset the counters
+		Data->RetiredCounters.clear();
+		for (Counter * counter : Data->Counters)
+		{
+			counter->Reset();
+		}
+
+		// reset the allocation statistics. Live bytes are kept, since they're still allocated
+		for (ScopeID scope = 0; scope < Data->Scopes.GetSize(); ++scope)
 		{
-			markers->clear();
+			Data->Scopes[scope].Memory.Allocations		= 0;
+			Data->Scopes[scope].Memory.AllocatedBytes	= 0;
 		}
 	}
 
+	//!
+	//! Intern a string, and return its ID. This doesn't lock.
+	//!
+	inline StringID Intern(const char * string, size_t size)
+	{
+		return Data->Strings.Intern(string, size);
+	}
+
+	//!
+	//! Intern a string, and return its ID. This doesn't lock.
+	//!
+	inline StringID Intern(const char * string)
+	{
+		return Data->Strings.Intern(string, strlen(string));
+	}
+
+	//!
+	//! Intern a string, and return its ID. This doesn't lock.
+	//!
+	inline StringID Intern(const String & string)
+	{
+		return Data->Strings.Intern(string.data(), string.size());
+	}
+
+	//!
+	//! Register a new scope. This doesn't lock: the name and filename are interned, and
+	//! the scope data is appended to a lock-free vector.
+	//!
+	inline ScopeID RegisterScope(StringID name, StringID filename, uint32_t line)
+	{
+		ScopeID scope = Data->Scopes.Allocate();
+		ScopeData & data	= Data->Scopes[scope];
+		data.Name			= Data->Strings.Get(name);
+		data.Filename		= Data->Strings.Get(filename);
+		data.Line			= line;
+		Data->Scopes.Publish(scope);
+		return scope;
+	}
+
 	//!
 	//! Register a new scope
 	//!
-	inline ScopeID RegisterScope(String && name, String && filename, uint32_t line)
+	template< typename NameType >
+	inline ScopeID RegisterScope(const NameType & name, const char * filename, uint32_t line)
+	{
+		return RegisterScope(Intern(name), Intern(filename), line);
+	}
+
+	//!
+	//! Get the scope used to profile a dynamically named scope. Scopes are shared by name:
+	//! the first use of a name registers its scope, next ones only cost a string table
+	//! lookup. See #PROFILE_DYNAMIC_SCOPE
+	//!
+	template< typename NameType >
+	inline ScopeID GetDynamicScope(const NameType & name, const char * filename, uint32_t line)
 	{
-		ScopedLock< Mutex > lock(Data->ScopeMutex);
-		Data->Scopes.push_back({ name, filename, line });
-		return static_cast< ScopeID >(Data->Scopes.size() - 1);
+		StringTable::Entry * entry = Data->Strings.GetEntry(Intern(name));
+		if (entry == nullptr)
+		{
+			static const ScopeID overflow = RegisterScope("<profiler string table full>", __FILE__, __LINE__);
+			return overflow;
+		}
+		ScopeID scope = entry->Scope.load(std::memory_order_acquire);
+		if (scope == static_cast< ScopeID >(-1))
+		{
+			// if another thread registered it first, our scope is just never used
+			ScopeID registered = RegisterScope(entry->Value, filename, line);
+			scope = entry->Scope.compare_exchange_strong(scope, registered, std::memory_order_acq_rel) == true ? registered : scope;
+		}
+		return scope;
 	}
 
 	//!
@@ -264,16 +1266,20 @@ namespace Profiler
 			: m_Enabled(Data->Started)
 			, m_ParentScope(CurrentScope)
 			, m_Scope(scope)
+#if PROFILER_MAX_ARGUMENTS > 0
+			, m_ArgumentCount(0)
+#endif
+			, m_Previous(CurrentProfile)
 		{
 			// if we're not enabled, do not waste time
 			if (m_Enabled == true)
 			{
-				m_Thread	= GetCurrentThreadID();
-				m_Start		= GetCurrentTime();
+				m_Start = GetCurrentTime();
 			}
 
 			// update current scope
 			CurrentScope = scope;
+			CurrentProfile = this;
 		}
 
 		//!
@@ -281,20 +1287,88 @@ namespace Profiler
 		//!
 		inline ~ProfileScope(void)
 		{
-			// add the marker
-			if (m_Enabled == true)
+			// add the marker, unless the thread's marker list is already destroyed
+			MarkerBuffer * buffer = m_Enabled == true ? Markers.Buffer : nullptr;
+			if (buffer != nullptr)
 			{
-				Markers.List->push_back({
+				TimePoint end = GetCurrentTime();
+
+				// and its arguments
+				uint32_t firstArgument = static_cast< uint32_t >(-1);
+#if PROFILER_MAX_ARGUMENTS > 0
+				if (m_ArgumentCount > 0)
+				{
+					firstArgument = static_cast< uint32_t >(buffer->Arguments.size());
+					for (uint8_t i = 0; i < m_ArgumentCount; ++i)
+					{
+						m_Arguments[i].Count = m_ArgumentCount;
+						buffer->Arguments.push_back(m_Arguments[i]);
+					}
+				}
+#endif
+
+				buffer->List.push_back({
 					m_ParentScope,
 					m_Scope,
-					m_Thread,
+					firstArgument,
 					m_Start,
-					GetCurrentTime()
+					end
 				});
 			}
 
 			// restore the previous scope
 			CurrentScope = m_ParentScope;
+			CurrentProfile = m_Previous;
+		}
+
+#if PROFILER_MAX_ARGUMENTS > 0
+
+		//!
+		//! Attach a numerical argument to the scope
+		//!
+		template< typename Type >
+		inline void AddArgument(StringID name, Type value)
+		{
+			static_assert(std::is_arithmetic< Type >::value, "Only numerical arguments are supported, use AddStringArgument for strings");
+			if (m_Enabled == true && m_ArgumentCount < PROFILER_MAX_ARGUMENTS)
+			{
+				ArgumentData & argument = m_Arguments[m_ArgumentCount++];
+				argument.Name = name;
+				if (std::is_floating_point< Type >::value == true)
+				{
+					argument.Type = ArgumentType::Double;
+					argument.Double = static_cast< double >(value);
+				}
+				else
+				{
+					argument.Type = ArgumentType::Integer;
+					argument.Integer = static_cast< int64_t >(value);
+				}
+			}
+		}
+
+		//!
+		//! Attach an interned string argument to the scope
+		//!
+		inline void AddStringArgument(StringID name, StringID value)
+		{
+			if (m_Enabled == true && m_ArgumentCount < PROFILER_MAX_ARGUMENTS)
+			{
+				ArgumentData & argument = m_Arguments[m_ArgumentCount++];
+				argument.Name = name;
+				argument.Type = ArgumentType::String;
+				argument.String = value;
+			}
+		}
+
+#endif
+
+		//!
+		//! Check if the profiler was started when the scope was entered
+		//!
+		inline bool IsEnabled(void) const
+		{
+			return m_Enabled;
 		}
 
 	private:
@@ -308,14 +1382,151 @@ namespace Profiler
 		//! Scope ID
 		ScopeID m_Scope;
 
-		//! Thread ID
-		ThreadID m_Thread;
+		//! Starting point
+		TimePoint m_Start;
+
+#if PROFILER_MAX_ARGUMENTS > 0
+
+		//! Number of arguments
+		uint8_t m_ArgumentCount;
+
+		//! The arguments
+		ArgumentData m_Arguments[PROFILER_MAX_ARGUMENTS];
+
+#endif
+
+		//! The previous innermost profiled scope
+		ProfileScope * m_Previous;
+
+	};
+
+	//!
+	//! Scope based counter which times one call every N calls. See #PROFILE_COUNT_SCOPE_SAMPLED
+	//!
+	class SampledCountScope
+	{
+
+	public:
+
+		//!
+		//! Constructor
+		//!
+		inline SampledCountScope(Counter & counter)
+			: m_Counter(counter.Increment() == true ? &counter : nullptr)
+		{
+			if (m_Counter != nullptr)
+			{
+				m_Start = GetCurrentTime();
+			}
+		}
+
+		//!
+		//! Destructor
+		//!
+		inline ~SampledCountScope(void)
+		{
+			if (m_Counter != nullptr)
+			{
+				m_Counter->AddSample(GetNanoSeconds(m_Start, GetCurrentTime()));
+			}
+		}
+
+	private:
+
+		//! The counter, nullptr if this call is not timed
+		Counter * m_Counter;
 
 		//! Starting point
 		TimePoint m_Start;
 
 	};
 
+	//! Tag of the allocations made while no scope was active (see #OnAllocation)
+	const uint32_t UnscopedMemory = static_cast< uint32_t >(-2);
+
+	//!
+	//! Get the per-thread flag used to ignore the allocations made by the memory hooks
+	//! themselves (growing the samples, or creating the thread's marker list)
+	//!
+	inline bool & GetMemoryHookGuard(void)
+	{
+		static thread_local bool guard = false;
+		return guard;
+	}
+
+	//!
+	//! Record a sample of the tracked memory in the current thread's marker buffer
+	//!
+	inline void AddMemorySample(int64_t bytes)
+	{
+		MarkerBuffer * buffer = Data->Started == true ? Markers.Buffer : nullptr;
+		if (buffer != nullptr)
+		{
+			buffer->MemorySamples.push_back({ GetCurrentTime(), bytes });
+		}
+	}
+
+	//!
+	//! MemoryTracker hook charging an allocation to the innermost profiled scope of the
+	//! calling thread. Use with `MT_SET_HOOKS(Profiler::OnAllocation, Profiler::OnDeallocation)`
+	//!
+	//! @return
+	//!		The charged scope, which the tracker gives back to #OnDeallocation. #UnscopedMemory
+	//!		if no scope is active, and -1 if the allocation wasn't accounted at all (made by
+	//!		the profiler itself)
+	//!
+	inline uint32_t OnAllocation(size_t bytes)
+	{
+		bool & guard = GetMemoryHookGuard();
+		if (guard == true)
+		{
+			return static_cast< uint32_t >(-1);
+		}
+		guard = true;
+		ScopeID scope = CurrentScope;
+		if (scope == static_cast< ScopeID >(-1))
+		{
+			scope = UnscopedMemory;
+		}
+		else
+		{
+			ScopeMemory & memory = Data->Scopes[scope].Memory;
+			memory.Allocations.fetch_add(1, std::memory_order_relaxed);
+			memory.AllocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+			memory.LiveBytes.fetch_add(static_cast< int64_t >(bytes), std::memory_order_relaxed);
+		}
+		AddMemorySample(Data->TrackedMemory.fetch_add(static_cast< int64_t >(bytes), std::memory_order_relaxed) + static_cast< int64_t >(bytes));
+		guard = false;
+		return scope;
+	}
+
+	//!
+	//! MemoryTracker hook releasing a deallocation from the scope which made the allocation
+	//!
+	inline void OnDeallocation(uint32_t scope, size_t bytes)
+	{
+		bool & guard = GetMemoryHookGuard();
+		if (guard == true || scope == static_cast< uint32_t >(-1))
+		{
+			return;
+		}
+		guard = true;
+		if (scope != UnscopedMemory)
+		{
+			Data->Scopes[scope].Memory.LiveBytes.fetch_sub(static_cast< int64_t >(bytes), std::memory_order_relaxed);
+		}
+		AddMemorySample(Data->TrackedMemory.fetch_sub(static_cast< int64_t >(bytes), std::memory_order_relaxed) - static_cast< int64_t >(bytes));
+		guard = false;
+	}
+
+#else // PROFILER_ENABLE == 0
+
+	//! Stub of the allocation hook, so that MT_SET_HOOKS doesn't depend on the profiler's state
+	inline uint32_t OnAllocation(size_t) { return 0; }
+
+	//! Stub of the deallocation hook
+	inline void OnDeallocation(uint32_t, size_t) {}
+
 #endif // PROFILER_ENABLE == 1
 
 
@@ -370,6 +1581,82 @@ namespace Profiler
 	static const Profiler::ScopeID PRIVATE_MERGE(_scope_id_, __LINE__) = Profiler::RegisterScope(name, __FILE__, __LINE__);	\
 	Profiler::ProfileScope PRIVATE_MERGE(_profile_, __LINE__)(PRIVATE_MERGE(_scope_id_, __LINE__))
 
+//!
+//! @def PROFILE_DYNAMIC_SCOPE(name)
+//!
+//! Same as #PROFILE_SCOPE, but the name can change at runtime (for instance a
+//! `std::string` containing a tenant or a query type) Scopes are shared by name,
+//! and finding a scope from its name is a lock-free string table lookup.
+//!
+#define PROFILE_DYNAMIC_SCOPE(name)																							\
+	Profiler::ProfileScope PRIVATE_MERGE(_profile_, __LINE__)(Profiler::GetDynamicScope(name, __FILE__, __LINE__))
+
+#if PROFILER_MAX_ARGUMENTS > 0
+
+//!
+//! @def PROFILE_ARG(name, value)
+//!
+//! Attach a numerical argument (integer or floating point) to the innermost profiled
+//! scope. For instance `PROFILE_ARG("size", payload.size());` The argument is stored
+//! along with the marker without any allocation, and is output by Profiler::Output
+//! functions.
+//!
+#define PROFILE_ARG(name, value)																		\
+	do																									\
+	{																									\
+		static const Profiler::StringID PRIVATE_MERGE(_arg_name_, __LINE__) = Profiler::Intern(name);	\
+		if (Profiler::CurrentProfile != nullptr)														\
+		{																								\
+			Profiler::CurrentProfile->AddArgument(PRIVATE_MERGE(_arg_name_, __LINE__), value);			\
+		}																								\
+	} while (false)
+
+//!
+//! @def PROFILE_ARG_STRING(name, value)
+//!
+//! Same as #PROFILE_ARG, for string values. Note that the value is interned, which
+//! means a lookup in the profiler's string table.
+//!
+#define PROFILE_ARG_STRING(name, value)																					\
+	do																													\
+	{																													\
+		static const Profiler::StringID PRIVATE_MERGE(_arg_name_, __LINE__) = Profiler::Intern(name);					\
+		if (Profiler::CurrentProfile != nullptr && Profiler::CurrentProfile->IsEnabled() == true)						\
+		{																												\
+			Profiler::CurrentProfile->AddStringArgument(PRIVATE_MERGE(_arg_name_, __LINE__), Profiler::Intern(value));	\
+		}																												\
+	} while (false)
+
+#else
+
+#	define PROFILE_ARG(name, value)			(void)0
+#	define PROFILE_ARG_STRING(name, value)	(void)0
+
+#endif
+
+//!
+//! @def PROFILE_COUNT_SCOPE(name)
+//!
+//! Count the calls to the current scope, without recording any marker. This only
+//! increments a per-thread counter, and is meant for scopes called too often to
+//! be profiled with #PROFILE_SCOPE. Counts are merged in the CSV output.
+//!
+#define PROFILE_COUNT_SCOPE(name)																							\
+	static const Profiler::ScopeID PRIVATE_MERGE(_scope_id_, __LINE__) = Profiler::RegisterScope(name, __FILE__, __LINE__);	\
+	static thread_local Profiler::Counter PRIVATE_MERGE(_counter_, __LINE__)(PRIVATE_MERGE(_scope_id_, __LINE__), 0);		\
+	PRIVATE_MERGE(_counter_, __LINE__).Increment()
+
+//!
+//! @def PROFILE_COUNT_SCOPE_SAMPLED(name, period)
+//!
+//! Same as #PROFILE_COUNT_SCOPE, but also time one call every @a period calls. The
+//! CSV output then estimates the total time of the scope from those samples.
+//!
+#define PROFILE_COUNT_SCOPE_SAMPLED(name, period)																			\
+	static const Profiler::ScopeID PRIVATE_MERGE(_scope_id_, __LINE__) = Profiler::RegisterScope(name, __FILE__, __LINE__);	\
+	static thread_local Profiler::Counter PRIVATE_MERGE(_counter_, __LINE__)(PRIVATE_MERGE(_scope_id_, __LINE__), period);	\
+	Profiler::SampledCountScope PRIVATE_MERGE(_count_, __LINE__)(PRIVATE_MERGE(_counter_, __LINE__))
+
 //!
 //! Private macro used to merge 2 values.
 //!
@@ -384,11 +1671,16 @@ namespace Profiler
 #else // PROFILER_ENABLE == 0
 
 
-#	define PROFILER_START()			(void)0
-#	define PROFILER_STOP()			(void)0
-#	define PROFILER_CLEAR()			(void)0
-#	define PROFILE_FUNCTION()		(void)0
-#	define PROFILE_SCOPE(name)		(void)0
+#	define PROFILER_START()								(void)0
+#	define PROFILER_STOP()								(void)0
+#	define PROFILER_CLEAR()								(void)0
+#	define PROFILE_FUNCTION()							(void)0
+#	define PROFILE_SCOPE(name)							(void)0
+#	define PROFILE_DYNAMIC_SCOPE(name)					(void)0
+#	define PROFILE_ARG(name, value)						(void)0
+#	define PROFILE_ARG_STRING(name, value)				(void)0
+#	define PROFILE_COUNT_SCOPE(name)					(void)0
+#	define PROFILE_COUNT_SCOPE_SAMPLED(name, period)	(void)0
 
 
 #endif // PROFILER_ENABLE
@@ -404,9 +1696,11 @@ namespace Profiler
 
 
 //!
-//! If @a PROFILER_IMPLEMENTATION is defined, define data.
+//! If @a PROFILER_IMPLEMENTATION is defined, define data. This is done once, even if the
+//! header is included again through other headers (TaskManager.h, etc.)
 //!
-#if defined(PROFILER_IMPLEMENTATION) && PROFILER_ENABLE == 1
+#if defined(PROFILER_IMPLEMENTATION) && PROFILER_ENABLE == 1 && !defined(PROFILER_IMPLEMENTATION_DEFINED)
+#define PROFILER_IMPLEMENTATION_DEFINED
 
 namespace Profiler
 {
@@ -415,6 +1709,7 @@ namespace Profiler
 	SharedData *				Data			= &_Data;
 	thread_local MarkerList		Markers;
 	thread_local ScopeID		CurrentScope	= static_cast< ScopeID >(-1);
+	thread_local ProfileScope *	CurrentProfile	= nullptr;
 
 	void SetSharedData(SharedData * data)
 	{
@@ -426,29 +1721,97 @@ namespace Profiler
 		// override the data
 		Data = data;
 
+		// intern our strings in the new table, and remember their new IDs
+		Vector< StringID > strings(_Data.Strings.GetCapacity(), StringTable::Invalid);
+		for (StringID id = 0; id < _Data.Strings.GetCapacity(); ++id)
+		{
+			if (_Data.Strings.GetEntry(id) != nullptr)
+			{
+				strings[id] = Intern(_Data.Strings.GetEntry(id)->Value);
+			}
+		}
+
+		// append our scopes, pointing to the new strings
+		uint32_t scopeCount = _Data.Scopes.GetSize();
+		ScopeID scopeOffset = scopeCount > 0 ? Data->Scopes.Allocate(scopeCount) : Data->Scopes.GetSize();
+		for (ScopeID id = 0; id < scopeCount; ++id)
+		{
+			// registrations of the local instance still in progress are waited for, this only
+			// happens once, when attaching to the shared instance
+			while (_Data.Scopes.IsPublished(id) == false)
+			{
+				std::this_thread::yield();
+			}
+			const ScopeData & scope = _Data.Scopes[id];
+			ScopeData & data	= Data->Scopes[scopeOffset + id];
+			data.Name			= Data->Strings.Get(Intern(scope.Name != nullptr ? scope.Name : ""));
+			data.Filename		= Data->Strings.Get(Intern(scope.Filename != nullptr ? scope.Filename : ""));
+			data.Line			= scope.Line;
+			data.Memory.Allocations		= scope.Memory.Allocations.load();
+			data.Memory.AllocatedBytes	= scope.Memory.AllocatedBytes.load();
+			data.Memory.LiveBytes		= scope.Memory.LiveBytes.load();
+		}
+		if (scopeCount > 0)
+		{
+			Data->Scopes.Publish(scopeOffset, scopeCount);
+		}
+
+		// keep our dynamic scopes
+		for (StringID id = 0; id < _Data.Strings.GetCapacity(); ++id)
+		{
+			StringTable::Entry * entry = _Data.Strings.GetEntry(id);
+			ScopeID scope = entry != nullptr ? entry->Scope.load(std::memory_order_acquire) : static_cast< ScopeID >(-1);
+			if (scope != static_cast< ScopeID >(-1) && strings[id] != StringTable::Invalid)
+			{
+				ScopeID none = static_cast< ScopeID >(-1);
+				Data->Strings.GetEntry(strings[id])->Scope.compare_exchange_strong(none, scope + scopeOffset);
+			}
+		}
+
 		// merge marker lists
 		{
 			ScopedLock< Mutex > lock(Data->MarkerMutex);
 
 			// remap the markers' scope IDs
-			ScopeID scopeOffset = static_cast< ScopeID >(Data->Scopes.size());
-			for (Vector< MarkerData > * markers : _Data.MarkerLists)
+			for (MarkerBuffer * buffer : _Data.MarkerLists)
 			{
-				for (MarkerData & marker : *markers)
+				for (MarkerData & marker : buffer->List)
 				{
 					marker.Scope += scopeOffset;
-					marker.ParentScope += scopeOffset;
+					if (marker.ParentScope != static_cast< ScopeID >(-1))
+					{
+						marker.ParentScope += scopeOffset;
+					}
+				}
+				buffer->ThreadIndex += Data->ThreadCount;
+
+				// and the arguments' string IDs
+				for (ArgumentData & argument : buffer->Arguments)
+				{
+					argument.Name = strings[argument.Name];
+					if (argument.Type == ArgumentType::String)
+					{
+						argument.String = strings[argument.String];
+					}
 				}
 			}
 
-			// add the markers
-			Data->MarkerLists.insert(Data->MarkerLists.end(), _Data.MarkerLists.begin(), _Data.MarkerLists.end());
-		}
+			// remap the counters
+			for (Counter * counter : _Data.Counters)
+			{
+				counter->OffsetScope(scopeOffset);
+			}
+			if (Data->RetiredCounters.size() < scopeOffset)
+			{
+				Data->RetiredCounters.resize(scopeOffset, CounterValues{ 0, 0, 0 });
+			}
 
-		// merge scopes
-		{
-			ScopedLock< Mutex > lock(Data->ScopeMutex);
-			Data->Scopes.insert(Data->Scopes.end(), _Data.Scopes.begin(), _Data.Scopes.end());
+			// add the markers, the counters and the free lists
+			Data->Counters.insert(Data->Counters.end(), _Data.Counters.begin(), _Data.Counters.end());
+			Data->RetiredCounters.insert(Data->RetiredCounters.end(), _Data.RetiredCounters.begin(), _Data.RetiredCounters.end());
+			Data->MarkerLists.insert(Data->MarkerLists.end(), _Data.MarkerLists.begin(), _Data.MarkerLists.end());
+			Data->FreeLists.insert(Data->FreeLists.end(), _Data.FreeLists.begin(), _Data.FreeLists.end());
+			Data->ThreadCount += _Data.ThreadCount;
 		}
 	}
 
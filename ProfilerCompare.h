@@ -0,0 +1,464 @@
+#ifndef PROFILER_COMPARE_H
+#define PROFILER_COMPARE_H
+
+
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <vector>
+
+
+//!
+//! Comparison of 2 profiling captures, to detect performance regressions (for instance between
+//! 2 nightly benchmark runs) A capture is either a raw output (see Output::Raw) or a summary of
+//! one (see Summarize) which is much smaller to archive. Scopes are matched by name. This
+//! doesn't use the live profiler, so it's available even when it's disabled.
+//!
+namespace Profiler
+{
+	namespace Compare
+	{
+
+		//! Header of the summary files
+		static const char * SummaryHeader = "name;count;mean;variance;p99;exclusive";
+
+		//!
+		//! Statistics of a scope in a capture. Times are in nanoseconds.
+		//!
+		struct ScopeStatistics
+		{
+			//! Number of markers
+			uint64_t Count;
+
+			//! Average duration
+			double Mean;
+
+			//! Unbiased variance of the durations
+			double Variance;
+
+			//! 99th percentile of the durations
+			uint64_t P99;
+
+			//! Total exclusive time
+			uint64_t Exclusive;
+		};
+
+		//! The statistics of a capture, indexed by scope name
+		typedef std::map< String, ScopeStatistics > Capture;
+
+		//!
+		//! Read a binary value written by Output::Write
+		//!
+		template< typename T > inline bool Read(std::ifstream & file, T & value)
+		{
+			return file.read(reinterpret_cast< char * >(&value), sizeof(T)).good();
+		}
+
+		//!
+		//! Override for strings
+		//!
+		template<> inline bool Read(std::ifstream & file, String & value)
+		{
+			uint64_t size = 0;
+			if (Read(file, size) == false)
+			{
+				return false;
+			}
+			value.resize(size);
+			return size == 0 || file.read(&value[0], size).good();
+		}
+
+		//!
+		//! Load a raw capture (see Output::Raw) Captures with another format are rejected.
+		//!
+		inline bool LoadRaw(const String & filename, Capture & capture)
+		{
+			std::ifstream file(filename, std::ios::binary | std::ios::in);
+			RawHeader header;
+			uint32_t scopeCount = 0;
+			if (file.is_open() == false || Read(file, header) == false)
+			{
+				return false;
+			}
+			if (header.Magic != RawMagic || header.Version != RawVersion || header.MarkerSize != sizeof(RawMarker) || header.ArgumentSize != sizeof(RawArgument))
+			{
+				return false;
+			}
+			if (Read(file, scopeCount) == false)
+			{
+				return false;
+			}
+
+			// scope names
+			std::vector< String > names(scopeCount);
+			for (uint32_t id = 0; id < scopeCount; ++id)
+			{
+				String scopeFilename;
+				uint32_t line = 0;
+				if (Read(file, scopeFilename) == false || Read(file, names[id]) == false || Read(file, line) == false)
+				{
+					return false;
+				}
+			}
+
+			// strings are only used by arguments
+			uint32_t stringCount = 0;
+			if (Read(file, stringCount) == false)
+			{
+				return false;
+			}
+			for (uint32_t i = 0; i < stringCount; ++i)
+			{
+				uint32_t id = 0;
+				String string;
+				if (Read(file, id) == false || Read(file, string) == false)
+				{
+					return false;
+				}
+			}
+
+			// durations and exclusive times of the markers. The markers of a thread are ordered by end
+			// time, so the children of a marker are the not yet claimed previous markers which started
+			// after it did.
+			uint64_t listCount = 0;
+			if (Read(file, listCount) == false)
+			{
+				return false;
+			}
+			std::vector< std::vector< uint64_t > > durations(scopeCount);
+			std::vector< uint64_t > exclusive(scopeCount, 0);
+			std::vector< RawMarker > markers;
+			std::vector< std::pair< int64_t, uint64_t > > unclaimed;
+			for (uint64_t list = 0; list < listCount; ++list)
+			{
+				uint32_t threadIndex = 0;
+				uint64_t markerCount = 0;
+				uint64_t argumentCount = 0;
+				if (Read(file, threadIndex) == false || Read(file, markerCount) == false)
+				{
+					return false;
+				}
+				markers.resize(markerCount);
+				if (markerCount != 0 && file.read(reinterpret_cast< char * >(markers.data()), markerCount * sizeof(RawMarker)).good() == false)
+				{
+					return false;
+				}
+				if (Read(file, argumentCount) == false || file.seekg(argumentCount * sizeof(RawArgument), std::ios::cur).good() == false)
+				{
+					return false;
+				}
+
+				unclaimed.clear();
+				for (const auto & marker : markers)
+				{
+					if (marker.Scope >= scopeCount)
+					{
+						return false;
+					}
+					uint64_t ns = marker.End > marker.Start ? static_cast< uint64_t >(marker.End - marker.Start) : 0;
+					uint64_t children = 0;
+					while (unclaimed.empty() == false && unclaimed.back().first >= marker.Start)
+					{
+						children += unclaimed.back().second;
+						unclaimed.pop_back();
+					}
+					unclaimed.push_back({ marker.Start, ns });
+					durations[marker.Scope].push_back(ns);
+					exclusive[marker.Scope] += ns > children ? ns - children : 0;
+				}
+			}
+
+			// compute the statistics. Scopes sharing a name are merged.
+			capture.clear();
+			std::map< String, std::vector< uint64_t > > merged;
+			std::map< String, uint64_t > mergedExclusive;
+			for (uint32_t id = 0; id < scopeCount; ++id)
+			{
+				if (durations[id].empty() == false)
+				{
+					std::vector< uint64_t > & values = merged[names[id]];
+					values.insert(values.end(), durations[id].begin(), durations[id].end());
+					mergedExclusive[names[id]] += exclusive[id];
+				}
+			}
+			for (auto & entry : merged)
+			{
+				std::vector< uint64_t > & values = entry.second;
+				std::sort(values.begin(), values.end());
+				double mean = 0.0;
+				for (uint64_t value : values)
+				{
+					mean += double(value) / double(values.size());
+				}
+				double variance = 0.0;
+				for (uint64_t value : values)
+				{
+					variance += (double(value) - mean) * (double(value) - mean);
+				}
+				variance = values.size() > 1 ? variance / double(values.size() - 1) : 0.0;
+				size_t rank = size_t(std::ceil(0.99 * double(values.size())));
+				capture[entry.first] = ScopeStatistics{ values.size(), mean, variance, values[rank > 0 ? rank - 1 : 0], mergedExclusive[entry.first] };
+			}
+			return true;
+		}
+
+		//!
+		//! Load a summary (see Summarize)
+		//!
+		inline bool LoadSummary(const String & filename, Capture & capture)
+		{
+			std::ifstream file(filename);
+			String line;
+			if (std::getline(file, line).good() == false || line != SummaryHeader)
+			{
+				return false;
+			}
+			capture.clear();
+			while (std::getline(file, line))
+			{
+				if (line.empty() == true)
+				{
+					continue;
+				}
+
+				// the name can contain separators, so values are parsed from the end
+				ScopeStatistics statistics;
+				size_t end = line.size();
+				double values[5];
+				for (int i = 4; i >= 0; --i)
+				{
+					size_t separator = end > 0 ? line.rfind(';', end - 1) : String::npos;
+					if (separator == String::npos)
+					{
+						return false;
+					}
+					values[i] = std::strtod(line.c_str() + separator + 1, nullptr);
+					end = separator;
+				}
+				statistics.Count		= uint64_t(values[0]);
+				statistics.Mean			= values[1];
+				statistics.Variance		= values[2];
+				statistics.P99			= uint64_t(values[3]);
+				statistics.Exclusive	= uint64_t(values[4]);
+				capture[line.substr(0, end)] = statistics;
+			}
+			return true;
+		}
+
+		//!
+		//! Load a capture, either raw or a summary
+		//!
+		inline bool Load(const String & filename, Capture & capture)
+		{
+			return LoadSummary(filename, capture) == true || LoadRaw(filename, capture) == true;
+		}
+
+		//!
+		//! Write the summary of a raw capture, to archive it or compare it later.
+		//!
+		inline bool Summarize(const String & rawFilename, const String & filename)
+		{
+			Capture capture;
+			if (Load(rawFilename, capture) == false)
+			{
+				return false;
+			}
+			std::ofstream file(filename);
+			file.precision(17);
+			file << SummaryHeader << std::endl;
+			for (const auto & entry : capture)
+			{
+				const ScopeStatistics & statistics = entry.second;
+				file << entry.first <<
+					";" << statistics.Count <<
+					";" << statistics.Mean <<
+					";" << statistics.Variance <<
+					";" << statistics.P99 <<
+					";" << statistics.Exclusive <<
+					std::endl;
+			}
+			return file.good();
+		}
+
+		//!
+		//! Regularized incomplete beta function, evaluated with its continued fraction (modified Lentz)
+		//!
+		inline double IncompleteBeta(double a, double b, double x)
+		{
+			if (x <= 0.0 || x >= 1.0)
+			{
+				return x <= 0.0 ? 0.0 : 1.0;
+			}
+
+			// the continued fraction converges quickly for x < (a + 1) / (a + b + 2), use the symmetry otherwise
+			if (x > (a + 1.0) / (a + b + 2.0))
+			{
+				return 1.0 - IncompleteBeta(b, a, 1.0 - x);
+			}
+
+			const double tiny = 1e-300;
+			double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1.0 - x)) / a;
+			double f = 1.0;
+			double c = 1.0;
+			double d = 0.0;
+			for (int i = 0; i <= 400; ++i)
+			{
+				int m = i / 2;
+				double numerator;
+				if (i == 0)
+				{
+					numerator = 1.0;
+				}
+				else if (i % 2 == 0)
+				{
+					numerator = (m * (b - m) * x) / ((a + 2.0 * m - 1.0) * (a + 2.0 * m));
+				}
+				else
+				{
+					numerator = -((a + m) * (a + b + m) * x) / ((a + 2.0 * m) * (a + 2.0 * m + 1.0));
+				}
+				d = 1.0 + numerator * d;
+				d = 1.0 / (std::fabs(d) < tiny ? tiny : d);
+				c = 1.0 + numerator / c;
+				c = std::fabs(c) < tiny ? tiny : c;
+				f *= c * d;
+				if (std::fabs(1.0 - c * d) < 1e-10)
+				{
+					break;
+				}
+			}
+			return front * (f - 1.0);
+		}
+
+		//!
+		//! Welch's t-test of the mean durations of a scope in 2 captures.
+		//!
+		//! @return
+		//!		The two-sided p-value: the probability that the difference of the means is only noise.
+		//!
+		inline double WelchTest(const ScopeStatistics & baseline, const ScopeStatistics & current, double & t)
+		{
+			t = 0.0;
+			if (baseline.Count < 2 || current.Count < 2)
+			{
+				return 1.0;
+			}
+			double v1 = baseline.Variance / double(baseline.Count);
+			double v2 = current.Variance / double(current.Count);
+			if (v1 + v2 <= 0.0)
+			{
+				return baseline.Mean == current.Mean ? 1.0 : 0.0;
+			}
+			t = (current.Mean - baseline.Mean) / std::sqrt(v1 + v2);
+			double df = (v1 + v2) * (v1 + v2) / (v1 * v1 / double(baseline.Count - 1) + v2 * v2 / double(current.Count - 1));
+			return IncompleteBeta(0.5 * df, 0.5, df / (df + t * t));
+		}
+
+		//!
+		//! Get the relative change from @p baseline to @p current, 0 if the baseline is 0
+		//!
+		inline double GetChange(double baseline, double current)
+		{
+			return baseline != 0.0 ? (current - baseline) / baseline : 0.0;
+		}
+
+		//!
+		//! Format a number for JSON, which has no representation of NaN and infinities
+		//!
+		inline String GetJsonDouble(double value, int decimals)
+		{
+			return std::isfinite(value) == true ? Output::GetDouble(value, decimals) : "null";
+		}
+
+		//!
+		//! Result of a comparison
+		//!
+		enum class Result
+		{
+			//! No scope regressed
+			NoRegression,
+
+			//! At least a scope regressed
+			Regression,
+
+			//! A capture couldn't be loaded, or the diff couldn't be written
+			Error
+		};
+
+		//!
+		//! Compare 2 captures (raw or summaries) and write a per scope diff to a JSON file. A scope
+		//! regressed if its mean duration increased by more than @p threshold (relative) with a p-value
+		//! below @p alpha (see WelchTest)
+		//!
+		inline Result Compare(const String & baselineFilename, const String & currentFilename, const String & filename, double threshold = 0.05, double alpha = 0.05)
+		{
+			Capture baseline, current;
+			if (Load(baselineFilename, baseline) == false || Load(currentFilename, current) == false)
+			{
+				return Result::Error;
+			}
+
+			// get all the scope names
+			std::map< String, bool > names;
+			for (const auto & entry : baseline)
+			{
+				names[entry.first] = true;
+			}
+			for (const auto & entry : current)
+			{
+				names[entry.first] = true;
+			}
+
+			std::ofstream file(filename);
+			if (file.is_open() == false)
+			{
+				return Result::Error;
+			}
+			file << "{" << std::endl;
+			file << "\t\"threshold\": " << threshold << "," << std::endl;
+			file << "\t\"alpha\": " << alpha << "," << std::endl;
+			file << "\t\"scopes\": [";
+			bool first = true;
+			uint32_t regressions = 0;
+			const ScopeStatistics empty{ 0, 0.0, 0.0, 0, 0 };
+			for (const auto & entry : names)
+			{
+				auto a = baseline.find(entry.first);
+				auto b = current.find(entry.first);
+				const ScopeStatistics & before = a != baseline.end() ? a->second : empty;
+				const ScopeStatistics & after = b != current.end() ? b->second : empty;
+				double t = 0.0;
+				double p = WelchTest(before, after, t);
+				double change = GetChange(before.Mean, after.Mean);
+				bool regression = change > threshold && p < alpha;
+				regressions += regression == true ? 1 : 0;
+
+				file << (first == true ? "" : ",") << std::endl;
+				first = false;
+				file << "\t\t{ \"name\": " << Output::GetJsonString(entry.first) <<
+					", \"count\": [" << before.Count << ", " << after.Count << "]" <<
+					", \"mean\": [" << GetJsonDouble(before.Mean, 1) << ", " << GetJsonDouble(after.Mean, 1) << "]" <<
+					", \"p99\": [" << before.P99 << ", " << after.P99 << "]" <<
+					", \"exclusive\": [" << before.Exclusive << ", " << after.Exclusive << "]" <<
+					", \"mean_change\": " << GetJsonDouble(change, 4) <<
+					", \"p99_change\": " << GetJsonDouble(GetChange(double(before.P99), double(after.P99)), 4) <<
+					", \"exclusive_change\": " << GetJsonDouble(GetChange(double(before.Exclusive), double(after.Exclusive)), 4) <<
+					", \"t\": " << GetJsonDouble(t, 3) <<
+					", \"p\": " << GetJsonDouble(p, 6) <<
+					", \"regression\": " << (regression == true ? "true" : "false") << " }";
+			}
+			file << std::endl << "\t]," << std::endl;
+			file << "\t\"regressions\": " << regressions << std::endl;
+			file << "}" << std::endl;
+			return regressions > 0 ? Result::Regression : Result::NoRegression;
+		}
+
+	} // namespace Compare
+} // namespace Profiler
+
+
+#endif // PROFILER_COMPARE_H
@@ -2,9 +2,73 @@
 #define PROFILER_OUTPUT_H
 
 
+#include <cstdio>
 #include <string>
 
 
+//
+// formatting helpers, also used by the comparison of captures (see ProfilerCompare.h) which
+// doesn't depend on the profiler being enabled
+//
+namespace Profiler
+{
+	namespace Output
+	{
+
+		//!
+		//! Clamp to n decimals
+		//!
+		inline String GetDouble(double value, int decimals)
+		{
+			String string = std::to_string(value);
+			auto dot = string.find('.');
+			if (dot == String::npos)
+			{
+				return string;
+			}
+			size_t numDecimals = string.size() - 1 - dot;
+			return numDecimals > decimals ? string.substr(0, dot + decimals + 1) : string;
+		}
+
+		//!
+		//! Escape a string to be written in a JSON file
+		//!
+		inline String GetJsonString(const String & string)
+		{
+			String result;
+			result.reserve(string.size() + 2);
+			result += '"';
+			for (char c : string)
+			{
+				switch (c)
+				{
+					case '"':	result += "\\\"";	break;
+					case '\\':	result += "\\\\";	break;
+					case '\n':	result += "\\n";	break;
+					case '\r':	result += "\\r";	break;
+					case '\t':	result += "\\t";	break;
+					default:
+						if (static_cast< unsigned char >(c) < 0x20)
+						{
+							char code[8];
+							snprintf(code, sizeof(code), "\\u%04x", c);
+							result += code;
+						}
+						else
+						{
+							result += c;
+						}
+						break;
+				}
+			}
+			result += '"';
+			return result;
+		}
+
+	} // namespace Output
+} // namespace Profiler
+
+
 #if PROFILER_ENABLE == 0
 
 
@@ -13,9 +77,12 @@ namespace Profiler
 	namespace Output
 	{
 
-		inline void Raw(const std::string &)					{}
-		inline void CommaSeparatedValues(const std::string &)	{}
-		inline void ChromeTracing(const std::string &)			{}
+		inline void Raw(const std::string &)										{}
+		inline void CommaSeparatedValues(const std::string &)						{}
+		inline void CommaSeparatedValues(const std::string &, const std::string &)	{}
+		inline void CriticalPath(const std::string &)								{}
+		inline void Utilization(const std::string &, uint64_t = 0)					{}
+		inline void ChromeTracing(const std::string &, uint64_t = 0)				{}
 
 	} // namespace Output
 } // namespace Profiler
@@ -27,7 +94,13 @@ namespace Profiler
 #include <mutex>
 #include <fstream>
 #include <algorithm>
-#include <unordered_map>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <vector>
 
 
 namespace Profiler
@@ -56,25 +129,10 @@ namespace Profiler
 		//!
 		template<> inline void Write(std::ofstream & file, const String & data)
 		{
-			Write(file, data.size());
+			Write(file, static_cast< uint64_t >(data.size()));
 			file.write(data.data(), data.size());
 		}
 
-		//!
-		//! Clamp to n decimals
-		//!
-		inline String GetDouble(double value, int decimals)
-		{
-			String string = std::to_string(value);
-			auto dot = string.find('.');
-			if (dot == String::npos)
-			{
-				return string;
-			}
-			size_t numDecimals = string.size() - 1 - dot;
-			return numDecimals > decimals ? string.substr(0, dot + decimals + 1) : string;
-		}
-
 		//!
 		//! Get a more readable time from nanoseconds
 		//!
@@ -99,35 +157,355 @@ namespace Profiler
 		}
 
 		//!
-		//! Raw output
+		//! Find the argument named @p name of a marker. Returns nullptr if the marker doesn't have it.
+		//!
+		inline const ArgumentData * FindArgument(const MarkerBuffer & buffer, const MarkerData & marker, StringID name)
+		{
+			if (marker.FirstArgument == static_cast< uint32_t >(-1))
+			{
+				return nullptr;
+			}
+			const ArgumentData * arguments = buffer.Arguments.data() + marker.FirstArgument;
+			for (uint8_t i = 0, count = arguments[0].Count; i < count; ++i)
+			{
+				if (arguments[i].Name == name)
+				{
+					return arguments + i;
+				}
+			}
+			return nullptr;
+		}
+
+		//!
+		//! Get the group of an argument. Numerical values are bucketed by powers of 2,
+		//! strings are grouped by value. The first value of the returned pair is used
+		//! to sort numerical groups.
+		//!
+		inline std::pair< double, String > GetArgumentGroup(const ArgumentData & argument)
+		{
+			if (argument.Type == ArgumentType::String)
+			{
+				return { 0.0, Data->Strings.Get(argument.String) };
+			}
+
+			double value = argument.Type == ArgumentType::Integer ? double(argument.Integer) : argument.Double;
+			if ((value >= 1.0) == false)
+			{
+				return { 0.0, "< 1" };
+			}
+			double low = std::exp2(std::floor(std::log2(value)));
+			return { low, "[" + std::to_string(uint64_t(low)) + ", " + std::to_string(uint64_t(low * 2.0)) + ")" };
+		}
+
+		//!
+		//! Write the value of an argument to a JSON stream
+		//!
+		inline void WriteArgument(std::ofstream & file, const ArgumentData & argument)
+		{
+			file << GetJsonString(Data->Strings.Get(argument.Name)) << ": ";
+			switch (argument.Type)
+			{
+				case ArgumentType::Integer:
+					file << argument.Integer;
+					break;
+
+				case ArgumentType::Double:
+					if (std::isfinite(argument.Double) == true)
+					{
+						file << std::to_string(argument.Double);
+					}
+					else
+					{
+						file << "null";
+					}
+					break;
+
+				case ArgumentType::String:
+					file << GetJsonString(Data->Strings.Get(argument.String));
+					break;
+			}
+		}
+
+		//!
+		//! Get the values of the call counters of the live and exited threads, indexed by scope ID.
+		//! The marker mutex must be locked.
+		//!
+		inline std::vector< CounterValues > GetCounterValues(void)
+		{
+			std::vector< CounterValues > counters(Data->RetiredCounters.begin(), Data->RetiredCounters.end());
+			counters.resize(Data->Scopes.GetSize(), CounterValues{ 0, 0, 0 });
+			for (const Counter * counter : Data->Counters)
+			{
+				CounterValues values = counter->GetValues();
+				CounterValues & total = counters[counter->GetScope()];
+				total.Count			+= values.Count;
+				total.SampleCount	+= values.SampleCount;
+				total.SampleTime	+= values.SampleTime;
+			}
+			return counters;
+		}
+
+		//!
+		//! Raw output. The capture starts with a RawHeader, and can be compared with others
+		//! (see Compare::Compare)
 		//!
 		inline void Raw(const String & filename)
 		{
-			// first, ensure that nobody else is modifying the profiling data
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
 			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
-			ScopedLock< Mutex > lockScopes(Data->ScopeMutex);
 
 			// open the output file
 			std::ofstream file(filename, std::ios::binary | std::ios::out);
 
-			// Write the start time
-			Write(file, Data->StartTime);
+			// write the header
+			RawHeader header = { RawMagic, RawVersion, sizeof(RawMarker), sizeof(RawArgument), GetRawTime(Data->StartTime) };
+			Write(file, header);
+
+			// write the scopes. Scopes still being registered by another thread are written empty,
+			// no marker references them yet.
+			uint32_t scopeCount = Data->Scopes.GetSize();
+			Write(file, scopeCount);
+			for (ScopeID id = 0; id < scopeCount; ++id)
+			{
+				const ScopeData & scope = Data->Scopes[id];
+				bool published = Data->Scopes.IsPublished(id);
+				Write(file, String(published == true && scope.Filename != nullptr ? scope.Filename : ""));
+				Write(file, String(published == true && scope.Name != nullptr ? scope.Name : ""));
+				Write(file, published == true ? scope.Line : uint32_t(0));
+			}
 
-			// write the scopes
-			Write(file, Data->Scopes.size());
-			for (const auto & scope : Data->Scopes)
+			// write the interned strings, as ID / string pairs
+			uint32_t stringCount = 0;
+			for (StringID id = 0; id < Data->Strings.GetCapacity(); ++id)
 			{
-				Write(file, scope.Filename);
-				Write(file, scope.Name);
-				Write(file, scope.Line);
+				stringCount += Data->Strings.GetEntry(id) != nullptr ? 1 : 0;
+			}
+			Write(file, stringCount);
+			for (StringID id = 0; id < Data->Strings.GetCapacity(); ++id)
+			{
+				if (Data->Strings.GetEntry(id) != nullptr)
+				{
+					Write(file, id);
+					Write(file, Data->Strings.GetEntry(id)->Value);
+				}
 			}
 
 			// write the markers
-			Write(file, Data->MarkerLists.size());
-			for (const auto * markers : Data->MarkerLists)
+			std::vector< RawMarker > markers;
+			std::vector< RawArgument > arguments;
+			Write(file, static_cast< uint64_t >(Data->MarkerLists.size()));
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				markers.resize(buffer->List.size());
+				for (size_t i = 0; i < markers.size(); ++i)
+				{
+					const MarkerData & marker = buffer->List[i];
+					markers[i] = RawMarker{ marker.ParentScope, marker.Scope, marker.FirstArgument, 0, GetRawTime(marker.Start), GetRawTime(marker.End) };
+				}
+				arguments.resize(buffer->Arguments.size());
+				for (size_t i = 0; i < arguments.size(); ++i)
+				{
+					const ArgumentData & argument = buffer->Arguments[i];
+					RawArgument & raw = arguments[i];
+					raw = RawArgument{ argument.Name, static_cast< uint8_t >(argument.Type), argument.Count, 0, 0 };
+					switch (argument.Type)
+					{
+						case ArgumentType::Integer:	raw.Value = argument.Integer;					break;
+						case ArgumentType::Double:	std::memcpy(&raw.Value, &argument.Double, 8);	break;
+						case ArgumentType::String:	raw.Value = argument.String;					break;
+					}
+				}
+				Write(file, buffer->ThreadIndex);
+				Write(file, static_cast< uint64_t >(markers.size()));
+				Write(file, markers.data(), markers.size() * sizeof(RawMarker));
+				Write(file, static_cast< uint64_t >(arguments.size()));
+				Write(file, arguments.data(), arguments.size() * sizeof(RawArgument));
+			}
+		}
+
+		//!
+		//! Per-scope times and counts, aggregated from a part of the markers
+		//!
+		struct Aggregate
+		{
+			//! Constructor
+			inline Aggregate(size_t scopeCount)
+				: Inclusive(scopeCount, 0)
+				, Exclusive(scopeCount, 0)
+				, Counts(scopeCount, 0)
 			{
-				Write(file, markers->size());
-				Write(file, markers->data(), markers->size());
+			}
+
+			//! Inclusive times
+			std::vector< uint64_t > Inclusive;
+
+			//! Exclusive times. Children are removed from their parent, which can be in another part
+			std::vector< int64_t > Exclusive;
+
+			//! Number of markers
+			std::vector< uint64_t > Counts;
+		};
+
+		//!
+		//! A part of a marker list, aggregated at once
+		//!
+		struct Chunk
+		{
+			//! The marker list
+			const MarkerBuffer * Buffer;
+
+			//! Index of the first marker
+			size_t Begin;
+
+			//! Index past the last marker
+			size_t End;
+
+			//! Time range of the markers, set by AggregateChunk
+			std::pair< TimePoint, TimePoint > Range;
+		};
+
+		//! Maximum number of markers per chunk
+		const size_t ChunkSize = 1 << 20;
+
+		//!
+		//! Split the marker lists in chunks. The marker mutex must be locked.
+		//!
+		inline std::vector< Chunk > GetChunks(void)
+		{
+			std::vector< Chunk > chunks;
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				for (size_t begin = 0; begin < buffer->List.size(); begin += ChunkSize)
+				{
+					chunks.push_back({ buffer, begin, std::min(buffer->List.size(), begin + ChunkSize), {} });
+				}
+			}
+			return chunks;
+		}
+
+		//!
+		//! Add the times and counts of the markers of @p chunk to @p aggregate, and set its time range
+		//!
+		inline void AggregateChunk(Chunk & chunk, Aggregate & aggregate)
+		{
+			const MarkerData * markers = chunk.Buffer->List.data();
+			chunk.Range = { markers[chunk.Begin].Start, markers[chunk.Begin].End };
+			for (size_t i = chunk.Begin; i < chunk.End; ++i)
+			{
+				const MarkerData & marker = markers[i];
+				chunk.Range.first = std::min(chunk.Range.first, marker.Start);
+				chunk.Range.second = std::max(chunk.Range.second, marker.End);
+
+				// update the exec times and counts
+				uint64_t ns = GetNanoSeconds(marker.Start, marker.End);
+				aggregate.Inclusive[marker.Scope] += ns;
+				aggregate.Exclusive[marker.Scope] += ns;
+				aggregate.Counts[marker.Scope] += 1;
+				if (marker.ParentScope != static_cast< ScopeID >(-1))
+				{
+					aggregate.Exclusive[marker.ParentScope] -= ns;
+				}
+			}
+		}
+
+		//!
+		//! Merge @p other into @p aggregate
+		//!
+		inline void MergeAggregate(Aggregate & aggregate, const Aggregate & other)
+		{
+			for (size_t scope = 0; scope < aggregate.Counts.size(); ++scope)
+			{
+				aggregate.Inclusive[scope] += other.Inclusive[scope];
+				aggregate.Exclusive[scope] += other.Exclusive[scope];
+				aggregate.Counts[scope] += other.Counts[scope];
+			}
+		}
+
+		//!
+		//! Write the CSV output from the aggregated chunks. The marker mutex must be locked.
+		//!
+		inline void WriteCommaSeparatedValues(const String & filename, const std::vector< Chunk > & chunks, const Aggregate & aggregate)
+		{
+			// open the output file
+			std::ofstream file(filename);
+			const std::vector< uint64_t > & inclusive = aggregate.Inclusive;
+			const std::vector< int64_t > & exclusive = aggregate.Exclusive;
+			const std::vector< uint64_t > & counts = aggregate.Counts;
+
+			// get the total execution time, from the per-thread time ranges
+			uint64_t execTime = 0;
+			for (size_t i = 0; i < chunks.size(); )
+			{
+				std::pair< TimePoint, TimePoint > range = chunks[i].Range;
+				size_t j = i + 1;
+				for (; j < chunks.size() && chunks[j].Buffer == chunks[i].Buffer; ++j)
+				{
+					range.first = std::min(range.first, chunks[j].Range.first);
+					range.second = std::max(range.second, chunks[j].Range.second);
+				}
+				execTime += GetNanoSeconds(range.first, range.second);
+				i = j;
+			}
+
+			// get the call counters
+			std::vector< CounterValues > counters = GetCounterValues();
+
+			// output summary
+			file << "name;counts;inclusive total;exclusive total;inclusive average;exclusive average;inclusive percentage;exclusive percentage;allocations;allocated;live" << std::endl;
+			for (size_t i = 0, iend = counts.size(); i < iend; ++i)
+			{
+				// the memory charged to the scope (see OnAllocation)
+				const ScopeMemory & memory = Data->Scopes[i].Memory;
+				uint64_t allocations = memory.Allocations.load(std::memory_order_relaxed);
+				int64_t live = memory.LiveBytes.load(std::memory_order_relaxed);
+				String memoryColumns =
+					";" + std::to_string(allocations) +
+					";" + std::to_string(memory.AllocatedBytes.load(std::memory_order_relaxed)) +
+					";" + std::to_string(live);
+
+				if (counts[i] != 0)
+				{
+					file << Data->Scopes[i].Name <<
+						";" << counts[i] <<
+						";" << GetReadableTime(inclusive[i]) <<
+						";" << GetReadableTime(exclusive[i]) <<
+						";" << GetReadableTime(inclusive[i] / counts[i]) <<
+						";" << GetReadableTime(exclusive[i] / counts[i]) <<
+						";" << GetDouble((100.0 * inclusive[i]) / double(execTime), 2) <<
+						";" << GetDouble((100.0 * exclusive[i]) / double(execTime), 2) <<
+						memoryColumns <<
+						std::endl;
+				}
+				else if (counters[i].Count != 0)
+				{
+					// call counters only know their total time if they were sampled, and never know the exclusive time.
+					// Samples are so short that the timing overhead is removed.
+					const CounterValues & counter = counters[i];
+					file << Data->Scopes[i].Name << ";" << counter.Count;
+					if (counter.SampleCount != 0)
+					{
+						uint64_t average = counter.SampleTime / counter.SampleCount;
+						average = average > GetTimingOverhead() ? average - GetTimingOverhead() : 0;
+						file <<
+							";" << GetReadableTime(average * counter.Count) <<
+							";" <<
+							";" << GetReadableTime(average) <<
+							";" <<
+							";" << GetDouble((100.0 * average * counter.Count) / double(execTime), 2) <<
+							";";
+					}
+					else
+					{
+						file << ";;;;;;";
+					}
+					file << memoryColumns << std::endl;
+				}
+				else if (allocations != 0 || live != 0)
+				{
+					// scopes which allocated memory, but whose markers were cleared
+					file << Data->Scopes[i].Name << ";0;;;;;;" << memoryColumns << std::endl;
+				}
 			}
 		}
 
@@ -136,83 +514,496 @@ namespace Profiler
 		//!
 		inline void CommaSeparatedValues(const String & filename)
 		{
-			// first, ensure that nobody else is modifying the profiling data
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
+			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
+
+			std::vector< Chunk > chunks = GetChunks();
+			Aggregate aggregate(Data->Scopes.GetSize());
+			for (Chunk & chunk : chunks)
+			{
+				AggregateChunk(chunk, aggregate);
+			}
+			WriteCommaSeparatedValues(filename, chunks, aggregate);
+		}
+
+		//!
+		//! Comma-separated values, where each scope is split in groups depending on the value
+		//! of its @p argument argument (see GetArgumentGroup) Markers without the argument are
+		//! grouped in an empty group.
+		//!
+		inline void CommaSeparatedValues(const String & filename, const String & argument)
+		{
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
 			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
-			ScopedLock< Mutex > lockScopes(Data->ScopeMutex);
 
 			// open the output file
 			std::ofstream file(filename);
 
-			// extract data from the markers
-			std::unordered_map< ThreadID, std::pair< TimePoint, TimePoint > > timeRanges;
-			std::vector< uint64_t > inclusive(Data->Scopes.size(), 0);
-			std::vector< int64_t > exclusive(Data->Scopes.size(), 0);
-			std::vector< uint64_t > counts(Data->Scopes.size(), 0);
-			for (const auto * markers : Data->MarkerLists)
+			// get the argument's name ID
+			StringID nameID = Data->Strings.Find(argument.data(), argument.size());
+
+			// per group statistics
+			struct Group
+			{
+				uint64_t Count;
+				uint64_t Inclusive;
+				uint64_t Exclusive;
+			};
+			std::map< std::tuple< ScopeID, double, String >, Group > groups;
+
+			// extract data from the markers. The markers of a thread are ordered by end time, so the children
+			// of a marker are the not yet claimed previous markers which started after it did.
+			uint64_t execTime = 0;
+			std::vector< std::pair< TimePoint, uint64_t > > unclaimed;
+			for (const auto * buffer : Data->MarkerLists)
 			{
-				for (const auto & marker : *markers)
+				if (buffer->List.empty() == true)
+				{
+					continue;
+				}
+
+				unclaimed.clear();
+				std::pair< TimePoint, TimePoint > range = { buffer->List.front().Start, buffer->List.front().End };
+				for (const auto & marker : buffer->List)
 				{
-					// update the per-thread time ranges
-					auto range = timeRanges.find(marker.Thread);
-					if (range == timeRanges.end())
+					range.first = std::min(range.first, marker.Start);
+					range.second = std::max(range.second, marker.End);
+
+					// get the exclusive time
+					uint64_t ns = GetNanoSeconds(marker.Start, marker.End);
+					uint64_t children = 0;
+					while (unclaimed.empty() == false && unclaimed.back().first >= marker.Start)
 					{
-						timeRanges[marker.Thread] = { marker.Start, marker.End };
+						children += unclaimed.back().second;
+						unclaimed.pop_back();
 					}
-					else
+					unclaimed.push_back({ marker.Start, ns });
+
+					// update the group
+					const ArgumentData * value = FindArgument(*buffer, marker, nameID);
+					std::pair< double, String > key = value != nullptr ? GetArgumentGroup(*value) : std::pair< double, String >(-1.0, String());
+					Group & group = groups[std::make_tuple(marker.Scope, key.first, key.second)];
+					group.Count += 1;
+					group.Inclusive += ns;
+					group.Exclusive += ns > children ? ns - children : 0;
+				}
+				execTime += GetNanoSeconds(range.first, range.second);
+			}
+
+			// output summary
+			file << "name;" << argument << ";counts;inclusive total;exclusive total;inclusive average;exclusive average;inclusive percentage;exclusive percentage" << std::endl;
+			for (const auto & entry : groups)
+			{
+				const Group & group = entry.second;
+				file << Data->Scopes[std::get< 0 >(entry.first)].Name <<
+					";" << std::get< 2 >(entry.first) <<
+					";" << group.Count <<
+					";" << GetReadableTime(group.Inclusive) <<
+					";" << GetReadableTime(group.Exclusive) <<
+					";" << GetReadableTime(group.Inclusive / group.Count) <<
+					";" << GetReadableTime(group.Exclusive / group.Count) <<
+					";" << GetDouble((100.0 * group.Inclusive) / double(execTime), 2) <<
+					";" << GetDouble((100.0 * group.Exclusive) / double(execTime), 2) <<
+					std::endl;
+			}
+		}
+
+		//!
+		//! A task executed by a TaskManager, as recorded by its push and execution markers
+		//!
+		struct TaskMarkers
+		{
+			//! The buffer containing the execution marker, nullptr if the task wasn't executed
+			const MarkerBuffer * Buffer;
+
+			//! Index of the execution marker
+			size_t Marker;
+
+			//! ID of the task which pushed this one, 0 if it was pushed outside of a task
+			uint64_t Parent;
+
+			//! Time at which the task was pushed
+			TimePoint Push;
+
+			//! True if the push was recorded
+			bool Pushed;
+
+			//! Time at which the task and the tasks it pushed (recursively) were all done
+			TimePoint SubtreeEnd;
+		};
+
+		//!
+		//! Get the markers nested in the execution marker @p index of a task, in order, including
+		//! it. Tasks executed inline by the task are returned, but not their own nested markers, and
+		//! are flagged in the second value of the pairs.
+		//!
+		inline void GetTaskMarkers(const MarkerBuffer & buffer, size_t index, const std::map< std::pair< const MarkerBuffer *, size_t >, uint64_t > & executions, std::vector< std::pair< size_t, bool > > & markers)
+		{
+			markers.clear();
+			markers.push_back({ index, false });
+			const MarkerData & task = buffer.List[index];
+			size_t i = index;
+			while (i > 0 && buffer.List[i - 1].Start >= task.Start)
+			{
+				--i;
+				bool nestedTask = executions.count({ &buffer, i }) != 0;
+				markers.push_back({ i, nestedTask });
+				if (nestedTask == true)
+				{
+					const MarkerData & nested = buffer.List[i];
+					while (i > 0 && buffer.List[i - 1].Start >= nested.Start)
 					{
-						range->second.first = std::min(range->second.first, marker.Start);
-						range->second.second = std::max(range->second.second, marker.End);
+						--i;
 					}
+				}
+			}
+			std::reverse(markers.begin(), markers.end());
+		}
 
-					// update the exec times and counts
-					uint64_t ns = GetNanoSeconds(marker.Start, marker.End);
-					inclusive[marker.Scope] += ns;
-					exclusive[marker.Scope] += ns;
-					counts[marker.Scope] += 1;
-					if (marker.ParentScope != static_cast< ScopeID >(-1))
+		//!
+		//! Add the exclusive time of @p markers (see GetTaskMarkers) clipped to [ @p from, @p to ] to
+		//! the per-scope @p times. Inline tasks are added as a whole if @p nestedTasks is true.
+		//!
+		inline void AddExclusiveTimes(const MarkerBuffer & buffer, const std::vector< std::pair< size_t, bool > > & markers, TimePoint from, TimePoint to, bool nestedTasks, std::vector< uint64_t > & times)
+		{
+			std::vector< std::pair< TimePoint, uint64_t > > unclaimed;
+			for (const auto & entry : markers)
+			{
+				const MarkerData & marker = buffer.List[entry.first];
+				TimePoint start = std::max(marker.Start, from);
+				TimePoint end = std::min(marker.End, to);
+				uint64_t ns = start < end ? GetNanoSeconds(start, end) : 0;
+				uint64_t children = 0;
+				while (unclaimed.empty() == false && unclaimed.back().first >= marker.Start)
+				{
+					children += unclaimed.back().second;
+					unclaimed.pop_back();
+				}
+				unclaimed.push_back({ marker.Start, ns });
+				if (entry.second == false || nestedTasks == true)
+				{
+					times[marker.Scope] += ns > children ? ns - children : 0;
+				}
+			}
+		}
+
+		//!
+		//! Critical path analysis of the tasks executed by TaskManager. The dependency graph is rebuilt
+		//! from the push and execution markers of the tasks: a task depends on the one which pushed it.
+		//! The critical path is the chain of tasks and queue waits which ended with the last task, and
+		//! bounded the wall time. For each scope, this outputs its exclusive time in tasks, its
+		//! contribution to the critical path, and its parallel slack: by how much it could be delayed
+		//! without delaying the last task.
+		//!
+		inline void CriticalPath(const String & filename)
+		{
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
+			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
+
+			// open the output file
+			std::ofstream file(filename);
+
+			// find the push and execution markers of the tasks, which are the markers of the scopes of
+			// TaskManager. Only those are looked at, since other scopes could use the same arguments.
+			enum : char { OtherScope, PushScope, TaskScope };
+			std::vector< char > kinds(Data->Scopes.GetSize(), OtherScope);
+			for (ScopeID i = 0; i < kinds.size(); ++i)
+			{
+				if (Data->Scopes.IsPublished(i) == false)
+				{
+					continue;
+				}
+				const char * name = Data->Scopes[i].Name != nullptr ? Data->Scopes[i].Name : "";
+				kinds[i] = std::strcmp(name, "TaskManager::PushTask") == 0 ? PushScope : std::strcmp(name, "TaskManager::Task") == 0 ? TaskScope : OtherScope;
+			}
+			StringID taskName = Data->Strings.Find("task", 4);
+			StringID parentName = Data->Strings.Find("parent", 6);
+			std::map< uint64_t, TaskMarkers > tasks;
+			std::map< std::pair< const MarkerBuffer *, size_t >, uint64_t > executions;
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				for (size_t i = 0; i < buffer->List.size(); ++i)
+				{
+					const MarkerData & marker = buffer->List[i];
+					char kind = marker.Scope < kinds.size() ? kinds[marker.Scope] : char(OtherScope);
+					const ArgumentData * id = kind != OtherScope ? FindArgument(*buffer, marker, taskName) : nullptr;
+					if (id == nullptr || id->Type != ArgumentType::Integer)
+					{
+						continue;
+					}
+					TaskMarkers & task = tasks.insert({ uint64_t(id->Integer), TaskMarkers{ nullptr, 0, 0, TimePoint(), false, TimePoint() } }).first->second;
+					const ArgumentData * parent = FindArgument(*buffer, marker, parentName);
+					if (kind == TaskScope && parent != nullptr && parent->Type == ArgumentType::Integer)
+					{
+						task.Buffer = buffer;
+						task.Marker = i;
+						task.Parent = uint64_t(parent->Integer);
+						executions[{ buffer, i }] = uint64_t(id->Integer);
+					}
+					else if (kind == PushScope)
 					{
-						exclusive[marker.ParentScope] -= ns;
+						task.Push = marker.End;
+						task.Pushed = true;
 					}
 				}
 			}
 
-			// get the total execution time
-			uint64_t execTime = 0;
-			for (const auto & range : timeRanges)
+			// forget the tasks which were pushed but not executed, and get the time at which each task
+			// subtree was done. Tasks are pushed before their children, so they have smaller IDs (the
+			// IDs are 64 bit, so they don't wrap)
+			uint64_t last = 0;
+			uint64_t work = 0;
+			for (auto it = tasks.begin(); it != tasks.end(); )
 			{
-				execTime += GetNanoSeconds(range.second.first, range.second.second);
+				it = it->second.Buffer == nullptr ? tasks.erase(it) : std::next(it);
+			}
+			for (auto it = tasks.rbegin(); it != tasks.rend(); ++it)
+			{
+				TaskMarkers & task = it->second;
+				const MarkerData & marker = task.Buffer->List[task.Marker];
+				task.SubtreeEnd = std::max(task.SubtreeEnd, marker.End);
+				work += GetNanoSeconds(marker.Start, marker.End);
+				if (last == 0 || marker.End > tasks[last].Buffer->List[tasks[last].Marker].End)
+				{
+					last = it->first;
+				}
+				auto parent = tasks.find(task.Parent);
+				if (parent != tasks.end())
+				{
+					parent->second.SubtreeEnd = std::max(parent->second.SubtreeEnd, task.SubtreeEnd);
+				}
+			}
+			if (last == 0)
+			{
+				file << "no task markers" << std::endl;
+				return;
 			}
 
-			// output summary
-			file << "name;counts;inclusive total;exclusive total;inclusive average;exclusive average;inclusive percentage;exclusive percentage" << std::endl;
-			for (size_t i = 0, iend = Data->Scopes.size(); i < iend; ++i)
+			// walk the critical path back from the last task. Each task is on it from the time it started
+			// up to the time it pushed the next one, and waited in the queue after being pushed.
+			std::vector< uint64_t > critical(Data->Scopes.GetSize(), 0);
+			std::vector< std::pair< size_t, bool > > markers;
+			uint64_t queueWait = 0;
+			TimePoint end = tasks[last].Buffer->List[tasks[last].Marker].End;
+			TimePoint begin = end;
+			for (uint64_t id = last; ; )
 			{
-				if (counts[i] != 0)
+				const TaskMarkers & task = tasks[id];
+				const MarkerData & marker = task.Buffer->List[task.Marker];
+				GetTaskMarkers(*task.Buffer, task.Marker, executions, markers);
+				AddExclusiveTimes(*task.Buffer, markers, marker.Start, begin, true, critical);
+				begin = task.Pushed == true ? std::min(task.Push, marker.Start) : marker.Start;
+				queueWait += GetNanoSeconds(begin, marker.Start);
+
+				auto parent = tasks.find(task.Parent);
+				if (parent == tasks.end() || parent->second.Buffer->List[parent->second.Marker].Start > begin)
+				{
+					break;
+				}
+				id = task.Parent;
+			}
+			uint64_t length = GetNanoSeconds(begin, end);
+
+			// get the exclusive time of the scopes in tasks, and their minimum slack
+			std::vector< uint64_t > times(Data->Scopes.GetSize(), 0);
+			std::vector< uint64_t > slacks(Data->Scopes.GetSize(), uint64_t(-1));
+			for (const auto & entry : tasks)
+			{
+				const TaskMarkers & task = entry.second;
+				uint64_t slack = task.SubtreeEnd < end ? GetNanoSeconds(task.SubtreeEnd, end) : 0;
+				const MarkerData & marker = task.Buffer->List[task.Marker];
+				GetTaskMarkers(*task.Buffer, task.Marker, executions, markers);
+				AddExclusiveTimes(*task.Buffer, markers, marker.Start, marker.End, false, times);
+				for (const auto & nested : markers)
+				{
+					if (nested.second == false)
+					{
+						ScopeID scope = task.Buffer->List[nested.first].Scope;
+						slacks[scope] = std::min(slacks[scope], slack);
+					}
+				}
+			}
+
+			// output the summary, and the per scope results
+			file << "critical path;" << GetReadableTime(length) << std::endl;
+			file << "total work;" << GetReadableTime(work) << std::endl;
+			file << "parallelism;" << GetDouble(length > 0 ? double(work) / double(length) : 0.0, 2) << std::endl;
+			file << "queue wait;" << GetReadableTime(queueWait) << std::endl;
+			file << std::endl;
+			file << "name;task time;critical path;critical percentage;minimum slack" << std::endl;
+			for (size_t i = 0, iend = Data->Scopes.GetSize(); i < iend; ++i)
+			{
+				if (times[i] != 0 || critical[i] != 0)
 				{
 					file << Data->Scopes[i].Name <<
-						";" << counts[i] <<
-						";" << GetReadableTime(inclusive[i]) <<
-						";" << GetReadableTime(exclusive[i]) <<
-						";" << GetReadableTime(inclusive[i] / counts[i]) <<
-						";" << GetReadableTime(exclusive[i] / counts[i]) <<
-						";" << GetDouble((100.0 * inclusive[i]) / double(execTime), 2) <<
-						";" << GetDouble((100.0 * exclusive[i]) / double(execTime), 2) <<
+						";" << GetReadableTime(times[i]) <<
+						";" << GetReadableTime(critical[i]) <<
+						";" << GetDouble(length > 0 ? (100.0 * critical[i]) / double(length) : 0.0, 2) <<
+						";" << (slacks[i] != uint64_t(-1) ? GetReadableTime(slacks[i]) : String()) <<
 						std::endl;
 				}
 			}
 		}
 
+		//!
+		//! Get the busy time of each thread (from its top-level markers) in consecutive windows
+		//! of @p window nanoseconds, starting at @p begin (the start of the first marker.) Threads
+		//! without markers are skipped. The marker mutex must be locked.
+		//!
+		//! @return
+		//!		The duration of the profiled range, in nanoseconds
+		//!
+		inline uint64_t GetUtilization(uint64_t window, std::vector< const MarkerBuffer * > & threads, std::vector< std::vector< uint64_t > > & busy, TimePoint & begin)
+		{
+			threads.clear();
+			busy.clear();
+
+			// get the profiled time range
+			bool empty = true;
+			TimePoint end;
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				for (const auto & marker : buffer->List)
+				{
+					begin = empty == true ? marker.Start : std::min(begin, marker.Start);
+					end = empty == true ? marker.End : std::max(end, marker.End);
+					empty = false;
+				}
+			}
+			if (empty == true)
+			{
+				return 0;
+			}
+
+			// accumulate the top-level markers of each thread in the windows they overlap
+			window = std::max< uint64_t >(window, 1);
+			size_t windowCount = size_t(GetNanoSeconds(begin, end) / window + 1);
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				if (buffer->List.empty() == true)
+				{
+					continue;
+				}
+				threads.push_back(buffer);
+				busy.push_back(std::vector< uint64_t >(windowCount, 0));
+				std::vector< uint64_t > & windows = busy.back();
+				for (const auto & marker : buffer->List)
+				{
+					if (marker.ParentScope != static_cast< ScopeID >(-1))
+					{
+						continue;
+					}
+					uint64_t start = GetNanoSeconds(begin, marker.Start);
+					uint64_t stop = GetNanoSeconds(begin, marker.End);
+					for (size_t i = size_t(start / window); i < windowCount && i * window < stop; ++i)
+					{
+						windows[i] += std::min(stop, (i + 1) * window) - std::max(start, i * window);
+					}
+				}
+			}
+			return GetNanoSeconds(begin, end);
+		}
+
+		//!
+		//! Per-thread utilization report. For each thread, this outputs its busy time (the time spent
+		//! in its top-level markers) and idle time over the profiled range, then the load imbalance
+		//! (the busiest thread's time over the average one, and the standard deviation of the
+		//! utilizations), then the utilization of each thread for each window of @p window nanoseconds.
+		//!
+		inline void Utilization(const String & filename, uint64_t window = 1000000)
+		{
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
+			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
+
+			// open the output file
+			std::ofstream file(filename);
+
+			// get the per window busy times
+			std::vector< const MarkerBuffer * > threads;
+			std::vector< std::vector< uint64_t > > busy;
+			TimePoint begin;
+			uint64_t range = GetUtilization(window, threads, busy, begin);
+			if (threads.empty() == true || range == 0)
+			{
+				file << "no markers" << std::endl;
+				return;
+			}
+			window = std::max< uint64_t >(window, 1);
+
+			// per thread summary
+			std::vector< double > utilizations;
+			uint64_t maxBusy = 0;
+			uint64_t totalBusy = 0;
+			file << "thread;busy;idle;utilization" << std::endl;
+			for (size_t i = 0; i < threads.size(); ++i)
+			{
+				uint64_t total = 0;
+				for (uint64_t ns : busy[i])
+				{
+					total += ns;
+				}
+				maxBusy = std::max(maxBusy, total);
+				totalBusy += total;
+				utilizations.push_back((100.0 * total) / double(range));
+				file << threads[i]->ThreadIndex <<
+					";" << GetReadableTime(total) <<
+					";" << GetReadableTime(range - total) <<
+					";" << GetDouble(utilizations.back(), 2) <<
+					std::endl;
+			}
+
+			// load imbalance
+			double average = double(totalBusy) / double(threads.size());
+			double mean = 0.0;
+			double variance = 0.0;
+			for (double utilization : utilizations)
+			{
+				mean += utilization / double(utilizations.size());
+			}
+			for (double utilization : utilizations)
+			{
+				variance += (utilization - mean) * (utilization - mean) / double(utilizations.size());
+			}
+			file << std::endl;
+			file << "load imbalance;" << GetDouble(average > 0.0 ? double(maxBusy) / average : 0.0, 2) << std::endl;
+			file << "utilization standard deviation;" << GetDouble(std::sqrt(variance), 2) << std::endl;
+
+			// per window utilization
+			file << std::endl << "window";
+			for (const auto * thread : threads)
+			{
+				file << ";thread " << thread->ThreadIndex;
+			}
+			file << std::endl;
+			for (size_t w = 0; w < busy.front().size(); ++w)
+			{
+				file << GetReadableTime(w * window);
+				for (size_t i = 0; i < threads.size(); ++i)
+				{
+					file << ";" << GetDouble((100.0 * busy[i][w]) / double(window), 2);
+				}
+				file << std::endl;
+			}
+		}
+
 		//!
 		//! Output the results of a profiling session to a JSON file that can
 		//! then be loaded by using the "chrome://tracing" utility of Chrome.
 		//!
 		//! See Trace Event Format : https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU/preview
 		//!
-		inline void ChromeTracing(const String & filename)
+		//! If @p utilizationWindow is not 0, the utilization of each thread over windows of that many
+		//! nanoseconds (see Utilization) is also written as counter tracks.
+		//!
+		inline void ChromeTracing(const String & filename, uint64_t utilizationWindow = 0)
 		{
-			// first, ensure that nobody else is modifying the profiling data
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
 			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
-			ScopedLock< Mutex > lockScopes(Data->ScopeMutex);
 
 			// open the output file
 			std::ofstream file(filename);
@@ -220,28 +1011,88 @@ namespace Profiler
 
 			// and write data
 			bool first = true;
-			for (const auto * markers : Data->MarkerLists)
+			for (const auto * buffer : Data->MarkerLists)
 			{
-				for (const auto & marker : *markers)
+				if (buffer->List.empty() == true)
+				{
+					continue;
+				}
+
+				// name the thread track using the original thread ID
+				file << (first == true ? "" : ",") << std::endl;
+				first = false;
+				file << "{ \"ph\": \"M\", \"pid\": \"foo\", \"name\": \"thread_name\", ";
+				file << "\"tid\": " << buffer->ThreadIndex << ", ";
+				std::ostringstream threadName;
+				threadName << "Thread " << buffer->Thread << (buffer->Retired == true ? " (exited)" : "");
+				file << "\"args\": { \"name\": " << GetJsonString(threadName.str()) << " } }";
+
+				for (const auto & marker : buffer->List)
 				{
 					const ScopeData & scope = Data->Scopes[marker.Scope];
 					String scopeFilename = scope.Filename;
 					std::replace(scopeFilename.begin(), scopeFilename.end(), '\\', '/');
-					if (first == false)
+					file << "," << std::endl;
+					file << "{ \"cat\": \"perf\", \"ph\": \"X\", \"pid\": \"foo\", ";
+					file << "\"name\": " << GetJsonString(scope.Name) << ", ";
+					file << "\"tid\": " << buffer->ThreadIndex << ", ";
+					file << "\"ts\": " << GetMicroSeconds(Data->StartTime, marker.Start) << ", ";
+					file << "\"dur\": " << GetMicroSeconds(marker.Start, marker.End) << ", ";
+					file << "\"args\": { \"filename\": " << GetJsonString(scopeFilename) << ", \"line\": " << scope.Line;
+					if (marker.FirstArgument != static_cast< uint32_t >(-1))
 					{
-						file << "," << std::endl;
+						const ArgumentData * arguments = buffer->Arguments.data() + marker.FirstArgument;
+						for (uint8_t i = 0, count = arguments[0].Count; i < count; ++i)
+						{
+							file << ", ";
+							WriteArgument(file, arguments[i]);
+						}
 					}
-					else
+					file << " } }";
+				}
+			}
+
+			// write the tracked memory as a counter track, keeping the last sample of each microsecond
+			std::vector< MemorySample > samples;
+			for (const auto * buffer : Data->MarkerLists)
+			{
+				samples.insert(samples.end(), buffer->MemorySamples.begin(), buffer->MemorySamples.end());
+			}
+			std::stable_sort(samples.begin(), samples.end(), [] (const MemorySample & a, const MemorySample & b) {
+				return a.Time < b.Time;
+			});
+			for (size_t i = 0; i < samples.size(); ++i)
+			{
+				uint64_t time = GetMicroSeconds(Data->StartTime, samples[i].Time);
+				if (i + 1 < samples.size() && GetMicroSeconds(Data->StartTime, samples[i + 1].Time) == time)
+				{
+					continue;
+				}
+				file << (first == true ? "" : ",") << std::endl;
+				first = false;
+				file << "{ \"ph\": \"C\", \"pid\": \"foo\", \"name\": \"Tracked memory\", ";
+				file << "\"ts\": " << time << ", ";
+				file << "\"args\": { \"bytes\": " << samples[i].Bytes << " } }";
+			}
+
+			// write the utilization counter tracks
+			if (utilizationWindow != 0)
+			{
+				std::vector< const MarkerBuffer * > threads;
+				std::vector< std::vector< uint64_t > > busy;
+				TimePoint begin;
+				GetUtilization(utilizationWindow, threads, busy, begin);
+				uint64_t offset = threads.empty() == false ? GetMicroSeconds(Data->StartTime, begin) : 0;
+				for (size_t i = 0; i < threads.size(); ++i)
+				{
+					for (size_t w = 0; w < busy[i].size(); ++w)
 					{
-						file << std::endl;
+						file << (first == true ? "" : ",") << std::endl;
 						first = false;
+						file << "{ \"ph\": \"C\", \"pid\": \"foo\", \"name\": \"Utilization - thread " << threads[i]->ThreadIndex << "\", ";
+						file << "\"ts\": " << offset + (w * utilizationWindow) / 1000 << ", ";
+						file << "\"args\": { \"percentage\": " << GetDouble((100.0 * busy[i][w]) / double(utilizationWindow), 2) << " } }";
 					}
-					file << "{ \"cat\": \"perf\", \"ph\": \"X\", \"pid\": \"foo\", ";
-					file << "\"name\": \"" << scope.Name << "\", ";
-					file << "\"tid\": " << marker.Thread << ", ";
-					file << "\"ts\": " << GetMicroSeconds(Data->StartTime, marker.Start) << ", ";
-					file << "\"dur\": " << GetMicroSeconds(marker.Start, marker.End) << ", ";
-					file << "\"args\": { \"filename\": \"" << scopeFilename << "\", \"line\": " << scope.Line << " } }";
 				}
 			}
 
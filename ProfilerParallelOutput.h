@@ -0,0 +1,87 @@
+#ifndef PROFILER_PARALLEL_OUTPUT_H
+#define PROFILER_PARALLEL_OUTPUT_H
+
+
+#include "Profiler.h"
+
+
+#if PROFILER_ENABLE == 0
+
+
+namespace Profiler
+{
+	namespace Output
+	{
+
+		inline void ParallelCommaSeparatedValues(const std::string &)	{}
+
+	} // namespace Output
+} // namespace Profiler
+
+
+#else
+
+
+#include "TaskManager.h"
+
+
+namespace Profiler
+{
+	namespace Output
+	{
+
+		//!
+		//! Get the task manager used to aggregate the captures. It's created on first use, and its
+		//! tasks aren't profiled, since the workers run while the marker mutex is locked.
+		//!
+		inline TaskManager & GetOutputTaskManager(void)
+		{
+			struct OutputTaskManager
+				: public TaskManager
+			{
+				inline OutputTaskManager(void)
+				{
+					this->SetProfiled(false);
+				}
+			};
+			static OutputTaskManager tasks;
+			return tasks;
+		}
+
+		//!
+		//! Same as CommaSeparatedValues, but the chunks of markers are aggregated in parallel, which
+		//! is faster for large captures. Small captures are aggregated by the calling thread.
+		//!
+		inline void ParallelCommaSeparatedValues(const String & filename)
+		{
+			// first, ensure that nobody else is modifying the markers. Scopes and strings can be registered
+			// concurrently, but the ones used by the markers are already there.
+			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
+
+			std::vector< Chunk > chunks = GetChunks();
+			Aggregate identity(Data->Scopes.GetSize());
+			if (chunks.size() <= 1)
+			{
+				for (Chunk & chunk : chunks)
+				{
+					AggregateChunk(chunk, identity);
+				}
+				WriteCommaSeparatedValues(filename, chunks, identity);
+				return;
+			}
+
+			// each worker aggregates in its own copy of the results, which are merged at the end
+			Aggregate aggregate = GetOutputTaskManager().ParallelReduce(0, static_cast< int64_t >(chunks.size()), 1, identity,
+				[&chunks] (Aggregate & partial, int64_t i) { AggregateChunk(chunks[static_cast< size_t >(i)], partial); },
+				[] (Aggregate a, const Aggregate & b) { MergeAggregate(a, b); return a; }
+			);
+			WriteCommaSeparatedValues(filename, chunks, aggregate);
+		}
+
+	} // namespace Output
+} // namespace Profiler
+
+
+#endif // PROFILER_ENABLE
+
+#endif // PROFILER_PARALLEL_OUTPUT_H
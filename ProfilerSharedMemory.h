@@ -0,0 +1,772 @@
+#ifndef PROFILER_SHARED_MEMORY_H
+#define PROFILER_SHARED_MEMORY_H
+
+
+#include "Profiler.h"
+
+
+#if PROFILER_ENABLE == 0
+
+
+namespace Profiler
+{
+	namespace SharedMemory
+	{
+
+		inline bool Create(const std::string &, uint64_t)					{ return false; }
+		inline bool Attach(const std::string &, const std::string & = "")	{ return false; }
+		inline bool Publish(void)											{ return false; }
+		inline void Detach(void)											{}
+		inline void Remove(const std::string &)								{}
+		inline bool ChromeTracing(const std::string &, const std::string &)	{ return false; }
+
+	} // namespace SharedMemory
+} // namespace Profiler
+
+
+#else
+
+
+#include <fstream>
+#include <unordered_map>
+
+#if defined(_WIN32)
+#	if !defined(NOMINMAX)
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#	if defined(GetCurrentTime)
+#		undef GetCurrentTime
+#	endif
+#else
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+
+//!
+//! Cross-process profiling. A supervisor creates a named shared memory segment, and every
+//! process (including the supervisor) attaches to it and periodically publishes its markers.
+//! The segment has its own scope table shared by all processes, so published markers don't
+//! need to be remapped, and any process can then output a single trace of all processes.
+//!
+//! Everything in the segment is addressed by offsets, since it's mapped at different addresses
+//! in each process, and synchronized by atomics which are lock-free, thus address-free.
+//!
+namespace Profiler
+{
+	namespace SharedMemory
+	{
+
+		//! Magic number identifying a profiler segment
+		static const uint32_t Magic = 0x50524f46;
+
+		//! Maximum number of processes attached to a segment
+		static const uint32_t MaxProcesses = 256;
+
+		//! Number of slots of the segment's scope table
+		static const uint32_t MaxScopes = 65536;
+
+		//! Number of markers per block
+		static const uint64_t BlockCapacity = 65536;
+
+		//!
+		//! A marker in the segment. Times are in nanoseconds since the clock's epoch, which
+		//! is shared by all processes.
+		//!
+		struct Marker
+		{
+
+			//! The ID of the parent scope in the segment's scope table
+			uint32_t ParentScope;
+
+			//! The ID of the scope in the segment's scope table
+			uint32_t Scope;
+
+			//! Start point
+			int64_t Start;
+
+			//! End point
+			int64_t End;
+
+		};
+
+		//!
+		//! A scope in the segment's scope table
+		//!
+		struct Scope
+		{
+
+			//! Offset of the name, 0 if the slot is unused
+			uint64_t Name;
+
+			//! Offset of the filename
+			uint64_t Filename;
+
+			//! The line
+			uint32_t Line;
+
+			//! The hash of the name, filename and line
+			uint32_t Hash;
+
+		};
+
+		//!
+		//! An attached process
+		//!
+		struct Process
+		{
+
+			//! The system process ID
+			uint64_t ID;
+
+			//! Offset of the process name
+			uint64_t Name;
+
+		};
+
+		//!
+		//! A block of markers of a single thread. Blocks are chained, newest first.
+		//!
+		struct Block
+		{
+
+			//! Offset of the next block
+			uint64_t Next;
+
+			//! Index of the process in the segment's process table
+			uint32_t Process;
+
+			//! Index of the thread in its process (see MarkerBuffer::ThreadIndex)
+			uint32_t Thread;
+
+			//! Number of published markers
+			std::atomic< uint64_t > Count;
+
+			// followed by BlockCapacity markers
+
+		};
+
+		//!
+		//! The segment header
+		//!
+		struct Header
+		{
+
+			//! Magic number
+			uint32_t Magic;
+
+			//! Lock protecting the scope table, the process table and the block chain. This is
+			//! only taken when registering, never while recording.
+			std::atomic< uint32_t > Lock;
+
+			//! Size of the segment in bytes
+			uint64_t Size;
+
+			//! Number of bytes used, including the header
+			std::atomic< uint64_t > Used;
+
+			//! Creation time of the segment, in nanoseconds since the clock's epoch
+			int64_t StartTime;
+
+			//! Offset of the newest block
+			std::atomic< uint64_t > Blocks;
+
+			//! Number of attached processes
+			std::atomic< uint32_t > ProcessCount;
+
+			//! The attached processes
+			Process Processes[MaxProcesses];
+
+			//! The scope table
+			Scope Scopes[MaxScopes];
+
+		};
+
+		static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory profiling requires lock-free (thus address-free) atomics");
+
+		//!
+		//! A mapped segment
+		//!
+		class Segment
+		{
+
+		public:
+
+			//!
+			//! Constructor
+			//!
+			inline Segment(void)
+				: m_Data(nullptr)
+				, m_Size(0)
+#if defined(_WIN32)
+				, m_Handle(nullptr)
+#endif
+			{
+			}
+
+			//!
+			//! Destructor
+			//!
+			inline ~Segment(void)
+			{
+				this->Close();
+			}
+
+			//!
+			//! Map a segment, creating it if @p size is not 0
+			//!
+			inline bool Open(const String & name, uint64_t size)
+			{
+				this->Close();
+#if defined(_WIN32)
+				if (size != 0)
+				{
+					m_Handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), name.c_str());
+				}
+				else
+				{
+					m_Handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+				}
+				if (m_Handle == nullptr)
+				{
+					return false;
+				}
+				m_Data = reinterpret_cast< char * >(MapViewOfFile(m_Handle, FILE_MAP_ALL_ACCESS, 0, 0, SIZE_T(size)));
+				if (m_Data == nullptr)
+				{
+					this->Close();
+					return false;
+				}
+				m_Size = size != 0 ? size : reinterpret_cast< Header * >(m_Data)->Size;
+#else
+				String path = name[0] == '/' ? name : "/" + name;
+				int file = shm_open(path.c_str(), size != 0 ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+				if (file < 0)
+				{
+					return false;
+				}
+				struct stat info;
+				if ((size != 0 && ftruncate(file, off_t(size)) != 0) || fstat(file, &info) != 0)
+				{
+					close(file);
+					return false;
+				}
+				void * data = mmap(nullptr, size_t(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+				close(file);
+				if (data == MAP_FAILED)
+				{
+					return false;
+				}
+				m_Data = reinterpret_cast< char * >(data);
+				m_Size = uint64_t(info.st_size);
+#endif
+
+				// initialize the header of a new segment (the memory is zeroed by the system)
+				Header * header = this->GetHeader();
+				if (size != 0)
+				{
+					header->Size = size;
+					header->StartTime = std::chrono::duration_cast< std::chrono::nanoseconds >(GetCurrentTime().time_since_epoch()).count();
+					header->Used.store(sizeof(Header), std::memory_order_relaxed);
+					header->Magic = Magic;
+				}
+				else if (header->Magic != Magic)
+				{
+					this->Close();
+					return false;
+				}
+				return true;
+			}
+
+			//!
+			//! Unmap the segment
+			//!
+			inline void Close(void)
+			{
+#if defined(_WIN32)
+				if (m_Data != nullptr)
+				{
+					UnmapViewOfFile(m_Data);
+				}
+				if (m_Handle != nullptr)
+				{
+					CloseHandle(m_Handle);
+				}
+				m_Handle = nullptr;
+#else
+				if (m_Data != nullptr)
+				{
+					munmap(m_Data, size_t(m_Size));
+				}
+#endif
+				m_Data = nullptr;
+				m_Size = 0;
+			}
+
+			//!
+			//! Check if the segment is mapped
+			//!
+			inline bool IsOpen(void) const
+			{
+				return m_Data != nullptr;
+			}
+
+			//!
+			//! Get the header
+			//!
+			inline Header * GetHeader(void) const
+			{
+				return reinterpret_cast< Header * >(m_Data);
+			}
+
+			//!
+			//! Get a pointer from an offset
+			//!
+			template< typename Type >
+			inline Type * Get(uint64_t offset) const
+			{
+				return reinterpret_cast< Type * >(m_Data + offset);
+			}
+
+			//!
+			//! Allocate some bytes in the segment, aligned on 8 bytes.
+			//!
+			//! @return
+			//!		The offset of the allocated bytes, or 0 if the segment is full.
+			//!
+			inline uint64_t Allocate(uint64_t bytes)
+			{
+				bytes = (bytes + 7) & ~uint64_t(7);
+				uint64_t offset = this->GetHeader()->Used.fetch_add(bytes, std::memory_order_relaxed);
+				return offset + bytes <= m_Size ? offset : 0;
+			}
+
+			//!
+			//! Write a string in the segment (size then characters)
+			//!
+			//! @return
+			//!		The offset of the string, or 0 if the segment is full.
+			//!
+			inline uint64_t AllocateString(const char * string)
+			{
+				uint32_t size = static_cast< uint32_t >(strlen(string));
+				uint64_t offset = this->Allocate(sizeof(uint32_t) + size + 1);
+				if (offset != 0)
+				{
+					memcpy(this->Get< uint32_t >(offset), &size, sizeof(uint32_t));
+					memcpy(this->Get< char >(offset + sizeof(uint32_t)), string, size + 1);
+				}
+				return offset;
+			}
+
+			//!
+			//! Get a string written by AllocateString
+			//!
+			inline const char * GetString(uint64_t offset) const
+			{
+				return offset != 0 ? this->Get< char >(offset + sizeof(uint32_t)) : "";
+			}
+
+			//!
+			//! Take the segment's lock
+			//!
+			inline void Lock(void)
+			{
+				uint32_t expected = 0;
+				while (this->GetHeader()->Lock.compare_exchange_weak(expected, 1, std::memory_order_acquire) == false)
+				{
+					expected = 0;
+					std::this_thread::yield();
+				}
+			}
+
+			//!
+			//! Release the segment's lock
+			//!
+			inline void Unlock(void)
+			{
+				this->GetHeader()->Lock.store(0, std::memory_order_release);
+			}
+
+		private:
+
+			//! The mapped data
+			char * m_Data;
+
+			//! Size of the mapping
+			uint64_t m_Size;
+
+#if defined(_WIN32)
+			//! The file mapping handle
+			HANDLE m_Handle;
+#endif
+
+		};
+
+		//!
+		//! Publishing state of a local marker buffer
+		//!
+		struct BufferState
+		{
+
+			//! Thread index of the buffer when it was last published
+			uint32_t ThreadIndex;
+
+			//! Number of published markers
+			size_t Published;
+
+			//! Offset of the block currently filled
+			uint64_t Block;
+
+		};
+
+		//!
+		//! State of the current process
+		//!
+		struct State
+		{
+
+			//! The attached segment
+			Segment Attached;
+
+			//! The segment created by this process. It's kept mapped until removed, since
+			//! on some systems a segment is destroyed when no process maps it.
+			Segment Created;
+
+			//! Index of the process in the segment
+			uint32_t Process;
+
+			//! Segment scope ID of each local scope, -1 if not yet registered
+			Vector< uint32_t > Scopes;
+
+			//! The publishing state of the local buffers
+			std::unordered_map< MarkerBuffer *, BufferState > Buffers;
+
+			//! Mutex protecting the state
+			Mutex StateMutex;
+
+		};
+
+		//!
+		//! Get the state of the current process
+		//!
+		inline State & GetState(void)
+		{
+			static State state;
+			return state;
+		}
+
+		//!
+		//! Convert a time point to nanoseconds since the clock's epoch
+		//!
+		inline int64_t GetTime(TimePoint time)
+		{
+			return std::chrono::duration_cast< std::chrono::nanoseconds >(time.time_since_epoch()).count();
+		}
+
+		//!
+		//! Get the segment scope ID of a local scope, registering it if needed. The
+		//! segment's lock must be taken.
+		//!
+		inline uint32_t GetScope(Segment & segment, ScopeID id)
+		{
+			const ScopeData & scope = Data->Scopes[id];
+			const char * name = scope.Name != nullptr ? scope.Name : "";
+			const char * filename = scope.Filename != nullptr ? scope.Filename : "";
+			uint32_t hash = Hash::Combine(Hash::Jenkins(name, strlen(name)), Hash::Jenkins(filename, strlen(filename)), scope.Line);
+			Scope * scopes = segment.GetHeader()->Scopes;
+			for (uint32_t i = 0; i < MaxScopes; ++i)
+			{
+				uint32_t slot = (hash + i) & (MaxScopes - 1);
+				if (scopes[slot].Name == 0)
+				{
+					uint64_t nameOffset = segment.AllocateString(name);
+					uint64_t filenameOffset = segment.AllocateString(filename);
+					if (nameOffset == 0 || filenameOffset == 0)
+					{
+						return static_cast< uint32_t >(-1);
+					}
+					scopes[slot] = { nameOffset, filenameOffset, scope.Line, hash };
+					return slot;
+				}
+				if (scopes[slot].Hash == hash &&
+					scopes[slot].Line == scope.Line &&
+					strcmp(segment.GetString(scopes[slot].Name), name) == 0 &&
+					strcmp(segment.GetString(scopes[slot].Filename), filename) == 0)
+				{
+					return slot;
+				}
+			}
+			return static_cast< uint32_t >(-1);
+		}
+
+		//!
+		//! Create a new segment. This is usually done by the supervisor process, which then
+		//! attaches to it like the other ones. The memory is only committed when used.
+		//!
+		//! @param name
+		//!		Name of the segment.
+		//!
+		//! @param size
+		//!		Size of the segment in bytes.
+		//!
+		inline bool Create(const String & name, uint64_t size)
+		{
+			State & state = GetState();
+			ScopedLock< Mutex > lock(state.StateMutex);
+			return state.Created.Open(name, size < sizeof(Header) ? sizeof(Header) : size);
+		}
+
+		//!
+		//! Remove a segment. Processes which mapped it keep their mapping.
+		//!
+		inline void Remove(const String & name)
+		{
+			State & state = GetState();
+			ScopedLock< Mutex > lock(state.StateMutex);
+			state.Created.Close();
+#if !defined(_WIN32)
+			shm_unlink((name[0] == '/' ? name : "/" + name).c_str());
+#else
+			(void)name;
+#endif
+		}
+
+		//!
+		//! Attach the current process to an existing segment.
+		//!
+		//! @param name
+		//!		Name of the segment.
+		//!
+		//! @param processName
+		//!		Name displayed for this process in the traces.
+		//!
+		inline bool Attach(const String & name, const String & processName = "")
+		{
+			State & state = GetState();
+			ScopedLock< Mutex > lock(state.StateMutex);
+			if (state.Attached.Open(name, 0) == false)
+			{
+				return false;
+			}
+
+			// register the process
+			Segment & segment = state.Attached;
+			Header * header = segment.GetHeader();
+			segment.Lock();
+			state.Process = header->ProcessCount.load(std::memory_order_relaxed);
+			if (state.Process < MaxProcesses)
+			{
+#if defined(_WIN32)
+				uint64_t pid = GetCurrentProcessId();
+#else
+				uint64_t pid = uint64_t(getpid());
+#endif
+				String displayName = processName.empty() == true ? "Process " + std::to_string(pid) : processName;
+				header->Processes[state.Process] = { pid, segment.AllocateString(displayName.c_str()) };
+				header->ProcessCount.store(state.Process + 1, std::memory_order_release);
+			}
+			segment.Unlock();
+			if (state.Process >= MaxProcesses)
+			{
+				state.Attached.Close();
+				return false;
+			}
+
+			state.Scopes.clear();
+			state.Buffers.clear();
+			return true;
+		}
+
+		//!
+		//! Publish the markers recorded since the last call to the attached segment. Call this
+		//! periodically, and before clearing the profiler data.
+		//!
+		//! @return
+		//!		false if the process is not attached, or the segment is full. The markers whose
+		//!		scope doesn't fit in the segment are dropped.
+		//!
+		inline bool Publish(void)
+		{
+			State & state = GetState();
+			ScopedLock< Mutex > lock(state.StateMutex);
+			if (state.Attached.IsOpen() == false)
+			{
+				return false;
+			}
+
+			Segment & segment = state.Attached;
+			ScopedLock< Mutex > lockMarkers(Data->MarkerMutex);
+			bool result = true;
+			for (MarkerBuffer * buffer : Data->MarkerLists)
+			{
+				// a buffer might have been cleared, or recycled for a new thread
+				BufferState & published = state.Buffers[buffer];
+				if (published.ThreadIndex != buffer->ThreadIndex || published.Published > buffer->List.size())
+				{
+					published = { buffer->ThreadIndex, 0, 0 };
+				}
+
+				for (size_t i = published.Published, iend = buffer->List.size(); i < iend; ++i)
+				{
+					const MarkerData & marker = buffer->List[i];
+
+					// get the segment scopes
+					ScopeID maxScope = std::max(marker.Scope, marker.ParentScope != static_cast< ScopeID >(-1) ? marker.ParentScope : 0);
+					if (state.Scopes.size() <= maxScope)
+					{
+						state.Scopes.resize(maxScope + 1, static_cast< uint32_t >(-1));
+					}
+					uint32_t & scope = state.Scopes[marker.Scope];
+					uint32_t * parent = marker.ParentScope != static_cast< ScopeID >(-1) ? &state.Scopes[marker.ParentScope] : nullptr;
+					if (scope == static_cast< uint32_t >(-1) || (parent != nullptr && *parent == static_cast< uint32_t >(-1)))
+					{
+						segment.Lock();
+						scope = GetScope(segment, marker.Scope);
+						if (parent != nullptr)
+						{
+							*parent = GetScope(segment, marker.ParentScope);
+						}
+						segment.Unlock();
+					}
+
+					// the segment has no room left for the scope: skip the marker
+					if (scope == static_cast< uint32_t >(-1))
+					{
+						result = false;
+						published.Published = i + 1;
+						continue;
+					}
+
+					// get a block with some room
+					Block * block = published.Block != 0 ? segment.Get< Block >(published.Block) : nullptr;
+					if (block == nullptr || block->Count.load(std::memory_order_relaxed) == BlockCapacity)
+					{
+						uint64_t offset = segment.Allocate(sizeof(Block) + BlockCapacity * sizeof(Marker));
+						if (offset == 0)
+						{
+							result = false;
+							break;
+						}
+						block = segment.Get< Block >(offset);
+						block->Process = state.Process;
+						block->Thread = buffer->ThreadIndex;
+						block->Count.store(0, std::memory_order_relaxed);
+						segment.Lock();
+						block->Next = segment.GetHeader()->Blocks.load(std::memory_order_relaxed);
+						segment.GetHeader()->Blocks.store(offset, std::memory_order_release);
+						segment.Unlock();
+						published.Block = offset;
+					}
+
+					// write the marker, and publish it
+					uint64_t count = block->Count.load(std::memory_order_relaxed);
+					Marker * markers = reinterpret_cast< Marker * >(block + 1);
+					markers[count] = {
+						parent != nullptr ? *parent : static_cast< uint32_t >(-1),
+						scope,
+						GetTime(marker.Start),
+						GetTime(marker.End)
+					};
+					block->Count.store(count + 1, std::memory_order_release);
+					published.Published = i + 1;
+				}
+			}
+
+			// forget the buffers which are no longer used
+			for (auto entry = state.Buffers.begin(); entry != state.Buffers.end(); )
+			{
+				if (std::find(Data->MarkerLists.begin(), Data->MarkerLists.end(), entry->first) == Data->MarkerLists.end())
+				{
+					entry = state.Buffers.erase(entry);
+				}
+				else
+				{
+					++entry;
+				}
+			}
+			return result;
+		}
+
+		//!
+		//! Publish the remaining markers, and detach from the segment.
+		//!
+		inline void Detach(void)
+		{
+			Publish();
+			State & state = GetState();
+			ScopedLock< Mutex > lock(state.StateMutex);
+			state.Attached.Close();
+		}
+
+		//!
+		//! Output the markers of every process attached to a segment to a JSON file that can
+		//! be loaded by "chrome://tracing". This can be done by any process, attached or not.
+		//!
+		inline bool ChromeTracing(const String & name, const String & filename)
+		{
+			Segment segment;
+			if (segment.Open(name, 0) == false)
+			{
+				return false;
+			}
+			Header * header = segment.GetHeader();
+
+			// open the output file
+			std::ofstream file(filename);
+			file << "[";
+
+			// name the processes
+			bool first = true;
+			for (uint32_t i = 0, iend = header->ProcessCount.load(std::memory_order_acquire); i < iend; ++i)
+			{
+				file << (first == true ? "" : ",") << std::endl;
+				first = false;
+				file << "{ \"ph\": \"M\", \"pid\": " << header->Processes[i].ID << ", \"name\": \"process_name\", ";
+				file << "\"args\": { \"name\": " << Output::GetJsonString(segment.GetString(header->Processes[i].Name)) << " } }";
+			}
+
+			// and write the markers
+			for (uint64_t offset = header->Blocks.load(std::memory_order_acquire); offset != 0; )
+			{
+				const Block * block = segment.Get< Block >(offset);
+				const Marker * markers = reinterpret_cast< const Marker * >(block + 1);
+				uint64_t pid = header->Processes[block->Process].ID;
+				for (uint64_t i = 0, iend = block->Count.load(std::memory_order_acquire); i < iend; ++i)
+				{
+					const Marker & marker = markers[i];
+					if (marker.Scope >= MaxScopes)
+					{
+						continue;
+					}
+					const Scope & scope = header->Scopes[marker.Scope];
+					String scopeFilename = segment.GetString(scope.Filename);
+					std::replace(scopeFilename.begin(), scopeFilename.end(), '\\', '/');
+					file << (first == true ? "" : ",") << std::endl;
+					first = false;
+					file << "{ \"cat\": \"perf\", \"ph\": \"X\", \"pid\": " << pid << ", ";
+					file << "\"name\": " << Output::GetJsonString(segment.GetString(scope.Name)) << ", ";
+					file << "\"tid\": " << block->Thread << ", ";
+					file << "\"ts\": " << (marker.Start - header->StartTime) / 1000 << ", ";
+					file << "\"dur\": " << (marker.End - marker.Start) / 1000 << ", ";
+					file << "\"args\": { \"filename\": " << Output::GetJsonString(scopeFilename) << ", \"line\": " << scope.Line << " } }";
+				}
+				offset = block->Next;
+			}
+
+			// close
+			file << std::endl << "]" << std::endl;
+			return true;
+		}
+
+	} // namespace SharedMemory
+} // namespace Profiler
+
+
+#endif // PROFILER_ENABLE
+
+
+#endif // PROFILER_SHARED_MEMORY_H
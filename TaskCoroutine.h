@@ -0,0 +1,628 @@
+#ifndef TASK_COROUTINE_H
+#define TASK_COROUTINE_H
+
+
+#include "TaskManager.h"
+
+#if TASK_MANAGER_COROUTINES == 1
+
+#include <exception>
+#include <optional>
+
+
+//!
+//! Allocation of coroutine frames. Frames of up to 2 KB come from the TaskBlockPool, so
+//! that creating coroutines doesn't allocate once the pools are warm. Promises inherit
+//! from this to use it.
+//!
+struct CoroutineFrame
+{
+
+	//!
+	//! Allocate a frame
+	//!
+	static inline void * operator new(size_t size)
+	{
+		return size <= 128 ? TaskBlockPool< 128 >::Allocate()
+			: size <= 256 ? TaskBlockPool< 256 >::Allocate()
+			: size <= 512 ? TaskBlockPool< 512 >::Allocate()
+			: size <= 1024 ? TaskBlockPool< 1024 >::Allocate()
+			: size <= 2048 ? TaskBlockPool< 2048 >::Allocate()
+			: ::operator new(size);
+	}
+
+	//!
+	//! Deallocate a frame
+	//!
+	static inline void operator delete(void * pointer, size_t size)
+	{
+		if (size <= 128)
+		{
+			TaskBlockPool< 128 >::Deallocate(pointer);
+		}
+		else if (size <= 256)
+		{
+			TaskBlockPool< 256 >::Deallocate(pointer);
+		}
+		else if (size <= 512)
+		{
+			TaskBlockPool< 512 >::Deallocate(pointer);
+		}
+		else if (size <= 1024)
+		{
+			TaskBlockPool< 1024 >::Deallocate(pointer);
+		}
+		else if (size <= 2048)
+		{
+			TaskBlockPool< 2048 >::Deallocate(pointer);
+		}
+		else
+		{
+			::operator delete(pointer);
+		}
+	}
+
+};
+
+
+template< typename Type > class CoTask;
+
+//!
+//! Part of the promise of a CoTask which doesn't depend on its result: the coroutine awaiting
+//! it, and the exception it threw.
+//!
+class CoTaskPromiseBase
+	: public CoroutineFrame
+{
+
+public:
+
+	//!
+	//! Resume the awaiting coroutine when the task is done, without growing the stack
+	//!
+	struct FinalAwaiter
+	{
+		inline bool await_ready(void) const noexcept
+		{
+			return false;
+		}
+
+		template< typename Promise >
+		inline std::coroutine_handle<> await_suspend(std::coroutine_handle< Promise > coroutine) noexcept
+		{
+			std::coroutine_handle<> continuation = coroutine.promise().Continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		inline void await_resume(void) const noexcept
+		{
+		}
+	};
+
+	//! Tasks are started when they're awaited
+	inline std::suspend_always initial_suspend(void) const noexcept
+	{
+		return {};
+	}
+
+	//! Resume the awaiting coroutine
+	inline FinalAwaiter final_suspend(void) const noexcept
+	{
+		return {};
+	}
+
+	//! Keep the exception, it's rethrown to the awaiting coroutine
+	inline void unhandled_exception(void) noexcept
+	{
+		Exception = std::current_exception();
+	}
+
+	//! The coroutine awaiting the task
+	std::coroutine_handle<> Continuation;
+
+	//! The exception thrown by the task
+	std::exception_ptr Exception;
+
+};
+
+//!
+//! Promise of a CoTask returning a value
+//!
+template< typename Type >
+class CoTaskPromise
+	: public CoTaskPromiseBase
+{
+
+public:
+
+	inline CoTask< Type > get_return_object(void)
+	{
+		return CoTask< Type >(std::coroutine_handle< CoTaskPromise >::from_promise(*this));
+	}
+
+	template< typename Value >
+	inline void return_value(Value && value)
+	{
+		Result.emplace(std::forward< Value >(value));
+	}
+
+	//! Get the result, or rethrow the exception
+	inline Type GetResult(void)
+	{
+		if (Exception)
+		{
+			std::rethrow_exception(Exception);
+		}
+		return std::move(*Result);
+	}
+
+	//! The result
+	std::optional< Type > Result;
+
+};
+
+//!
+//! Promise of a CoTask returning nothing
+//!
+template<>
+class CoTaskPromise< void >
+	: public CoTaskPromiseBase
+{
+
+public:
+
+	inline CoTask< void > get_return_object(void);
+
+	inline void return_void(void) const noexcept
+	{
+	}
+
+	//! Rethrow the exception, if any
+	inline void GetResult(void)
+	{
+		if (Exception)
+		{
+			std::rethrow_exception(Exception);
+		}
+	}
+
+};
+
+//!
+//! Lazily started coroutine returning @p Type. It starts when it's awaited, on the awaiting
+//! thread, and resumes the awaiting coroutine when it's done. Use `co_await manager.Schedule()`
+//! to continue on the task manager's threads. A task must be awaited (or passed to WhenAll,
+//! WhenAny or SyncWait) until it's done before being destroyed.
+//!
+//! ```cpp
+//! CoTask< int > Load(TaskManager & manager)
+//! {
+//!		co_await manager.Schedule();
+//!		co_return Read();
+//! }
+//! ```
+//!
+template< typename Type = void >
+class CoTask
+{
+
+	template< typename Other > friend class CoTaskPromise;
+
+public:
+
+	//! The promise
+	typedef CoTaskPromise< Type > promise_type;
+
+	//!
+	//! Default constructor. The task is invalid.
+	//!
+	inline CoTask(void)
+		: m_Coroutine(nullptr)
+	{
+	}
+
+	//!
+	//! Move constructor
+	//!
+	inline CoTask(CoTask && other) noexcept
+		: m_Coroutine(other.m_Coroutine)
+	{
+		other.m_Coroutine = nullptr;
+	}
+
+	//!
+	//! Move assignment
+	//!
+	inline CoTask & operator = (CoTask && other) noexcept
+	{
+		std::swap(m_Coroutine, other.m_Coroutine);
+		return *this;
+	}
+
+	CoTask(const CoTask &) = delete;
+	CoTask & operator = (const CoTask &) = delete;
+
+	//!
+	//! Destructor
+	//!
+	inline ~CoTask(void)
+	{
+		if (m_Coroutine)
+		{
+			m_Coroutine.destroy();
+		}
+	}
+
+	//!
+	//! Check if the task is done
+	//!
+	inline bool IsReady(void) const
+	{
+		return !m_Coroutine || m_Coroutine.done();
+	}
+
+	//!
+	//! Get the result of a task which is done, or rethrow its exception
+	//!
+	inline Type GetResult(void)
+	{
+		assert(this->IsReady() == true);
+		return m_Coroutine.promise().GetResult();
+	}
+
+	//!
+	//! Awaitable starting the task, and resuming the awaiting coroutine when it's done
+	//!
+	struct ReadyAwaiter
+	{
+		inline bool await_ready(void) const noexcept
+		{
+			return !Coroutine || Coroutine.done();
+		}
+
+		inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+		{
+			Coroutine.promise().Continuation = awaiting;
+			return Coroutine;
+		}
+
+		inline void await_resume(void) const noexcept
+		{
+		}
+
+		//! The task
+		std::coroutine_handle< promise_type > Coroutine;
+	};
+
+	//!
+	//! Awaitable returning the result of the task
+	//!
+	struct ResultAwaiter
+		: public ReadyAwaiter
+	{
+		inline Type await_resume(void)
+		{
+			return this->Coroutine.promise().GetResult();
+		}
+	};
+
+	//!
+	//! Await the task, and get its result
+	//!
+	inline ResultAwaiter operator co_await (void) &&
+	{
+		return ResultAwaiter{ { m_Coroutine } };
+	}
+
+	//!
+	//! Await the task, without taking its result (see GetResult)
+	//!
+	inline ReadyAwaiter WhenReady(void)
+	{
+		return ReadyAwaiter{ m_Coroutine };
+	}
+
+private:
+
+	//!
+	//! Constructor
+	//!
+	inline explicit CoTask(std::coroutine_handle< promise_type > coroutine)
+		: m_Coroutine(coroutine)
+	{
+	}
+
+	//! The coroutine
+	std::coroutine_handle< promise_type > m_Coroutine;
+
+};
+
+inline CoTask< void > CoTaskPromise< void >::get_return_object(void)
+{
+	return CoTask< void >(std::coroutine_handle< CoTaskPromise >::from_promise(*this));
+}
+
+//!
+//! Coroutine started immediately, and destroying itself when it's done. Used to be notified
+//! of the completion of tasks.
+//!
+struct CoDetached
+{
+
+	struct promise_type
+		: public CoroutineFrame
+	{
+		inline CoDetached get_return_object(void) const noexcept
+		{
+			return {};
+		}
+
+		inline std::suspend_never initial_suspend(void) const noexcept
+		{
+			return {};
+		}
+
+		inline std::suspend_never final_suspend(void) const noexcept
+		{
+			return {};
+		}
+
+		inline void return_void(void) const noexcept
+		{
+		}
+
+		inline void unhandled_exception(void) const noexcept
+		{
+			std::terminate();
+		}
+	};
+
+};
+
+//!
+//! Start @p task, and call @p function once it's done
+//!
+template< typename Type, typename Function >
+inline CoDetached CoTaskNotify(CoTask< Type > & task, Function function)
+{
+	co_await task.WhenReady();
+	function();
+}
+
+//!
+//! Awaitable starting tasks, and resuming the awaiting coroutine once they're all done
+//!
+template< typename Type >
+struct WhenAllAwaiter
+{
+	inline bool await_ready(void) const noexcept
+	{
+		return Tasks.empty();
+	}
+
+	inline bool await_suspend(std::coroutine_handle<> awaiting)
+	{
+		// one more for this function, so that the last task can't resume the awaiting
+		// coroutine before all of them are started
+		Awaiting = awaiting;
+		Count = Tasks.size() + 1;
+		for (CoTask< Type > & task : Tasks)
+		{
+			CoTaskNotify(task, [this] (void) {
+				if (Count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					Awaiting.resume();
+				}
+			});
+		}
+		return Count.fetch_sub(1, std::memory_order_acq_rel) != 1;
+	}
+
+	inline void await_resume(void) const noexcept
+	{
+	}
+
+	//! The tasks
+	std::vector< CoTask< Type > > & Tasks;
+
+	//! Number of tasks not done yet
+	std::atomic< size_t > Count;
+
+	//! The coroutine awaiting the tasks
+	std::coroutine_handle<> Awaiting;
+};
+
+//!
+//! Run tasks concurrently, and get their results in the same order. The tasks start on the
+//! awaiting thread, so they should start by scheduling themselves on a task manager. If some
+//! throw, the first one's exception is rethrown.
+//!
+template< typename Type >
+inline CoTask< std::vector< Type > > WhenAll(std::vector< CoTask< Type > > tasks)
+{
+	co_await WhenAllAwaiter< Type >{ tasks, { 0 }, nullptr };
+	std::vector< Type > results;
+	results.reserve(tasks.size());
+	for (CoTask< Type > & task : tasks)
+	{
+		results.push_back(task.GetResult());
+	}
+	co_return results;
+}
+
+//!
+//! Run tasks returning nothing concurrently (see WhenAll)
+//!
+inline CoTask< void > WhenAll(std::vector< CoTask< void > > tasks)
+{
+	co_await WhenAllAwaiter< void >{ tasks, { 0 }, nullptr };
+	for (CoTask< void > & task : tasks)
+	{
+		task.GetResult();
+	}
+}
+
+//!
+//! Result of WhenAny: the index of the first task done, and its result
+//!
+template< typename Type >
+struct WhenAnyResult
+{
+	typedef std::pair< size_t, Type > Result;
+};
+
+template<>
+struct WhenAnyResult< void >
+{
+	typedef size_t Result;
+};
+
+//!
+//! State of WhenAny, shared with the tasks still running when the first one is done
+//!
+template< typename Type >
+struct WhenAnyState
+{
+	//! The tasks
+	std::vector< CoTask< Type > > Tasks;
+
+	//! Set by the first task done
+	std::atomic< bool > Done;
+
+	//! Index of the first task done
+	size_t Index;
+
+	//! The coroutine awaiting the first task
+	std::coroutine_handle<> Awaiting;
+};
+
+//!
+//! Awaitable starting tasks, and resuming the awaiting coroutine when one of them is done
+//!
+template< typename Type >
+struct WhenAnyAwaiter
+{
+	inline bool await_ready(void) const noexcept
+	{
+		return false;
+	}
+
+	inline void await_suspend(std::coroutine_handle<> awaiting)
+	{
+		// the first task done can resume the awaiting coroutine before the others are started,
+		// so this only uses a copy of the state from now on
+		std::shared_ptr< WhenAnyState< Type > > state = State;
+		state->Awaiting = awaiting;
+		for (size_t i = 0; i < state->Tasks.size(); ++i)
+		{
+			CoTaskNotify(state->Tasks[i], [state, i] (void) {
+				if (state->Done.exchange(true, std::memory_order_acq_rel) == false)
+				{
+					state->Index = i;
+					state->Awaiting.resume();
+				}
+			});
+		}
+	}
+
+	inline void await_resume(void) const noexcept
+	{
+	}
+
+	//! The shared state
+	std::shared_ptr< WhenAnyState< Type > > State;
+};
+
+//!
+//! Get the first task done out of @p tasks, and its result. The others keep running, and
+//! are destroyed once they're done. There must be at least one task.
+//!
+template< typename Type >
+inline CoTask< typename WhenAnyResult< Type >::Result > WhenAny(std::vector< CoTask< Type > > tasks)
+{
+	assert(tasks.empty() == false);
+	std::shared_ptr< WhenAnyState< Type > > state = std::make_shared< WhenAnyState< Type > >();
+	state->Tasks = std::move(tasks);
+	state->Done = false;
+	// a named awaiter: GCC 12 destroys braced temporary awaiters twice
+	WhenAnyAwaiter< Type > awaiter{ state };
+	co_await awaiter;
+	if constexpr (std::is_void< Type >::value == true)
+	{
+		state->Tasks[state->Index].GetResult();
+		co_return state->Index;
+	}
+	else
+	{
+		co_return std::make_pair(state->Index, state->Tasks[state->Index].GetResult());
+	}
+}
+
+//!
+//! Block the current thread until @p task is done, and get its result. A worker of @p manager
+//! executes queued tasks meanwhile (see TaskManager::Wait( WaitGroup & ))
+//!
+template< typename Type >
+inline Type SyncWait(TaskManager & manager, CoTask< Type > task)
+{
+	WaitGroup done(1);
+	CoTaskNotify(task, [&done] (void) {
+		done.Done();
+	});
+	manager.Wait(done);
+	return task.GetResult();
+}
+
+//!
+//! Awaitable on the result of a TaskFuture
+//!
+template< typename Type >
+struct TaskFutureAwaiter
+{
+	inline bool await_ready(void) const
+	{
+		return Future.IsReady();
+	}
+
+	inline void await_suspend(std::coroutine_handle<> awaiting)
+	{
+		this->Resume(awaiting, std::is_void< Type >());
+	}
+
+	inline typename TaskFuture< Type >::Reference await_resume(void) const
+	{
+		return Future.Get();
+	}
+
+	inline void Resume(std::coroutine_handle<> awaiting, std::false_type)
+	{
+		Future.Then([awaiting] (const Type &) {
+			awaiting.resume();
+		});
+	}
+
+	inline void Resume(std::coroutine_handle<> awaiting, std::true_type)
+	{
+		Future.Then([awaiting] (void) {
+			awaiting.resume();
+		});
+	}
+
+	//! The future
+	TaskFuture< Type > Future;
+};
+
+//!
+//! Await the result of a task pushed with TaskManager::Submit. The coroutine is resumed by
+//! the thread setting the value.
+//!
+template< typename Type >
+inline TaskFutureAwaiter< Type > operator co_await (const TaskFuture< Type > & future)
+{
+	return TaskFutureAwaiter< Type >{ future };
+}
+
+
+#endif // TASK_MANAGER_COROUTINES == 1
+
+#endif // TASK_COROUTINE_H
@@ -0,0 +1,310 @@
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+
+#include "TaskManager.h"
+
+
+//!
+//! A graph of tasks, executed by a TaskManager. Nodes and edges are declared once, and the
+//! graph can then be run any number of times: each node is pushed as soon as all the nodes
+//! it depends on are done. Running a graph doesn't allocate, apart from the task manager's
+//! pools warming up.
+//!
+class TaskGraph
+{
+
+public:
+
+	//!
+	//! Constructor
+	//!
+	inline TaskGraph(void)
+		: m_Manager(nullptr)
+		, m_Prepared(false)
+	{
+	}
+
+	//!
+	//! Destructor. Waits for the current run.
+	//!
+	inline ~TaskGraph(void)
+	{
+		this->Wait();
+	}
+
+	TaskGraph(const TaskGraph &) = delete;
+	TaskGraph & operator = (const TaskGraph &) = delete;
+
+	//!
+	//! Add a node, and get its index. The task is called with the `void *` of the thread
+	//! executing it (see TaskManager::SetThreadLocalStorage) each time the graph runs.
+	//!
+	inline int AddNode(TaskFunction && task)
+	{
+		assert(this->IsRunning() == false);
+		m_Nodes.emplace_back(std::move(task));
+		m_Prepared = false;
+		return static_cast< int >(m_Nodes.size()) - 1;
+	}
+
+	//!
+	//! Make the node @p to depend on the node @p from
+	//!
+	inline void AddEdge(int from, int to)
+	{
+		assert(this->IsRunning() == false);
+		assert(from >= 0 && from < static_cast< int >(m_Nodes.size()));
+		assert(to >= 0 && to < static_cast< int >(m_Nodes.size()));
+		m_Nodes[from].Successors.push_back(to);
+		++m_Nodes[to].Dependencies;
+		m_Prepared = false;
+	}
+
+	//!
+	//! Get the number of nodes
+	//!
+	inline int GetNodeCount(void) const
+	{
+		return static_cast< int >(m_Nodes.size());
+	}
+
+	//!
+	//! Start running the graph on @p manager. Returns immediately, use Wait to wait for the
+	//! graph to complete. The graph must not have cycles, and must not be modified or run
+	//! again until the current run is complete. If the manager cancels the tasks (see
+	//! TaskManager::Cancel) the nodes which didn't run yet are skipped, and the run completes.
+	//!
+	inline void Run(TaskManager & manager)
+	{
+		assert(this->IsRunning() == false);
+		this->Prepare();
+		if (m_Nodes.empty() == true)
+		{
+			return;
+		}
+
+		m_Manager = &manager;
+		m_Done.Add(static_cast< int >(m_Nodes.size()));
+		for (size_t i = 0; i < m_Nodes.size(); ++i)
+		{
+			m_Pending[i].store(m_Nodes[i].Dependencies, std::memory_order_relaxed);
+		}
+		for (int root : m_Roots)
+		{
+			this->Push(root);
+		}
+	}
+
+	//!
+	//! Stall the current thread until the current run is complete. Workers of the task
+	//! manager running the graph execute queued tasks meanwhile.
+	//!
+	inline void Wait(void)
+	{
+		if (m_Manager != nullptr)
+		{
+			m_Manager->Wait(m_Done);
+		}
+	}
+
+	//!
+	//! Check if the graph is running
+	//!
+	inline bool IsRunning(void) const
+	{
+		return m_Done.IsDone() == false;
+	}
+
+private:
+
+	//!
+	//! A node of the graph
+	//!
+	struct Node
+	{
+		//! Constructor
+		inline Node(TaskFunction && task)
+			: Task(std::move(task))
+			, Dependencies(0)
+		{
+		}
+
+		//! The task
+		TaskFunction Task;
+
+		//! The nodes depending on this one
+		std::vector< int > Successors;
+
+		//! Number of nodes this one depends on
+		int Dependencies;
+	};
+
+	//!
+	//! Allocate the dependency counters and find the roots, if the graph changed
+	//!
+	inline void Prepare(void)
+	{
+		if (m_Prepared == true)
+		{
+			return;
+		}
+
+		m_Pending.reset(new std::atomic< int >[m_Nodes.size()]);
+		m_Roots.clear();
+		for (size_t i = 0; i < m_Nodes.size(); ++i)
+		{
+			if (m_Nodes[i].Dependencies == 0)
+			{
+				m_Roots.push_back(static_cast< int >(i));
+			}
+		}
+		assert(this->IsAcyclic() == true);
+		m_Prepared = true;
+	}
+
+	//!
+	//! Check that the graph doesn't have cycles, which would never complete
+	//!
+	inline bool IsAcyclic(void) const
+	{
+		std::vector< int > dependencies(m_Nodes.size());
+		for (size_t i = 0; i < m_Nodes.size(); ++i)
+		{
+			dependencies[i] = m_Nodes[i].Dependencies;
+		}
+		std::vector< int > ready(m_Roots);
+		size_t visited = 0;
+		while (ready.empty() == false)
+		{
+			int node = ready.back();
+			ready.pop_back();
+			++visited;
+			for (int successor : m_Nodes[node].Successors)
+			{
+				if (--dependencies[successor] == 0)
+				{
+					ready.push_back(successor);
+				}
+			}
+		}
+		return visited == m_Nodes.size();
+	}
+
+	//!
+	//! Task executing a node, or skipping it if it's dropped
+	//!
+	struct NodeTask
+	{
+		//! Execute the node
+		inline void operator () (void * data)
+		{
+			Graph->Execute(Node, data);
+		}
+
+		//! Skip the node
+		inline void Drop(void)
+		{
+			Graph->Skip(Node);
+		}
+
+		//! The graph
+		TaskGraph * Graph;
+
+		//! The node
+		int Node;
+	};
+
+	//!
+	//! Push a ready node to the task manager
+	//!
+	inline void Push(int node)
+	{
+		m_Manager->PushTask(DroppableTask< NodeTask >(NodeTask{ this, node }));
+	}
+
+	//!
+	//! Skip a node whose task was dropped, and the nodes it made ready, so that the run
+	//! completes. They're done without running their tasks.
+	//!
+	inline void Skip(int node)
+	{
+		while (node >= 0)
+		{
+			int next = -1;
+			for (int successor : m_Nodes[node].Successors)
+			{
+				if (m_Pending[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					if (next < 0)
+					{
+						next = successor;
+					}
+					else
+					{
+						this->Skip(successor);
+					}
+				}
+			}
+
+			// as in Execute, nothing can be accessed once the last node is done
+			m_Done.Done();
+			node = next;
+		}
+	}
+
+	//!
+	//! Execute a node, then the nodes it made ready. The first of those is executed on the
+	//! current thread instead of going through the task manager's queues.
+	//!
+	inline void Execute(int node, void * data)
+	{
+		while (node >= 0)
+		{
+			m_Nodes[node].Task(data);
+
+			int next = -1;
+			for (int successor : m_Nodes[node].Successors)
+			{
+				if (m_Pending[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					if (next < 0)
+					{
+						next = successor;
+					}
+					else
+					{
+						this->Push(successor);
+					}
+				}
+			}
+
+			// the graph might be destroyed as soon as the last node is done, so nothing can be
+			// accessed after that (there's no next node then)
+			m_Done.Done();
+			node = next;
+		}
+	}
+
+	//! The nodes
+	std::vector< Node > m_Nodes;
+
+	//! The nodes without dependencies
+	std::vector< int > m_Roots;
+
+	//! Number of dependencies of each node not done yet during the current run
+	std::unique_ptr< std::atomic< int >[] > m_Pending;
+
+	//! The task manager of the current run
+	TaskManager * m_Manager;
+
+	//! True if the dependency counters and the roots are up to date
+	bool m_Prepared;
+
+	//! The nodes not done yet during the current run
+	WaitGroup m_Done;
+
+};
+
+
+#endif // TASK_GRAPH_H
@@ -2,256 +2,3962 @@
 #define TASK_MANAGER_H
 
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__linux__)
+#	include <linux/futex.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+#include "Profiler.h"
 
 //!
-//! The task manager allows to easily create a pool thread and send jobs to
-//! it. Each job will be executed on an independent thread, in a FIFO fashion.
-//! It also provides a cheap thread local storage emulation capability.
+//! TaskManager::Schedule and TaskCoroutine.h are only available when the compiler supports
+//! C++20 coroutines.
 //!
-class TaskManager
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#	define TASK_MANAGER_COROUTINES 1
+#	include <coroutine>
+#else
+#	define TASK_MANAGER_COROUTINES 0
+#endif
+
+
+//!
+//! Chase-Lev work stealing deque of pointers. The owner thread pushes and pops at the
+//! bottom without locking, while other threads steal from the top with a CAS. When the
+//! ring buffer is full, it's replaced by a bigger copy. Old buffers are kept until the
+//! deque is destroyed, since stealers might still be reading them.
+//!
+template< typename Type >
+class WorkStealingDeque
 {
 
 public:
 
 	//!
-	//! Defines a simple task
+	//! Constructor
 	//!
-	typedef std::function< void (void *) > Task;
+	//! @param capacity
+	//!		Initial capacity. Must be a power of 2.
+	//!
+	inline WorkStealingDeque(int64_t capacity = 1024)
+		: m_Top(0)
+		, m_Bottom(0)
+		, m_Buffer(nullptr)
+	{
+		m_Buffers.emplace_back(new Buffer(capacity));
+		m_Buffer = m_Buffers.back().get();
+	}
 
 	//!
-	//! Constructor.
+	//! Push an item. Only the owner thread can call this.
 	//!
-	//! @param threadCount
-	//!		Optional number of thread used by the task manager. If omitted, the number
-	//!		of thread created will be the one supported by the platform.
+	inline void Push(Type * item)
+	{
+		int64_t bottom = m_Bottom.load(std::memory_order_relaxed);
+		int64_t top = m_Top.load(std::memory_order_acquire);
+		Buffer * buffer = m_Buffer.load(std::memory_order_relaxed);
+		if (bottom - top >= buffer->Capacity)
+		{
+			buffer = this->Grow(buffer, top, bottom);
+		}
+		buffer->Put(bottom, item);
+		m_Bottom.store(bottom + 1, std::memory_order_release);
+	}
+
 	//!
-	TaskManager(int threadCount = -1)
-		: m_State(State::Stopping)
-		, m_QueuedTaskCount(0)
-		, m_RunningThreadCount(0)
+	//! Pop the last pushed item, nullptr if the deque is empty. Only the owner thread
+	//! can call this.
+	//!
+	inline Type * Pop(void)
 	{
-		// init the threads
-		this->SetThreadCount(threadCount);
+		int64_t bottom = m_Bottom.load(std::memory_order_relaxed) - 1;
+		Buffer * buffer = m_Buffer.load(std::memory_order_relaxed);
+		m_Bottom.store(bottom, std::memory_order_seq_cst);
+		int64_t top = m_Top.load(std::memory_order_seq_cst);
+		if (top > bottom)
+		{
+			// empty
+			m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		Type * item = buffer->Get(bottom);
+		if (top == bottom)
+		{
+			// last item, race against the stealers
+			if (m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed) == false)
+			{
+				item = nullptr;
+			}
+			m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+		return item;
 	}
 
 	//!
-	//! Destructor. Cleanup the threads. This will stall the current
-	//! thread until all jobs are done processing and all threads have
-	//! been correctly stopped and cleaned up.
+	//! Steal the first pushed item. Returns nullptr if the deque is empty, or if another
+	//! thread took the item first. Can be called by any thread.
+	//!
+	inline Type * Steal(void)
+	{
+		int64_t top = m_Top.load(std::memory_order_seq_cst);
+		int64_t bottom = m_Bottom.load(std::memory_order_seq_cst);
+		if (top >= bottom)
+		{
+			return nullptr;
+		}
+		Type * item = m_Buffer.load(std::memory_order_acquire)->Get(top);
+		if (m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed) == false)
+		{
+			return nullptr;
+		}
+		return item;
+	}
+
+	//!
+	//! Check if the deque looks empty. This is only a hint when other threads use it.
+	//!
+	inline bool IsEmpty(void) const
+	{
+		return m_Top.load(std::memory_order_seq_cst) >= m_Bottom.load(std::memory_order_seq_cst);
+	}
+
+private:
+
+	//!
+	//! Ring buffer of the items
+	//!
+	struct Buffer
+	{
+		//! Constructor
+		inline Buffer(int64_t capacity)
+			: Capacity(capacity)
+			, Items(new std::atomic< Type * >[capacity])
+		{
+		}
+
+		//! Get an item
+		inline Type * Get(int64_t index) const
+		{
+			return Items[index & (Capacity - 1)].load(std::memory_order_relaxed);
+		}
+
+		//! Set an item
+		inline void Put(int64_t index, Type * item)
+		{
+			Items[index & (Capacity - 1)].store(item, std::memory_order_relaxed);
+		}
+
+		//! Number of items
+		int64_t Capacity;
+
+		//! The items
+		std::unique_ptr< std::atomic< Type * >[] > Items;
+	};
+
+	//!
+	//! Replace the buffer by one twice as big
+	//!
+	inline Buffer * Grow(Buffer * buffer, int64_t top, int64_t bottom)
+	{
+		Buffer * grown = new Buffer(buffer->Capacity * 2);
+		for (int64_t i = top; i < bottom; ++i)
+		{
+			grown->Put(i, buffer->Get(i));
+		}
+		m_Buffers.emplace_back(grown);
+		m_Buffer.store(grown, std::memory_order_release);
+		return grown;
+	}
+
+	//! Padding, so that the data allocated before the deque doesn't share m_Top's cache line.
+	//! Explicit padding is used instead of alignas, which C++11's new doesn't honor.
+	char m_TopPadding[64];
+
+	//! Index of the first item, incremented by stealers
+	std::atomic< int64_t > m_Top;
+
+	//! Padding, so that stealers updating m_Top don't invalidate the owner's m_Bottom
+	char m_BottomPadding[64 - sizeof(std::atomic< int64_t >)];
+
+	//! Index after the last item, only modified by the owner
+	std::atomic< int64_t > m_Bottom;
+
+	//! The current buffer
+	std::atomic< Buffer * > m_Buffer;
+
+	//! All the buffers allocated so far
+	std::vector< std::unique_ptr< Buffer > > m_Buffers;
+
+};
+
+
+//!
+//! FIFO queue stored in a ring buffer. Unlike std::queue, it doesn't allocate once it
+//! grew to its maximum size. Not thread safe.
+//!
+template< typename Type >
+class RingQueue
+{
+
+public:
+
+	//!
+	//! Constructor
+	//!
+	//! @param capacity
+	//!		Initial capacity. Must be a power of 2.
+	//!
+	inline RingQueue(size_t capacity = 1024)
+		: m_Items(capacity)
+		, m_Front(0)
+		, m_Count(0)
+	{
+	}
+
+	//!
+	//! Push an item at the back
+	//!
+	inline void Push(const Type & item)
+	{
+		if (m_Count == m_Items.size())
+		{
+			std::vector< Type > items(m_Items.size() * 2);
+			for (size_t i = 0; i < m_Count; ++i)
+			{
+				items[i] = m_Items[(m_Front + i) & (m_Items.size() - 1)];
+			}
+			m_Items.swap(items);
+			m_Front = 0;
+		}
+		m_Items[(m_Front + m_Count) & (m_Items.size() - 1)] = item;
+		++m_Count;
+	}
+
+	//!
+	//! Get the front item
+	//!
+	inline const Type & Front(void) const
+	{
+		assert(m_Count > 0);
+		return m_Items[m_Front];
+	}
+
+	//!
+	//! Remove the front item
+	//!
+	inline void Pop(void)
+	{
+		assert(m_Count > 0);
+		m_Front = (m_Front + 1) & (m_Items.size() - 1);
+		--m_Count;
+	}
+
+	//!
+	//! Check if the queue is empty
+	//!
+	inline bool IsEmpty(void) const
+	{
+		return m_Count == 0;
+	}
+
+private:
+
+	//! The items
+	std::vector< Type > m_Items;
+
+	//! Index of the front item
+	size_t m_Front;
+
+	//! Number of items
+	size_t m_Count;
+
+};
+
+
+//!
+//! Hierarchical timer wheel: 4 levels of 64 slots, each slot of a level covering 64 ticks of
+//! the previous one. A timer goes to the lowest level covering its expiration, and moves down
+//! a level each time the wheel's current tick reaches its slot, so inserting and cancelling
+//! are O(1) Timers are stored in a vector, linked in the slots by index, and reused once
+//! they expired or were cancelled. Not thread safe.
+//!
+template< typename Type >
+class TimerWheel
+{
+
+public:
+
+	//! ID of a timer. 0 is never a valid ID.
+	typedef uint64_t ID;
+
+	//!
+	//! Constructor
+	//!
+	inline TimerWheel(void)
+		: m_Now(0)
+		, m_Count(0)
+		, m_Free(Invalid)
+	{
+		for (uint32_t level = 0; level < Levels; ++level)
+		{
+			m_Occupied[level] = 0;
+			for (uint32_t slot = 0; slot < Slots; ++slot)
+			{
+				m_Heads[level][slot] = Invalid;
+			}
+		}
+	}
+
+	//!
+	//! Add a timer expiring at @p tick, or at the next tick if it already passed
+	//!
+	inline ID Insert(uint64_t tick, Type && value)
+	{
+		uint32_t index = m_Free;
+		if (index != Invalid)
+		{
+			m_Free = m_Nodes[index].Next;
+			m_Nodes[index].Value = std::move(value);
+		}
+		else
+		{
+			index = static_cast< uint32_t >(m_Nodes.size());
+			m_Nodes.push_back(Node(std::move(value)));
+		}
+		Node & node = m_Nodes[index];
+		node.Expire = std::max(tick, m_Now + 1);
+		node.Active = true;
+		this->Link(index);
+		++m_Count;
+		return (static_cast< uint64_t >(node.Generation) << 32) | index;
+	}
+
+	//!
+	//! Remove a timer. Returns false if it already expired, or was already cancelled.
+	//!
+	inline bool Cancel(ID id)
+	{
+		uint32_t index = static_cast< uint32_t >(id);
+		if (index >= m_Nodes.size() || m_Nodes[index].Generation != static_cast< uint32_t >(id >> 32) || m_Nodes[index].Active == false)
+		{
+			return false;
+		}
+		this->Unlink(index);
+		this->Free(index);
+		return true;
+	}
+
+	//!
+	//! Move the current tick to @p tick, calling `function(value)` for each timer expiring.
+	//! It returns the number of ticks after which the timer expires again, or 0 to remove
+	//! it (in which case it can move the value) @p function must not modify the wheel.
+	//!
+	template< typename Function >
+	inline void Advance(uint64_t tick, Function & function)
+	{
+		if (m_Count == 0)
+		{
+			m_Now = std::max(m_Now, tick);
+			return;
+		}
+		while (m_Now < tick)
+		{
+			++m_Now;
+
+			// move the timers of the higher levels' current slots down, when their lower levels
+			// wrapped around
+			for (uint32_t level = 1; level < Levels && (m_Now & ((uint64_t(1) << (SlotBits * level)) - 1)) == 0; ++level)
+			{
+				uint32_t index = this->Detach(level, static_cast< uint32_t >(m_Now >> (SlotBits * level)) & (Slots - 1));
+				while (index != Invalid)
+				{
+					uint32_t next = m_Nodes[index].Next;
+					this->Link(index);
+					index = next;
+				}
+			}
+
+			// expire the timers of the current slot
+			uint32_t index = this->Detach(0, static_cast< uint32_t >(m_Now) & (Slots - 1));
+			while (index != Invalid)
+			{
+				uint32_t next = m_Nodes[index].Next;
+				uint64_t period = function(m_Nodes[index].Value);
+				if (period == 0)
+				{
+					this->Free(index);
+				}
+				else
+				{
+					m_Nodes[index].Expire = m_Now + period;
+					this->Link(index);
+				}
+				index = next;
+			}
+		}
+	}
+
+	//!
+	//! Get the next tick at which Advance might expire timers, or UINT64_MAX if there are
+	//! no timers. This is exact for the timers of the first level, and the next wrap around
+	//! of the first level otherwise.
+	//!
+	inline uint64_t GetNextTick(void) const
+	{
+		if (m_Count == 0)
+		{
+			return UINT64_MAX;
+		}
+		uint64_t next = UINT64_MAX;
+		for (uint32_t level = 1; level < Levels; ++level)
+		{
+			if (m_Occupied[level] != 0)
+			{
+				next = ((m_Now >> SlotBits) + 1) << SlotBits;
+				break;
+			}
+		}
+		if (m_Occupied[0] != 0)
+		{
+			// rotate the slots so that the first bit is the next tick's slot
+			uint32_t shift = static_cast< uint32_t >(m_Now + 1) & (Slots - 1);
+			uint64_t occupied = shift == 0 ? m_Occupied[0] : (m_Occupied[0] >> shift) | (m_Occupied[0] << (Slots - shift));
+			uint64_t ticks = 0;
+			while ((occupied & 1) == 0)
+			{
+				occupied >>= 1;
+				++ticks;
+			}
+			next = std::min(next, m_Now + 1 + ticks);
+		}
+		return next;
+	}
+
+	//!
+	//! Get the current tick
+	//!
+	inline uint64_t GetTick(void) const
+	{
+		return m_Now;
+	}
+
+	//!
+	//! Get the number of timers
+	//!
+	inline size_t GetCount(void) const
+	{
+		return m_Count;
+	}
+
+private:
+
+	//! Layout of the wheel
+	enum : uint32_t
+	{
+		Levels		= 4,
+		SlotBits	= 6,
+		Slots		= 1 << SlotBits,
+		Invalid		= 0xffffffff
+	};
+
+	//!
+	//! A timer
+	//!
+	struct Node
+	{
+		//! Constructor
+		inline Node(Type && value)
+			: Value(std::move(value))
+			, Expire(0)
+			, Previous(Invalid)
+			, Next(Invalid)
+			, Generation(1)
+			, Level(0)
+			, Slot(0)
+			, Active(false)
+		{
+		}
+
+		//! The value
+		Type Value;
+
+		//! Tick at which the timer expires
+		uint64_t Expire;
+
+		//! Previous timer of the slot
+		uint32_t Previous;
+
+		//! Next timer of the slot, or of the free list
+		uint32_t Next;
+
+		//! Incremented each time the node is reused, to invalidate old IDs
+		uint32_t Generation;
+
+		//! Level of the slot
+		uint8_t Level;
+
+		//! Index of the slot
+		uint8_t Slot;
+
+		//! True if the timer is in a slot
+		bool Active;
+	};
+
+	//!
+	//! Link a timer to the slot of its expiration
+	//!
+	inline void Link(uint32_t index)
+	{
+		Node & node = m_Nodes[index];
+		uint64_t delta = node.Expire > m_Now ? node.Expire - m_Now : 0;
+		uint64_t expire = std::max(node.Expire, m_Now);
+		uint32_t level = 0;
+		while (level < Levels - 1 && delta >= (uint64_t(1) << (SlotBits * (level + 1))))
+		{
+			++level;
+		}
+		if (delta >= (uint64_t(1) << (SlotBits * Levels)))
+		{
+			// beyond the wheel: park it in the last slot, it'll cascade there again
+			expire = m_Now + (uint64_t(1) << (SlotBits * Levels)) - 1;
+		}
+		uint32_t slot = static_cast< uint32_t >(expire >> (SlotBits * level)) & (Slots - 1);
+		node.Level = static_cast< uint8_t >(level);
+		node.Slot = static_cast< uint8_t >(slot);
+		node.Previous = Invalid;
+		node.Next = m_Heads[level][slot];
+		if (node.Next != Invalid)
+		{
+			m_Nodes[node.Next].Previous = index;
+		}
+		m_Heads[level][slot] = index;
+		m_Occupied[level] |= uint64_t(1) << slot;
+	}
+
+	//!
+	//! Unlink a timer from its slot
+	//!
+	inline void Unlink(uint32_t index)
+	{
+		Node & node = m_Nodes[index];
+		if (node.Previous != Invalid)
+		{
+			m_Nodes[node.Previous].Next = node.Next;
+		}
+		else
+		{
+			m_Heads[node.Level][node.Slot] = node.Next;
+			if (node.Next == Invalid)
+			{
+				m_Occupied[node.Level] &= ~(uint64_t(1) << node.Slot);
+			}
+		}
+		if (node.Next != Invalid)
+		{
+			m_Nodes[node.Next].Previous = node.Previous;
+		}
+	}
+
+	//!
+	//! Empty a slot, and get its first timer
+	//!
+	inline uint32_t Detach(uint32_t level, uint32_t slot)
+	{
+		uint32_t index = m_Heads[level][slot];
+		m_Heads[level][slot] = Invalid;
+		m_Occupied[level] &= ~(uint64_t(1) << slot);
+		return index;
+	}
+
+	//!
+	//! Put an unlinked timer in the free list
+	//!
+	inline void Free(uint32_t index)
+	{
+		Node & node = m_Nodes[index];
+		node.Value = Type();
+		node.Active = false;
+		if (++node.Generation == 0)
+		{
+			node.Generation = 1;
+		}
+		node.Next = m_Free;
+		m_Free = index;
+		--m_Count;
+	}
+
+	//! The current tick
+	uint64_t m_Now;
+
+	//! Number of timers
+	size_t m_Count;
+
+	//! First free node
+	uint32_t m_Free;
+
+	//! The timers
+	std::vector< Node > m_Nodes;
+
+	//! First timer of each slot
+	uint32_t m_Heads[Levels][Slots];
+
+	//! Bit mask of the non-empty slots of each level
+	uint64_t m_Occupied[Levels];
+
+};
+
+
+//!
+//! Thread safe pool of memory blocks of @a Size bytes. Each thread has its own cache of free
+//! blocks, so allocating and deallocating doesn't lock. Caches exchange batches of blocks with
+//! a shared list when they're empty or too big, which is what happens when blocks are allocated
+//! by a thread and deallocated by another. The memory is never released to the system.
+//!
+template< size_t Size >
+class TaskBlockPool
+{
+
+public:
+
+	//!
+	//! Allocate a block
+	//!
+	static inline void * Allocate(void)
+	{
+		Cache & cache = GetCache();
+		if (cache.Head == nullptr)
+		{
+			cache.Refill();
+		}
+		Block * block = cache.Head;
+		cache.Head = block->Next;
+		--cache.Count;
+		return block;
+	}
+
+	//!
+	//! Deallocate a block, possibly allocated by another thread
+	//!
+	static inline void Deallocate(void * pointer)
+	{
+		Cache & cache = GetCache();
+		Block * block = static_cast< Block * >(pointer);
+		block->Next = cache.Head;
+		cache.Head = block;
+		if (++cache.Count >= 2 * BatchSize)
+		{
+			cache.Release(BatchSize);
+		}
+	}
+
+private:
+
+	//! Number of blocks exchanged between the caches and the shared list
+	enum : size_t { BatchSize = 256 };
+
+	//!
+	//! A block. When it's free, it's used as a node of the free list
+	//!
+	union Block
+	{
+		Block * Next;
+		typename std::aligned_storage< Size, alignof(std::max_align_t) >::type Data;
+	};
+
+	//!
+	//! The shared batches of free blocks
+	//!
+	struct Shared
+	{
+		std::mutex Mutex;
+		std::vector< std::pair< Block *, size_t > > Batches;
+	};
+
+	//!
+	//! Get the shared batches. They're never destroyed, since caches of exiting threads use
+	//! them, possibly after static objects have been destroyed.
+	//!
+	static inline Shared & GetShared(void)
+	{
+		static Shared * shared = new Shared();
+		return *shared;
+	}
+
+	//!
+	//! Per-thread cache of free blocks
+	//!
+	struct Cache
+	{
+		//! Constructor
+		inline Cache(void)
+			: Head(nullptr)
+			, Count(0)
+		{
+		}
+
+		//! Destructor. Give the blocks back to the shared list.
+		inline ~Cache(void)
+		{
+			this->Release(Count);
+		}
+
+		//! Get a batch of blocks from the shared list, or allocate a new one
+		inline void Refill(void)
+		{
+			Shared & shared = GetShared();
+			{
+				std::lock_guard< std::mutex > lock(shared.Mutex);
+				if (shared.Batches.empty() == false)
+				{
+					Head = shared.Batches.back().first;
+					Count = shared.Batches.back().second;
+					shared.Batches.pop_back();
+					return;
+				}
+			}
+			Block * blocks = static_cast< Block * >(::operator new(BatchSize * sizeof(Block)));
+			for (size_t i = 0; i < BatchSize; ++i)
+			{
+				blocks[i].Next = i + 1 < BatchSize ? blocks + i + 1 : nullptr;
+			}
+			Head = blocks;
+			Count = BatchSize;
+		}
+
+		//! Give @p count blocks to the shared list
+		inline void Release(size_t count)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+			Block * first = Head;
+			Block * last = Head;
+			for (size_t i = 1; i < count; ++i)
+			{
+				last = last->Next;
+			}
+			Head = last->Next;
+			Count -= count;
+			last->Next = nullptr;
+			Shared & shared = GetShared();
+			std::lock_guard< std::mutex > lock(shared.Mutex);
+			shared.Batches.push_back({ first, count });
+		}
+
+		//! First free block
+		Block * Head;
+
+		//! Number of free blocks
+		size_t Count;
+	};
+
+	//!
+	//! Get the current thread's cache
+	//!
+	static inline Cache & GetCache(void)
+	{
+		static thread_local Cache cache;
+		return cache;
+	}
+
+};
+
+//!
+//! Allocation of objects of @a Size bytes aligned on @a Align. Objects of up to 2 KB come from
+//! the TaskBlockPool of their size class. Bigger ones, which would make the pools keep a lot
+//! of memory, and over-aligned ones are allocated.
+//!
+template< size_t Size, size_t Align >
+class TaskBlock
+{
+
+public:
+
+	//!
+	//! Allocate a block
+	//!
+	static inline void * Allocate(void)
+	{
+		return Allocate(std::integral_constant< bool, Pooled >());
+	}
+
+	//!
+	//! Deallocate a block
+	//!
+	static inline void Deallocate(void * pointer)
+	{
+		Deallocate(pointer, std::integral_constant< bool, Pooled >());
+	}
+
+private:
+
+	//! Size of the pooled block, 0 if the object isn't pooled
+	enum : size_t
+	{
+		BlockSize = Align > alignof(std::max_align_t) ? 0
+			: Size <= 128 ? 128
+			: Size <= 256 ? 256
+			: Size <= 512 ? 512
+			: Size <= 1024 ? 1024
+			: Size <= 2048 ? 2048
+			: 0
+	};
+
+	//! True if the object is pooled
+	enum : bool { Pooled = BlockSize != 0 };
+
+	//! The pool of the block
+	typedef TaskBlockPool< Pooled == true ? static_cast< size_t >(BlockSize) : 1 > Pool;
+
+	static inline void * Allocate(std::true_type)
+	{
+		return Pool::Allocate();
+	}
+
+	static inline void Deallocate(void * pointer, std::true_type)
+	{
+		Pool::Deallocate(pointer);
+	}
+
+	//! Allocate, aligning by hand if needed. The allocated pointer is stored before the block.
+	static inline void * Allocate(std::false_type)
+	{
+		if (Align <= alignof(std::max_align_t))
+		{
+			return ::operator new(Size);
+		}
+		void * memory = ::operator new(Size + Align);
+		void * block = reinterpret_cast< void * >((reinterpret_cast< uintptr_t >(memory) + Align) & ~uintptr_t(Align - 1));
+		static_cast< void ** >(block)[-1] = memory;
+		return block;
+	}
+
+	static inline void Deallocate(void * pointer, std::false_type)
+	{
+		::operator delete(Align <= alignof(std::max_align_t) ? pointer : static_cast< void ** >(pointer)[-1]);
+	}
+
+};
+
+//!
+//! Move-only task, callable with a `void *` (see TaskManager::PushTask) Callables of up to
+//! InlineSize bytes are stored inline, and bigger ones in pooled blocks (see TaskBlockPool)
+//! so that creating tasks usually doesn't allocate.
+//!
+class TaskFunction
+{
+
+public:
+
+	//! Size of the inline storage
+	enum : size_t { InlineSize = 64 };
+
+	//!
+	//! Check if callables of type @a Type are stored inline. They must be small enough, and
+	//! nothrow move constructible.
+	//!
+	template< typename Type >
+	struct IsInline
+		: std::integral_constant< bool, sizeof(Type) <= InlineSize && alignof(Type) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible< Type >::value >
+	{
+	};
+
+	//!
+	//! Default constructor. The task is empty.
+	//!
+	inline TaskFunction(void)
+		: m_Operations(nullptr)
+	{
+	}
+
+	//!
+	//! Construct from a callable
+	//!
+	template<
+		typename Function,
+		typename = typename std::enable_if< std::is_same< typename std::decay< Function >::type, TaskFunction >::value == false >::type
+	>
+	inline TaskFunction(Function && function)
+		: m_Operations(&Operations< typename std::decay< Function >::type >::Table)
+	{
+		typedef typename std::decay< Function >::type Type;
+		Operations< Type >::Construct(&m_Storage, std::forward< Function >(function));
+	}
+
+	//!
+	//! Move constructor
+	//!
+	inline TaskFunction(TaskFunction && other) noexcept
+		: m_Operations(other.m_Operations)
+	{
+		if (m_Operations != nullptr)
+		{
+			m_Operations->Move(&other.m_Storage, &m_Storage);
+			other.m_Operations = nullptr;
+		}
+	}
+
+	//!
+	//! Move assignment
+	//!
+	inline TaskFunction & operator = (TaskFunction && other) noexcept
+	{
+		if (this != &other)
+		{
+			this->Reset();
+			m_Operations = other.m_Operations;
+			if (m_Operations != nullptr)
+			{
+				m_Operations->Move(&other.m_Storage, &m_Storage);
+				other.m_Operations = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	TaskFunction(const TaskFunction &) = delete;
+	TaskFunction & operator = (const TaskFunction &) = delete;
+
+	//!
+	//! Destructor
+	//!
+	inline ~TaskFunction(void)
+	{
+		this->Reset();
+	}
+
+	//!
+	//! Execute the task
+	//!
+	inline void operator () (void * data)
+	{
+		m_Operations->Invoke(&m_Storage, data);
+	}
+
+	//!
+	//! Check if the task is not empty
+	//!
+	inline explicit operator bool (void) const
+	{
+		return m_Operations != nullptr;
+	}
+
+	//!
+	//! Destroy the callable, leaving the task empty
+	//!
+	inline void Reset(void)
+	{
+		if (m_Operations != nullptr)
+		{
+			m_Operations->Destroy(&m_Storage);
+			m_Operations = nullptr;
+		}
+	}
+
+private:
+
+	//! The inline storage
+	typedef std::aligned_storage< InlineSize, alignof(std::max_align_t) >::type Storage;
+
+	//!
+	//! Type erased operations on the stored callable
+	//!
+	struct OperationTable
+	{
+		void (*Invoke)(Storage * storage, void * data);
+		void (*Move)(Storage * from, Storage * to);
+		void (*Destroy)(Storage * storage);
+	};
+
+	//!
+	//! Operations on callables stored inline
+	//!
+	template< typename Type, bool Inline = IsInline< Type >::value >
+	struct Operations
+	{
+		template< typename Function >
+		static inline void Construct(Storage * storage, Function && function)
+		{
+			new (storage) Type(std::forward< Function >(function));
+		}
+
+		static inline void Invoke(Storage * storage, void * data)
+		{
+			(*reinterpret_cast< Type * >(storage))(data);
+		}
+
+		static inline void Move(Storage * from, Storage * to)
+		{
+			new (to) Type(std::move(*reinterpret_cast< Type * >(from)));
+			reinterpret_cast< Type * >(from)->~Type();
+		}
+
+		static inline void Destroy(Storage * storage)
+		{
+			reinterpret_cast< Type * >(storage)->~Type();
+		}
+
+		static const OperationTable Table;
+	};
+
+	//!
+	//! Operations on bigger callables, stored in a pooled block (or allocated if really big)
+	//!
+	template< typename Type >
+	struct Operations< Type, false >
+	{
+		static_assert(alignof(Type) <= alignof(std::max_align_t), "Over-aligned tasks are not supported");
+
+		//! Size of the pooled block, 0 if the callable is too big for the pools
+		enum : size_t { BlockSize = sizeof(Type) <= 128 ? 128 : sizeof(Type) <= 256 ? 256 : sizeof(Type) <= 512 ? 512 : 0 };
+
+		template< typename Function >
+		static inline void Construct(Storage * storage, Function && function)
+		{
+			void * memory = BlockSize != 0 ? TaskBlockPool< BlockSize != 0 ? static_cast< size_t >(BlockSize) : 1 >::Allocate() : ::operator new(sizeof(Type));
+			*reinterpret_cast< Type ** >(storage) = new (memory) Type(std::forward< Function >(function));
+		}
+
+		static inline void Invoke(Storage * storage, void * data)
+		{
+			(**reinterpret_cast< Type ** >(storage))(data);
+		}
+
+		static inline void Move(Storage * from, Storage * to)
+		{
+			*reinterpret_cast< Type ** >(to) = *reinterpret_cast< Type ** >(from);
+		}
+
+		static inline void Destroy(Storage * storage)
+		{
+			Type * callable = *reinterpret_cast< Type ** >(storage);
+			callable->~Type();
+			if (BlockSize != 0)
+			{
+				TaskBlockPool< BlockSize != 0 ? static_cast< size_t >(BlockSize) : 1 >::Deallocate(callable);
+			}
+			else
+			{
+				::operator delete(callable);
+			}
+		}
+
+		static const OperationTable Table;
+	};
+
+	//! The callable's operations, nullptr if the task is empty
+	const OperationTable * m_Operations;
+
+	//! The callable, or a pointer to it
+	Storage m_Storage;
+
+};
+
+template< typename Type, bool Inline >
+const TaskFunction::OperationTable TaskFunction::Operations< Type, Inline >::Table = {
+	&TaskFunction::Operations< Type, Inline >::Invoke,
+	&TaskFunction::Operations< Type, Inline >::Move,
+	&TaskFunction::Operations< Type, Inline >::Destroy
+};
+
+template< typename Type >
+const TaskFunction::OperationTable TaskFunction::Operations< Type, false >::Table = {
+	&TaskFunction::Operations< Type, false >::Invoke,
+	&TaskFunction::Operations< Type, false >::Move,
+	&TaskFunction::Operations< Type, false >::Destroy
+};
+
+//!
+//! Task calling `Drop()` on its callable instead of executing it, if it's destroyed without
+//! being executed. This happens when it's cancelled (see TaskManager::Cancel) or pushed
+//! while the task manager is paused. Tasks counted by a WaitGroup use this to be counted
+//! as done anyway, so that their waiter doesn't hang.
+//!
+template< typename Function >
+class DroppableTask
+{
+
+public:
+
+	//!
+	//! Constructor
+	//!
+	inline explicit DroppableTask(const Function & function)
+		: m_Function(function)
+		, m_Pending(true)
+	{
+	}
+
+	//!
+	//! Move constructor
+	//!
+	inline DroppableTask(DroppableTask && other) noexcept(std::is_nothrow_move_constructible< Function >::value)
+		: m_Function(std::move(other.m_Function))
+		, m_Pending(other.m_Pending)
+	{
+		other.m_Pending = false;
+	}
+
+	DroppableTask(const DroppableTask &) = delete;
+	DroppableTask & operator = (const DroppableTask &) = delete;
+
+	//!
+	//! Destructor. Drop the callable if it wasn't executed.
+	//!
+	inline ~DroppableTask(void)
+	{
+		if (m_Pending == true)
+		{
+			m_Function.Drop();
+		}
+	}
+
+	//!
+	//! Execute the task
+	//!
+	inline void operator () (void * data)
+	{
+		m_Pending = false;
+		m_Function(data);
+	}
+
+private:
+
+	//! The callable
+	Function m_Function;
+
+	//! True until the task is executed or moved from
+	bool m_Pending;
+
+};
+
+
+//!
+//! Futex-style waiting on a 32 bits atomic: Wait blocks while the atomic has the expected
+//! value, until Wake is called on it. Wait can return spuriously, so callers loop. On Linux
+//! this uses futexes directly, elsewhere a fixed table of mutexes and condition variables
+//! indexed by the address.
+//!
+struct Futex
+{
+
+	//!
+	//! Block while @p word is @p expected, until a Wake
+	//!
+	static inline void Wait(std::atomic< int > & word, int expected)
+	{
+#if defined(__linux__)
+		syscall(SYS_futex, reinterpret_cast< int * >(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+		Bucket & bucket = GetBucket(&word);
+		std::unique_lock< std::mutex > lock(bucket.Mutex);
+		if (word.load(std::memory_order_seq_cst) == expected)
+		{
+			bucket.ConditionVariable.wait(lock);
+		}
+#endif
+	}
+
+	//!
+	//! Wake all the threads waiting on @p word. This doesn't access @p word, so the atomic
+	//! can be destroyed as soon as its waiters can see the new value.
+	//!
+	static inline void WakeAll(std::atomic< int > * word)
+	{
+#if defined(__linux__)
+		syscall(SYS_futex, reinterpret_cast< int * >(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+		Bucket & bucket = GetBucket(word);
+		{
+			std::lock_guard< std::mutex > lock(bucket.Mutex);
+		}
+		bucket.ConditionVariable.notify_all();
+#endif
+	}
+
+#if !defined(__linux__)
+
+private:
+
+	//!
+	//! Waiters of the addresses with the same hash
+	//!
+	struct Bucket
+	{
+		std::mutex Mutex;
+		std::condition_variable ConditionVariable;
+	};
+
+	//!
+	//! Get the bucket of an address
+	//!
+	static inline Bucket & GetBucket(const void * address)
+	{
+		static Bucket buckets[64];
+		return buckets[(reinterpret_cast< uintptr_t >(address) >> 4) % 64];
+	}
+
+#endif
+
+};
+
+//!
+//! Counts the tasks of a group, and wakes the threads waiting for them when the count
+//! reaches 0. Waiting threads block on the count (see Futex) instead of polling, and
+//! completing a task only makes a system call if some thread is waiting.
+//! TaskManager::Wait( WaitGroup & ) also executes queued tasks while waiting.
+//!
+class WaitGroup
+{
+
+public:
+
+	//!
+	//! Constructor
+	//!
+	inline WaitGroup(int count = 0)
+		: m_State(count)
+	{
+		assert(count >= 0);
+	}
+
+	WaitGroup(const WaitGroup &) = delete;
+	WaitGroup & operator = (const WaitGroup &) = delete;
+
+	//!
+	//! Add @p count tasks to the group
+	//!
+	inline void Add(int count = 1)
+	{
+		// when the group was done, the previous waiters are gone: clear their flag in the same
+		// atomic operation, so that a new waiter can't wait on a flag that's about to be cleared
+		int state = m_State.load(std::memory_order_relaxed);
+		int next = 0;
+		do
+		{
+			assert((state & CountMask) + count < CountMask);
+			next = (state & CountMask) == 0 ? (state + count) & ~WaitingFlag : state + count;
+		} while (m_State.compare_exchange_weak(state, next, std::memory_order_relaxed) == false);
+	}
+
+	//!
+	//! Mark a task of the group as done. The group can be destroyed as soon as this makes
+	//! it done.
+	//!
+	inline void Done(void)
+	{
+		int previous = m_State.fetch_sub(1, std::memory_order_acq_rel);
+		assert((previous & CountMask) > 0);
+		if (previous == (WaitingFlag | 1))
+		{
+			Futex::WakeAll(&m_State);
+		}
+	}
+
+	//!
+	//! Check if all the tasks of the group are done
+	//!
+	inline bool IsDone(void) const
+	{
+		return (m_State.load(std::memory_order_acquire) & CountMask) == 0;
+	}
+
+	//!
+	//! Get the number of tasks not done yet
+	//!
+	inline int GetCount(void) const
+	{
+		return m_State.load(std::memory_order_acquire) & CountMask;
+	}
+
+	//!
+	//! Block the current thread until all the tasks of the group are done
+	//!
+	inline void Wait(void)
+	{
+		int state = m_State.load(std::memory_order_acquire);
+		while ((state & CountMask) != 0)
+		{
+			if ((state & WaitingFlag) == 0)
+			{
+				if (m_State.compare_exchange_weak(state, state | WaitingFlag, std::memory_order_acq_rel, std::memory_order_acquire) == false)
+				{
+					continue;
+				}
+				state |= WaitingFlag;
+			}
+			Futex::Wait(m_State, state);
+			state = m_State.load(std::memory_order_acquire);
+		}
+	}
+
+private:
+
+	//! Layout of the state: the count, and a flag set when some threads wait
+	enum : int
+	{
+		CountMask	= 0x3fffffff,
+		WaitingFlag	= 0x40000000
+	};
+
+	//! The count and the waiting flag. This is the futex word.
+	std::atomic< int > m_State;
+
+};
+
+
+//!
+//! Shared state of a TaskFuture. It's allocated with TaskBlock and reference counted.
+//! Continuations are kept in a lock-free list, which is replaced by a marker when the
+//! value is set.
+//!
+template< typename Type >
+class TaskFutureState
+{
+
+public:
+
+	//! The type returned by Get
+	typedef typename std::conditional< std::is_void< Type >::value, void, typename std::add_lvalue_reference< const Type >::type >::type Reference;
+
+	//!
+	//! Create a state, with a reference
+	//!
+	static inline TaskFutureState * Create(void)
+	{
+		return new (TaskBlock< sizeof(TaskFutureState), alignof(TaskFutureState) >::Allocate()) TaskFutureState();
+	}
+
+	//!
+	//! Add a reference
+	//!
+	inline void AddReference(void)
+	{
+		m_References.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//!
+	//! Remove a reference, destroying the state when it was the last one
+	//!
+	inline void Release(void)
+	{
+		if (m_References.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			this->~TaskFutureState();
+			TaskBlock< sizeof(TaskFutureState), alignof(TaskFutureState) >::Deallocate(this);
+		}
+	}
+
+	//!
+	//! Check if the value was set
+	//!
+	inline bool IsReady(void) const
+	{
+		return m_Continuations.load(std::memory_order_acquire) == GetCompleted();
+	}
+
+	//!
+	//! Get the value. The state must be ready.
+	//!
+	inline Reference Get(void) const
+	{
+		assert(this->IsReady() == true);
+		return this->GetValue(std::is_void< Type >());
+	}
+
+	//!
+	//! Set the value to the result of @p function called with @p arguments, then execute the
+	//! continuations on the current thread.
+	//!
+	//! @param data
+	//!		The thread local storage passed to the continuations.
+	//!
+	template< typename Function, typename ... Arguments >
+	inline void Execute(void * data, Function & function, Arguments && ... arguments)
+	{
+		this->SetValue(std::is_void< Type >(), function, std::forward< Arguments >(arguments) ...);
+
+		// take the continuations, and execute them in the order they were added
+		Continuation * continuation = m_Continuations.exchange(GetCompleted(), std::memory_order_acq_rel);
+		Continuation * reversed = nullptr;
+		while (continuation != nullptr)
+		{
+			Continuation * next = continuation->Next;
+			continuation->Next = reversed;
+			reversed = continuation;
+			continuation = next;
+		}
+		while (reversed != nullptr)
+		{
+			Continuation * next = reversed->Next;
+			reversed->Function(data);
+			DeleteContinuation(reversed);
+			reversed = next;
+		}
+	}
+
+	//!
+	//! Add a continuation, executed when the value is set. Returns false if the value was
+	//! already set, in which case @p function is left untouched.
+	//!
+	inline bool AddContinuation(TaskFunction & function)
+	{
+		Continuation * continuation = new (TaskBlock< sizeof(Continuation), alignof(Continuation) >::Allocate()) Continuation(std::move(function));
+		Continuation * head = m_Continuations.load(std::memory_order_acquire);
+		do
+		{
+			if (head == GetCompleted())
+			{
+				function = std::move(continuation->Function);
+				DeleteContinuation(continuation);
+				return false;
+			}
+			continuation->Next = head;
+		} while (m_Continuations.compare_exchange_weak(head, continuation, std::memory_order_acq_rel, std::memory_order_acquire) == false);
+		return true;
+	}
+
+private:
+
+	//!
+	//! A node of the continuation list
+	//!
+	struct Continuation
+	{
+		//! Constructor
+		inline Continuation(TaskFunction && function)
+			: Function(std::move(function))
+			, Next(nullptr)
+		{
+		}
+
+		//! The continuation
+		TaskFunction Function;
+
+		//! The next node
+		Continuation * Next;
+	};
+
+	//! Storage of the value
+	typedef typename std::conditional< std::is_void< Type >::value, char, Type >::type Value;
+
+	//!
+	//! Constructor
+	//!
+	inline TaskFutureState(void)
+		: m_References(1)
+		, m_Continuations(nullptr)
+	{
+	}
+
+	//!
+	//! Destructor. Continuations of a state which never got its value are dropped.
+	//!
+	inline ~TaskFutureState(void)
+	{
+		Continuation * continuation = m_Continuations.load(std::memory_order_acquire);
+		if (continuation == GetCompleted())
+		{
+			this->DestroyValue(std::is_void< Type >());
+			return;
+		}
+		while (continuation != nullptr)
+		{
+			Continuation * next = continuation->Next;
+			DeleteContinuation(continuation);
+			continuation = next;
+		}
+	}
+
+	//!
+	//! Marker replacing the continuation list once the value is set
+	//!
+	static inline Continuation * GetCompleted(void)
+	{
+		static Continuation * completed = reinterpret_cast< Continuation * >(&completed);
+		return completed;
+	}
+
+	//!
+	//! Destroy a continuation and give it back to the pool
+	//!
+	static inline void DeleteContinuation(Continuation * continuation)
+	{
+		continuation->~Continuation();
+		TaskBlock< sizeof(Continuation), alignof(Continuation) >::Deallocate(continuation);
+	}
+
+	template< typename Function, typename ... Arguments >
+	inline void SetValue(std::false_type, Function & function, Arguments && ... arguments)
+	{
+		new (&m_Storage) Value(function(std::forward< Arguments >(arguments) ...));
+	}
+
+	template< typename Function, typename ... Arguments >
+	inline void SetValue(std::true_type, Function & function, Arguments && ... arguments)
+	{
+		function(std::forward< Arguments >(arguments) ...);
+	}
+
+	inline Reference GetValue(std::false_type) const
+	{
+		return *reinterpret_cast< const Value * >(&m_Storage);
+	}
+
+	inline Reference GetValue(std::true_type) const
+	{
+	}
+
+	inline void DestroyValue(std::false_type)
+	{
+		reinterpret_cast< Value * >(&m_Storage)->~Value();
+	}
+
+	inline void DestroyValue(std::true_type)
+	{
+	}
+
+	//! Number of references
+	std::atomic< int > m_References;
+
+	//! The continuations to execute when the value is set
+	std::atomic< Continuation * > m_Continuations;
+
+	//! The value
+	typename std::aligned_storage< sizeof(Value), alignof(Value) >::type m_Storage;
+
+};
+
+//!
+//! Result of a task pushed with TaskManager::Submit. This is a cheap handle on a pooled
+//! state, and can be copied. Continuations added with Then are executed by the thread
+//! which sets the value.
+//!
+template< typename Type >
+class TaskFuture
+{
+
+	template< typename Other > friend class TaskFuture;
+
+	//!
+	//! Result of a continuation
+	//!
+	template< typename Function, bool Void = std::is_void< Type >::value >
+	struct ResultOf
+	{
+		typedef decltype(std::declval< Function & >()(std::declval< const Type & >())) Result;
+	};
+
+	template< typename Function >
+	struct ResultOf< Function, true >
+	{
+		typedef decltype(std::declval< Function & >()()) Result;
+	};
+
+public:
+
+	//! The type returned by Get
+	typedef typename TaskFutureState< Type >::Reference Reference;
+
+	//!
+	//! Default constructor. The future is invalid.
+	//!
+	inline TaskFuture(void)
+		: m_State(nullptr)
+	{
+	}
+
+	//!
+	//! Construct from a state, taking one of its references
+	//!
+	inline explicit TaskFuture(TaskFutureState< Type > * state)
+		: m_State(state)
+	{
+	}
+
+	//!
+	//! Copy constructor
+	//!
+	inline TaskFuture(const TaskFuture & other)
+		: m_State(other.m_State)
+	{
+		if (m_State != nullptr)
+		{
+			m_State->AddReference();
+		}
+	}
+
+	//!
+	//! Move constructor
+	//!
+	inline TaskFuture(TaskFuture && other) noexcept
+		: m_State(other.m_State)
+	{
+		other.m_State = nullptr;
+	}
+
+	//!
+	//! Assignment
+	//!
+	inline TaskFuture & operator = (TaskFuture other) noexcept
+	{
+		std::swap(m_State, other.m_State);
+		return *this;
+	}
+
+	//!
+	//! Destructor
+	//!
+	inline ~TaskFuture(void)
+	{
+		if (m_State != nullptr)
+		{
+			m_State->Release();
+		}
+	}
+
+	//!
+	//! Check if the future has a state
+	//!
+	inline bool IsValid(void) const
+	{
+		return m_State != nullptr;
+	}
+
+	//!
+	//! Check if the value is available
+	//!
+	inline bool IsReady(void) const
+	{
+		assert(m_State != nullptr);
+		return m_State->IsReady();
+	}
+
+	//!
+	//! Stall the current thread until the value is available. Don't call this from a task
+	//! if the task manager might not have another thread to set the value.
+	//!
+	inline void Wait(void) const
+	{
+		assert(m_State != nullptr);
+		if (m_State->IsReady() == true)
+		{
+			return;
+		}
+
+		WaitGroup waiter(1);
+		TaskFunction signal([&waiter] (void *) {
+			waiter.Done();
+		});
+		if (m_State->AddContinuation(signal) == true)
+		{
+			waiter.Wait();
+		}
+	}
+
+	//!
+	//! Wait for the value, and get it
+	//!
+	inline Reference Get(void) const
+	{
+		this->Wait();
+		return m_State->Get();
+	}
+
+	//!
+	//! Add a continuation. It's called with the value (or nothing for TaskFuture< void >) by
+	//! the thread setting the value, or immediately by the current thread if the value is
+	//! already available. Returns the future result of the continuation.
+	//!
+	template< typename Function >
+	inline TaskFuture< typename TaskFuture::template ResultOf< Function >::Result > Then(Function && function) const
+	{
+		assert(m_State != nullptr);
+		typedef typename ResultOf< Function >::Result Result;
+		TaskFutureState< Result > * next = TaskFutureState< Result >::Create();
+		next->AddReference();
+		TaskFunction continuation(Continuation< typename std::decay< Function >::type, Result >(m_State, next, std::forward< Function >(function)));
+		if (m_State->AddContinuation(continuation) == false)
+		{
+			continuation(nullptr);
+		}
+		return TaskFuture< Result >(next);
+	}
+
+private:
+
+	//!
+	//! Task setting the value of a future from a continuation
+	//!
+	template< typename Callable, typename Result >
+	struct Continuation
+	{
+		//! Constructor
+		template< typename Other >
+		inline Continuation(TaskFutureState< Type > * previous, TaskFutureState< Result > * next, Other && function)
+			: Previous(previous)
+			, Next(next)
+			, Function(std::forward< Other >(function))
+		{
+		}
+
+		//! Move constructor
+		inline Continuation(Continuation && other) noexcept(std::is_nothrow_move_constructible< Callable >::value)
+			: Previous(other.Previous)
+			, Next(other.Next)
+			, Function(std::move(other.Function))
+		{
+			other.Next = nullptr;
+		}
+
+		//! Destructor
+		inline ~Continuation(void)
+		{
+			if (Next != nullptr)
+			{
+				Next->Release();
+			}
+		}
+
+		//! Execute the continuation. The previous state is alive, since it's executing it.
+		inline void operator () (void * data)
+		{
+			this->Execute(data, std::is_void< Type >());
+		}
+
+		inline void Execute(void * data, std::false_type)
+		{
+			Next->Execute(data, Function, Previous->Get());
+		}
+
+		inline void Execute(void * data, std::true_type)
+		{
+			Next->Execute(data, Function);
+		}
+
+		//! The state holding the continuation
+		TaskFutureState< Type > * Previous;
+
+		//! The state of the continuation's result
+		TaskFutureState< Result > * Next;
+
+		//! The continuation
+		Callable Function;
+	};
+
+	//! The shared state
+	TaskFutureState< Type > * m_State;
+
+};
+
+
+template< typename Type > class WorkerContext;
+
+//!
+//! The task manager allows to easily create a pool thread and send jobs to
+//! it. It also provides a cheap thread local storage emulation capability,
+//! and typed per-worker contexts (see WorkerContext)
+//!
+//! Each worker thread has its own deque of tasks: tasks pushed by a worker go
+//! to its deque, and are executed in LIFO order by the worker, while idle
+//! workers steal the oldest tasks of random other workers. Tasks pushed from
+//! other threads go to a global FIFO injection queue.
+//!
+class TaskManager
+{
+
+	template< typename Type > friend class WorkerContext;
+
+	//!
+	//! Result of a task pushed with Submit
+	//!
+	template< typename Function >
+	struct SubmitResult
+	{
+		typedef decltype(std::declval< Function & >()(std::declval< void * >())) Result;
+	};
+
+public:
+
+	//!
+	//! Defines a simple task. This is move-only, and doesn't allocate for small callables.
+	//!
+	typedef TaskFunction Task;
+
+	//!
+	//! ID of a delayed or periodic task, see CancelTimer
+	//!
+	typedef uint64_t TimerID;
+
+	//!
+	//! Priority of a task. Workers take the tasks with the highest priority first, but a
+	//! lower priority which wasn't served for longer than the aging time (see SetAgingTime)
+	//! while higher ones had tasks goes first, so that it can't starve.
+	//!
+	enum class Priority
+		: int
+	{
+		//! Latency critical tasks
+		High = 0,
+
+		//! The default priority
+		Normal,
+
+		//! Batch work
+		Background
+	};
+
+	//! Maximum number of threads
+	enum : int { ThreadCapacity = 256 };
+
+	//!
+	//! CPU affinity of the threads (see SetAffinity)
+	//!
+	enum class Affinity
+		: int
+	{
+		//! Threads can run on any CPU
+		None = 0,
+
+		//! One thread per physical core first, then on the other CPUs of the cores
+		PhysicalCores,
+
+		//! One thread per CPU, in the system's order
+		LogicalCores
+	};
+
+	//!
+	//! Constructor.
+	//!
+	//! @param threadCount
+	//!		Optional number of thread used by the task manager. If omitted, the number
+	//!		of thread created will be the one supported by the platform.
+	//!
+	TaskManager(int threadCount = -1)
+		: m_State(State::Running)
+		, m_QueuedTaskCount(0)
+		, m_RunningThreadCount(0)
+		, m_SleepingThreadCount(0)
+		, m_SleepingReservedThreadCount(0)
+		, m_ReservedThreadCount(0)
+		, m_AgingTime(10000000)
+		, m_SpinningThreadCount(0)
+		, m_SpinningReservedThreadCount(0)
+		, m_MaxSpinningThreadCount(std::thread::hardware_concurrency() > 1 ? 2 : 0)
+		, m_SpinTime(50000)
+		, m_TimerStart(0)
+		, m_TimerWakeTick(0)
+		, m_TimerStopping(false)
+		, m_ThreadCount(0)
+		, m_SlotCount(0)
+		, m_MinThreadCount(0)
+		, m_MaxThreadCount(0)
+		, m_ScalingLatency(0)
+		, m_IdleTimeout(0)
+		, m_ScalingStopping(false)
+		, m_Profiled(true)
+	{
+		for (int i = 0; i < PriorityCount; ++i)
+		{
+			m_PriorityTaskCount[i] = 0;
+			m_WaitingSince[i] = 0;
+		}
+		for (int i = 0; i < ThreadCapacity; ++i)
+		{
+			m_SlotStates[i] = SlotState::Running;
+		}
+		m_Threads.resize(ThreadCapacity);
+		m_ThreadLocalStorage.resize(ThreadCapacity, nullptr);
+
+		// init the threads
+		this->SetThreadCount(threadCount);
+	}
+
+	//!
+	//! Destructor. Cleanup the threads. This will stall the current
+	//! thread until all jobs are done processing and all threads have
+	//! been correctly stopped and cleaned up.
+	//!
+	~TaskManager(void)
+	{
+		this->StopScaling();
+		this->StopTimers();
+		m_State = State::Stopping;
+		this->JoinThreads();
+		for (Context & context : m_Contexts)
+		{
+			context.Delete(context.Object);
+		}
+	}
+
+	//!
+	//! Set the thread local storage for the given thread.
+	//!
+	//! @param threadIndex
+	//!		The 0 based index of the thread. See GetNumThreads.
+	//!
+	//! @param data
+	//!		Pointer to the storage. The TaskManager will *NOT* own
+	//!		this data, you are responsible for cleaning it.
+	//!
+	//! See CreateContext for typed storage, created and destroyed by the
+	//! threads themselves.
+	//!
+	inline void SetThreadLocalStorage(int threadIndex, void * data)
+	{
+		// do nothing if we're stopping
+		if (m_State == State::Stopping)
+		{
+			return;
+		}
+
+		// set the data
+		assert(threadIndex >= 0 && threadIndex < std::max(this->GetThreadCount(), 1));
+		m_ThreadLocalStorage[threadIndex] = data;
+	}
+
+	//!
+	//! Create a context with an instance of @p Type per worker. Each worker constructs its
+	//! instance the first time it uses it, by calling `factory(index)` with its index, and
+	//! destroys it when it exits. The context is owned by the task manager.
+	//!
+	template< typename Type, typename Factory >
+	inline WorkerContext< Type > & CreateContext(Factory && factory)
+	{
+		typename std::decay< Factory >::type function(std::forward< Factory >(factory));
+		return this->AddContext(new WorkerContext< Type >(this, [function] (void * memory, int index) {
+			new (memory) Type(function(index));
+		}));
+	}
+
+	//!
+	//! Create a context with a default constructed instance of @p Type per worker
+	//!
+	template< typename Type >
+	inline WorkerContext< Type > & CreateContext(void)
+	{
+		return this->AddContext(new WorkerContext< Type >(this, [] (void * memory, int) {
+			new (memory) Type();
+		}));
+	}
+
+	//!
+	//! Push a task called with the current worker's instance of @p context, instead of the
+	//! thread local storage.
+	//!
+	template< typename Type, typename Function >
+	inline void PushTask(WorkerContext< Type > & context, Function && function, Priority priority = Priority::Normal)
+	{
+		this->PushTask(ContextTask< Type, typename std::decay< Function >::type >{ &context, std::forward< Function >(function) }, priority);
+	}
+
+	//!
+	//! Push a new task. The task can be anything callable with a `void *`
+	//! (lambdas, functors, static methods / functions) Callables don't need
+	//! to be copyable, and those up to TaskFunction::InlineSize bytes are
+	//! stored without allocating.
+	//!
+	//! The `void *` parameter passed to the task is a pointer to some
+	//! user data (use SetThreadLocalStorage to set this) that is shared
+	//! per-thread.
+	//!
+	//! Each priority has its own queues, see Priority.
+	//!
+	inline void PushTask(Task && task, Priority priority = Priority::Normal)
+	{
+		// do nothing if we're not running
+		if (m_State != State::Running)
+		{
+			return;
+		}
+
+		// check if we have some threads
+		if (m_ThreadCount == 0)
+		{
+			// no jobs, just execute the task
+			this->PrepareTask(std::move(task))(m_ThreadLocalStorage.front());
+		}
+		else
+		{
+			// push the job to the current worker's deque, or to the injection queue
+			int level = static_cast< int >(priority);
+			Task * pushed = NewTask(this->PrepareTask(std::move(task)));
+			m_PendingTasks.Add(1);
+			int worker = GetWorkerIndex(this);
+			if (worker >= 0)
+			{
+				m_Deques[level][worker]->Push(pushed);
+			}
+			else
+			{
+				std::lock_guard< std::mutex > lock(m_QueueMutex);
+				m_Queues[level].Push(pushed);
+			}
+			this->StampWaiting(level);
+			++m_PriorityTaskCount[level];
+			++m_QueuedTaskCount;
+
+			// and notify one thread that we have a job to do
+			this->WakeThreads(1, priority);
+		}
+	}
+
+	//!
+	//! Push the tasks of [first, last) They're moved from the range. Tasks pushed by a worker
+	//! go to its deque, others to the injection queue under a single lock, and at most one
+	//! sleeping thread per task is woken up.
+	//!
+	template< typename Iterator >
+	inline void PushTasks(Iterator first, Iterator last, Priority priority = Priority::Normal)
+	{
+		// do nothing if we're not running
+		if (m_State != State::Running)
+		{
+			return;
+		}
+
+		// no threads, just execute the tasks
+		if (m_ThreadCount == 0)
+		{
+			for (; first != last; ++first)
+			{
+				this->PushTask(Task(std::move(*first)), priority);
+			}
+			return;
+		}
+
+		int count = static_cast< int >(std::distance(first, last));
+		if (count == 0)
+		{
+			return;
+		}
+
+		// the tasks are counted as pending before any of them can be executed
+		int level = static_cast< int >(priority);
+		m_PendingTasks.Add(count);
+		int worker = GetWorkerIndex(this);
+		if (worker >= 0)
+		{
+			for (; first != last; ++first)
+			{
+				m_Deques[level][worker]->Push(NewTask(this->PrepareTask(Task(std::move(*first)))));
+			}
+		}
+		else
+		{
+			std::lock_guard< std::mutex > lock(m_QueueMutex);
+			for (; first != last; ++first)
+			{
+				m_Queues[level].Push(NewTask(this->PrepareTask(Task(std::move(*first)))));
+			}
+		}
+		this->StampWaiting(level);
+		m_PriorityTaskCount[level] += count;
+		m_QueuedTaskCount += count;
+
+		this->WakeThreads(count, priority);
+	}
+
+	//!
+	//! Push all the tasks of a container (see PushTasks)
+	//!
+	template< typename Container >
+	inline void PushTasks(Container & tasks, Priority priority = Priority::Normal)
+	{
+		this->PushTasks(std::begin(tasks), std::end(tasks), priority);
+	}
+
+	//!
+	//! Push a task after @p us microseconds, rounded up to the timer resolution (1 ms) Timers
+	//! are kept in a timer wheel, serviced by a thread started with the first timer. Returns
+	//! an ID which can be used to cancel the timer (see CancelTimer)
+	//!
+	inline TimerID PushDelayed(uint64_t us, Task && task, Priority priority = Priority::Normal)
+	{
+		return this->AddTimer(us, 0, Timer{ std::move(task), nullptr, 0, priority });
+	}
+
+	//!
+	//! Push a task every @p us microseconds, rounded up to the timer resolution (1 ms) until
+	//! the timer is cancelled. A run is skipped if the previous one is still queued or running.
+	//!
+	inline TimerID PushPeriodic(uint64_t us, Task && task, Priority priority = Priority::Normal)
+	{
+		uint64_t period = std::max< uint64_t >((us * 1000 + TimerTick - 1) / TimerTick, 1);
+		std::shared_ptr< PeriodicTask > periodic = std::make_shared< PeriodicTask >(std::move(task));
+		return this->AddTimer(us, period, Timer{ Task(), std::move(periodic), period, priority });
+	}
+
+#if TASK_MANAGER_COROUTINES == 1
+
+	//!
+	//! Awaitable returned by Schedule
+	//!
+	struct ScheduleAwaiter
+	{
+		//! The coroutine is always suspended
+		inline bool await_ready(void) const noexcept
+		{
+			return false;
+		}
+
+		//! Push a task resuming the coroutine
+		inline void await_suspend(std::coroutine_handle<> coroutine)
+		{
+			Manager->PushTask([coroutine] (void *) {
+				coroutine.resume();
+			}, Priority);
+		}
+
+		//! Nothing to return
+		inline void await_resume(void) const noexcept
+		{
+		}
+
+		//! The task manager
+		TaskManager * Manager;
+
+		//! Priority of the task resuming the coroutine
+		TaskManager::Priority Priority;
+	};
+
+	//!
+	//! Get an awaitable moving the awaiting coroutine to the threads: `co_await Schedule()`
+	//! suspends it, and a worker resumes it. See TaskCoroutine.h
+	//!
+	inline ScheduleAwaiter Schedule(Priority priority = Priority::Normal)
+	{
+		return ScheduleAwaiter{ this, priority };
+	}
+
+#endif
+
+	//!
+	//! Cancel a timer pushed with PushDelayed or PushPeriodic. Returns false if it already
+	//! expired or was cancelled. A periodic task already pushed still runs.
+	//!
+	inline bool CancelTimer(TimerID id)
+	{
+		std::lock_guard< std::mutex > lock(m_TimerMutex);
+		return m_Timers.Cancel(id);
+	}
+
+	//!
+	//! Push a task returning a value, and get its future result. The task is called with
+	//! the same `void *` as the ones pushed with PushTask. If the task is cancelled, the
+	//! future will never be ready.
+	//!
+	template< typename Function >
+	inline TaskFuture< typename SubmitResult< Function >::Result > Submit(Function && function, Priority priority = Priority::Normal)
+	{
+		static_assert(TaskFunction::IsInline< SubmittedTask< void (*)(void *), int > >::value == true, "Small submitted tasks must be stored inline");
+		typedef typename SubmitResult< Function >::Result Result;
+		TaskFutureState< Result > * state = TaskFutureState< Result >::Create();
+		state->AddReference();
+		this->PushTask(SubmittedTask< typename std::decay< Function >::type, Result >(state, std::forward< Function >(function)), priority);
+		return TaskFuture< Result >(state);
+	}
+
+	//!
+	//! Enable or disable the profiling of the tasks (enabled by default when the profiler
+	//! is enabled) This must be disabled for task managers used while the profiler's markers
+	//! are locked, like by its outputs.
+	//!
+	inline void SetProfiled(bool profiled)
+	{
+		m_Profiled = profiled;
+	}
+
+	//!
+	//! Reserve the first @p count threads to high priority tasks, so that those don't wait
+	//! behind other tasks. There must be less reserved threads than threads.
+	//!
+	inline void SetReservedThreadCount(int count)
+	{
+		assert(count >= 0 && (count == 0 || count < this->GetThreadCount()));
+		m_ReservedThreadCount = count;
+
+		// wake everyone, so that sleeping threads wait on the right condition variable
+		this->WakeAllThreads();
+	}
+
+	//!
+	//! Set the time after which a priority which isn't served because of the higher ones
+	//! goes first (10 ms by default)
+	//!
+	inline void SetAgingTime(uint64_t us)
+	{
+		m_AgingTime = static_cast< int64_t >(us) * 1000;
+	}
+
+	//!
+	//! Set how long idle threads spin before sleeping (50 us by default, 0 to disable) A task
+	//! pushed while a thread is spinning is taken without waking a sleeping thread, which costs
+	//! a system call and tens of microseconds. The actual spin time adapts to how long each
+	//! thread usually waits for tasks, so threads spin less when tasks are rare.
+	//!
+	inline void SetSpinTime(uint64_t us)
+	{
+		m_SpinTime = static_cast< int64_t >(us) * 1000;
+	}
+
+	//!
+	//! Set the maximum number of threads spinning at the same time (2 by default, 0 on single
+	//! core machines) The other idle threads sleep immediately.
+	//!
+	inline void SetMaxSpinningThreadCount(int count)
+	{
+		assert(count >= 0);
+		m_MaxSpinningThreadCount = count;
+	}
+
+	//!
+	//! Pin each thread to a CPU. The thread @p i is pinned to `cpus[i % cpus.size()]` This
+	//! applies to the current threads, and to the ones created later by SetThreadCount. An
+	//! empty list lets the threads run on any CPU again. Only supported on Linux.
+	//!
+	//! @return
+	//!		false if a CPU can't be used by the process (see GetCpus) in which case nothing
+	//!		changes, or if a thread couldn't be pinned.
+	//!
+	inline bool SetAffinity(const std::vector< int > & cpus)
+	{
+#if defined(__linux__)
+		std::vector< Cpu > topology = GetTopology();
+		for (int cpu : cpus)
+		{
+			if (std::find_if(topology.begin(), topology.end(), [cpu] (const Cpu & usable) { return usable.Index == cpu; }) == topology.end())
+			{
+				return false;
+			}
+		}
+
+		std::lock_guard< std::mutex > resizeLock(m_ResizeMutex);
+		std::lock_guard< std::mutex > lock(m_ThreadOptionsMutex);
+		m_Cpus = cpus;
+		bool result = true;
+		for (int i = 0; i < m_ThreadCount; ++i)
+		{
+			result = this->ApplyAffinity(i, m_Threads[i].native_handle(), true) == true && result == true;
+		}
+		return result;
+#else
+		return cpus.empty();
+#endif
+	}
+
+	//!
+	//! Pin the threads to the CPUs detected from the topology (see GetCpus) leaving out the
+	//! @p excluded ones, for instance the cores dedicated to other threads.
+	//!
+	inline bool SetAffinity(Affinity affinity, const std::vector< int > & excluded = std::vector< int >())
+	{
+		return this->SetAffinity(affinity == Affinity::None ? std::vector< int >() : GetCpus(affinity, excluded));
+	}
+
+	//!
+	//! Name the threads "<name> <index>" for debuggers and profilers. The name is truncated
+	//! to fit in the 15 characters allowed by Linux. Only supported on Linux.
+	//!
+	inline void SetThreadName(const std::string & name)
+	{
+		std::lock_guard< std::mutex > resizeLock(m_ResizeMutex);
+		std::lock_guard< std::mutex > lock(m_ThreadOptionsMutex);
+		m_ThreadName = name;
+		for (int i = 0; i < m_ThreadCount; ++i)
+		{
+			this->ApplyThreadName(i, m_Threads[i].native_handle());
+		}
+	}
+
+	//!
+	//! Get the CPUs the process can use, minus the @p excluded ones. With Affinity::PhysicalCores, the
+	//! first CPU of each physical core comes first, then the other CPUs (hyper-threads) so
+	//! that the first threads each get their own core. The topology is read from /sys on
+	//! Linux. Elsewhere, or if it can't be read, CPUs are numbered from 0 to the hardware
+	//! concurrency.
+	//!
+	static inline std::vector< int > GetCpus(Affinity affinity = Affinity::PhysicalCores, const std::vector< int > & excluded = std::vector< int >())
+	{
+		std::vector< Cpu > topology = GetTopology();
+		std::vector< int > cpus;
+		std::vector< int > siblings;
+		std::vector< std::pair< int, int > > cores;
+		for (const Cpu & cpu : topology)
+		{
+			if (std::find(excluded.begin(), excluded.end(), cpu.Index) != excluded.end())
+			{
+				continue;
+			}
+			std::pair< int, int > core(cpu.Package, cpu.Core);
+			if (affinity == Affinity::PhysicalCores && std::find(cores.begin(), cores.end(), core) != cores.end())
+			{
+				siblings.push_back(cpu.Index);
+			}
+			else
+			{
+				cores.push_back(core);
+				cpus.push_back(cpu.Index);
+			}
+		}
+		cpus.insert(cpus.end(), siblings.begin(), siblings.end());
+		return cpus;
+	}
+
+	//!
+	//! Get the number of physical cores, for instance to create one thread per core
+	//!
+	static inline int GetPhysicalCoreCount(void)
+	{
+		std::vector< Cpu > topology = GetTopology();
+		std::vector< std::pair< int, int > > cores;
+		for (const Cpu & cpu : topology)
+		{
+			std::pair< int, int > core(cpu.Package, cpu.Core);
+			if (std::find(cores.begin(), cores.end(), core) == cores.end())
+			{
+				cores.push_back(core);
+			}
+		}
+		return std::max< int >(static_cast< int >(cores.size()), 1);
+	}
+
+	//!
+	//! Get the number of threads.
+	//!
+	inline int GetThreadCount(void) const
+	{
+		return m_ThreadCount;
+	}
+
+	//!
+	//! Get the current number of queued tasks
+	//!
+	inline int GetTaskCount(void) const
+	{
+		return m_QueuedTaskCount;
+	}
+
+	//!
+	//! Set the number of threads. The pool is resized live: the queued tasks are kept, new
+	//! threads start stealing immediately, and the removed threads exit once they've run
+	//! the tasks they own, unless the pool grows back before. Removing all the threads
+	//! first waits for the queued tasks.
+	//!
+	//! @param count
+	//!		Number of threads to use. 0 will execute tasks instantly, -1 will create
+	//!		threads depending on the hardware's capabilities. At most ThreadCapacity.
+	//!
+	inline void SetThreadCount(int count)
+	{
+		// ensure we have a valid thread count
+		if (count < 0)
+		{
+			count = std::thread::hardware_concurrency();
+		}
+		count = std::min< int >(count, ThreadCapacity);
+
+		std::lock_guard< std::mutex > lock(m_ResizeMutex);
+		if (count > m_ThreadCount)
+		{
+			this->AddThreads(count);
+		}
+		else if (count < m_ThreadCount)
+		{
+			this->RemoveThreads(count);
+		}
+	}
+
+	//!
+	//! Let the task manager resize its pool between @p minimum and @p maximum threads. A thread
+	//! is added when tasks were queued for @p latency microseconds without any idle thread,
+	//! for instance because the workers are blocked in I/O. A thread retires after sleeping
+	//! for @p idleTimeout microseconds, the last ones first, and never below @p minimum or the
+	//! reserved threads. A @p maximum of 0 disables auto-scaling.
+	//!
+	inline void SetAutoScaling(int minimum, int maximum, uint64_t latency = 1000, uint64_t idleTimeout = 1000000)
+	{
+		assert(minimum >= 0 && minimum <= maximum && maximum <= ThreadCapacity);
+		this->StopScaling();
+		m_MinThreadCount = minimum;
+		m_MaxThreadCount = maximum;
+		m_ScalingLatency = static_cast< int64_t >(latency) * 1000;
+		m_IdleTimeout = maximum > 0 ? static_cast< int64_t >(idleTimeout) * 1000 : 0;
+		if (maximum == 0)
+		{
+			return;
+		}
+
+		// bring the current count within the bounds, then start monitoring the queue
+		int count = this->GetThreadCount();
+		if (count < minimum || count > maximum)
+		{
+			this->SetThreadCount(std::min(std::max(count, minimum), maximum));
+		}
+		m_ScalingStopping = false;
+		m_ScalingThread = std::thread([this] (void) { this->RunScaling(); });
+	}
+
+	//!
+	//! Wait until there is no longer any task queued or running.
+	//! This will stall the current thread.
+	//!
+	//! @param us
+	//!		Unused, the current thread blocks until the last task is done.
+	//!
+	inline void Wait(uint64_t us = 1000)
+	{
+		(void)us;
+		m_PendingTasks.Wait();
+	}
+
+	//!
+	//! Wait until the tasks of @p group are done. If the current thread is a worker, it
+	//! executes queued tasks until there are none left, then blocks.
+	//!
+	inline void Wait(WaitGroup & group)
+	{
+		int worker = GetWorkerIndex(this);
+		if (worker >= 0)
+		{
+			uint32_t random = static_cast< uint32_t >(reinterpret_cast< uintptr_t >(&group)) | 1;
+			while (group.IsDone() == false)
+			{
+				int level = 0;
+				Task * task = this->GetTask(worker, random, level);
+				if (task == nullptr)
+				{
+					break;
+				}
+				this->ExecuteTask(task, worker, level);
+			}
+		}
+		group.Wait();
+	}
+
+	//!
+	//! Cancel every queued tasks and stall the current thread until the currently
+	//! running ones are completed. The tasks of ParallelFor, ParallelReduce, ParallelSort
+	//! and TaskGraph are cancelled too: those complete without doing the cancelled part
+	//! of their work.
+	//!
+	inline void Cancel(uint64_t us = 1000)
+	{
+		m_State = State::Paused;
+		this->EmptyQueue();
+		this->Wait(us);
+		m_State = State::Running;
+	}
+
+	//!
+	//! Call @p function with each index of [begin, end) The range is split in halves on
+	//! demand: a worker keeps processing its range @p grain indices at a time, and gives
+	//! the second half of what remains to the other threads when its previous half was
+	//! stolen (or when some threads are sleeping, for a thread which isn't a worker) The
+	//! current thread participates, and returns when all the indices are processed.
+	//!
+	template< typename Function >
+	inline void ParallelFor(int64_t begin, int64_t end, int64_t grain, Function && function)
+	{
+		auto body = [&function] (int64_t first, int64_t last, int) {
+			for (int64_t i = first; i < last; ++i)
+			{
+				function(i);
+			}
+		};
+		this->ParallelRange(begin, end, grain, body);
+	}
+
+	//!
+	//! Reduce [begin, end) to a single value. Each thread accumulates in its own copy of
+	//! @p identity by calling `function(accumulator, index)`, then the accumulators are merged
+	//! with `combine(a, b)` Since the range is split dynamically (see ParallelFor) @p combine
+	//! must be associative and commutative.
+	//!
+	template< typename Type, typename Function, typename Combine >
+	inline Type ParallelReduce(int64_t begin, int64_t end, int64_t grain, const Type & identity, Function && function, Combine && combine)
+	{
+		// one accumulator per worker, plus one for the current thread if it's not a worker. The
+		// padding keeps them on different cache lines.
+		struct Accumulator
+		{
+			Type Value;
+			char Padding[64];
+		};
+		int slots = m_SlotCount;
+		std::vector< Accumulator > accumulators(slots + 1, Accumulator{ identity, { 0 } });
+
+		// the workers added meanwhile accumulate in a local copy, merged under a lock
+		Type overflow = identity;
+		std::mutex overflowMutex;
+		auto body = [&] (int64_t first, int64_t last, int slot) {
+			if (slot >= slots)
+			{
+				Type accumulator = identity;
+				for (int64_t i = first; i < last; ++i)
+				{
+					function(accumulator, i);
+				}
+				std::lock_guard< std::mutex > lock(overflowMutex);
+				overflow = combine(overflow, accumulator);
+				return;
+			}
+			Type & accumulator = accumulators[slot < 0 ? slots : slot].Value;
+			for (int64_t i = first; i < last; ++i)
+			{
+				function(accumulator, i);
+			}
+		};
+		this->ParallelRange(begin, end, grain, body);
+
+		Type result = overflow;
+		for (const Accumulator & accumulator : accumulators)
+		{
+			result = combine(result, accumulator.Value);
+		}
+		return result;
+	}
+
+	//!
+	//! Sort [first, last) Parallel quick sort: the partitions bigger than @p grain are
+	//! sorted by other threads while the current one sorts the other side.
+	//!
+	template< typename Iterator, typename Compare >
+	inline void ParallelSort(Iterator first, Iterator last, Compare compare, int64_t grain = 4096)
+	{
+		WaitGroup pending(1);
+		int depth = 0;
+		for (int64_t count = static_cast< int64_t >(last - first); count > 1; count >>= 1)
+		{
+			depth += 2;
+		}
+		this->SortRange(first, last, compare, grain, depth, pending);
+		this->Wait(pending);
+	}
+
+	//!
+	//! Sort [first, last) using `operator <`
+	//!
+	template< typename Iterator >
+	inline void ParallelSort(Iterator first, Iterator last)
+	{
+		typedef typename std::iterator_traits< Iterator >::value_type Value;
+		this->ParallelSort(first, last, std::less< Value >());
+	}
+
+private:
+
+	//!
+	//! Task setting the value of a future
+	//!
+	template< typename Callable, typename Result >
+	struct SubmittedTask
+	{
+		//! Constructor
+		template< typename Other >
+		inline SubmittedTask(TaskFutureState< Result > * state, Other && function)
+			: State(state)
+			, Function(std::forward< Other >(function))
+		{
+		}
+
+		//! Move constructor
+		inline SubmittedTask(SubmittedTask && other) noexcept(std::is_nothrow_move_constructible< Callable >::value)
+			: State(other.State)
+			, Function(std::move(other.Function))
+		{
+			other.State = nullptr;
+		}
+
+		//! Destructor
+		inline ~SubmittedTask(void)
+		{
+			if (State != nullptr)
+			{
+				State->Release();
+			}
+		}
+
+		//! Execute the task
+		inline void operator () (void * data)
+		{
+			State->Execute(data, Function, data);
+		}
+
+		//! The state of the result
+		TaskFutureState< Result > * State;
+
+		//! The task
+		Callable Function;
+	};
+
+	//!
+	//! Task processing a subrange split by RunRange. If it's dropped, the subrange is left
+	//! unprocessed, but counted as done.
+	//!
+	template< typename Body >
+	struct RangeTask
+	{
+		//! Process the subrange
+		inline void operator () (void *)
+		{
+			Manager->RunRange(First, Last, Grain, *Function, *Pending);
+		}
+
+		//! Count the subrange as done
+		inline void Drop(void)
+		{
+			Pending->Done();
+		}
+
+		//! The task manager
+		TaskManager * Manager;
+
+		//! The function processing the subranges
+		Body * Function;
+
+		//! The subranges not done yet
+		WaitGroup * Pending;
+
+		//! The subrange
+		int64_t First;
+		int64_t Last;
+
+		//! Size of the subranges processed at once
+		int64_t Grain;
+	};
+
+	//!
+	//! Task sorting a partition split by SortRange. If it's dropped, the partition is left
+	//! unsorted, but counted as done.
+	//!
+	template< typename Iterator, typename Compare >
+	struct SortTask
+	{
+		//! Sort the partition
+		inline void operator () (void *)
+		{
+			Manager->SortRange(First, Last, *Function, Grain, Depth, *Pending);
+		}
+
+		//! Count the partition as done
+		inline void Drop(void)
+		{
+			Pending->Done();
+		}
+
+		//! The task manager
+		TaskManager * Manager;
+
+		//! The comparison
+		Compare * Function;
+
+		//! The partitions not sorted yet
+		WaitGroup * Pending;
+
+		//! The partition
+		Iterator First;
+		Iterator Last;
+
+		//! Size of the partitions sorted sequentially
+		int64_t Grain;
+
+		//! Number of splits left before sorting sequentially
+		int Depth;
+	};
+
+	//! Duration of a tick of the timers, in nanoseconds
+	enum : int64_t { TimerTick = 1000000 };
+
+	//!
+	//! The task of a periodic timer, shared by its runs
+	//!
+	struct PeriodicTask
+	{
+		//! Constructor
+		inline PeriodicTask(Task && function)
+			: Function(std::move(function))
+			, Running(false)
+		{
+		}
+
+		//! The task
+		Task Function;
+
+		//! True while a run is queued or running
+		std::atomic< bool > Running;
+	};
+
+	//!
+	//! A run of a periodic timer. The timer can run again once this is destroyed, whether it
+	//! was executed or cancelled.
+	//!
+	struct PeriodicRun
+	{
+		//! Constructor
+		inline PeriodicRun(const std::shared_ptr< PeriodicTask > & periodic)
+			: Periodic(periodic)
+		{
+		}
+
+		//! Move constructor
+		PeriodicRun(PeriodicRun &&) = default;
+
+		//! Destructor
+		inline ~PeriodicRun(void)
+		{
+			if (Periodic != nullptr)
+			{
+				Periodic->Running = false;
+			}
+		}
+
+		//! Execute the task
+		inline void operator () (void * data)
+		{
+			Periodic->Function(data);
+		}
+
+		//! The periodic task
+		std::shared_ptr< PeriodicTask > Periodic;
+	};
+
+	//!
+	//! A delayed or periodic task in the timer wheel
+	//!
+	struct Timer
+	{
+		//! The task of a delayed timer
+		Task Function;
+
+		//! The task of a periodic timer
+		std::shared_ptr< PeriodicTask > Periodic;
+
+		//! Number of ticks between the runs of a periodic timer, 0 for delayed ones
+		uint64_t Period;
+
+		//! Priority of the pushed tasks
+		TaskManager::Priority Priority;
+	};
+
+	//!
+	//! Add a timer expiring in @p us microseconds, starting the timer thread if needed
+	//!
+	inline TimerID AddTimer(uint64_t us, uint64_t period, Timer && timer)
+	{
+		std::lock_guard< std::mutex > lock(m_TimerMutex);
+		if (m_TimerThread.joinable() == false)
+		{
+			m_TimerStart = GetTime();
+			m_TimerStopping = false;
+			m_TimerThread = std::thread([this] (void) {
+				this->RunTimers();
+			});
+		}
+
+		// the wheel only advances while it has timers: catch up first, so that the timer thread
+		// doesn't have to walk every tick elapsed since the last timer
+		uint64_t elapsed = static_cast< uint64_t >(GetTime() - m_TimerStart);
+		if (m_Timers.GetCount() == 0)
+		{
+			auto none = [] (Timer &) -> uint64_t { return 0; };
+			m_Timers.Advance(elapsed / TimerTick, none);
+		}
+
+		// round the deadline up to the next tick, so that the task never runs early
+		uint64_t delay = period != 0 ? period * TimerTick : us * 1000;
+		uint64_t expire = (elapsed + delay + TimerTick - 1) / TimerTick;
+		TimerID id = m_Timers.Insert(expire, std::move(timer));
+
+		// wake the timer thread if it sleeps until later
+		if (expire < m_TimerWakeTick)
+		{
+			m_TimerConditionVariable.notify_one();
+		}
+		return id;
+	}
+
+	//!
+	//! Loop of the timer thread: push the tasks of the expired timers, then sleep until the
+	//! next one. The tasks are pushed without the timer lock, so that they can add timers.
+	//!
+	inline void RunTimers(void)
+	{
+		std::vector< Task > due[PriorityCount];
+		auto expire = [&due] (Timer & timer) -> uint64_t {
+			int level = static_cast< int >(timer.Priority);
+			if (timer.Period == 0)
+			{
+				due[level].push_back(std::move(timer.Function));
+				return 0;
+			}
+			if (timer.Periodic->Running.exchange(true) == false)
+			{
+				due[level].push_back(PeriodicRun(timer.Periodic));
+			}
+			return timer.Period;
+		};
+
+		std::unique_lock< std::mutex > lock(m_TimerMutex);
+		while (m_TimerStopping == false)
+		{
+			m_Timers.Advance(static_cast< uint64_t >(GetTime() - m_TimerStart) / TimerTick, expire);
+
+			bool pushed = false;
+			for (int level = 0; level < PriorityCount; ++level)
+			{
+				if (due[level].empty() == false)
+				{
+					lock.unlock();
+					this->PushTasks(due[level], static_cast< Priority >(level));
+					due[level].clear();
+					lock.lock();
+					pushed = true;
+				}
+			}
+			if (pushed == true)
+			{
+				continue;
+			}
+
+			m_TimerWakeTick = m_Timers.GetNextTick();
+			if (m_TimerWakeTick == UINT64_MAX)
+			{
+				m_TimerConditionVariable.wait(lock);
+			}
+			else
+			{
+				std::chrono::nanoseconds time(m_TimerStart + static_cast< int64_t >(m_TimerWakeTick) * TimerTick);
+				m_TimerConditionVariable.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::duration_cast< std::chrono::steady_clock::duration >(time)));
+			}
+			m_TimerWakeTick = 0;
+		}
+	}
+
+	//!
+	//! Stop the timer thread, dropping the pending timers
+	//!
+	inline void StopTimers(void)
+	{
+		{
+			std::lock_guard< std::mutex > lock(m_TimerMutex);
+			m_TimerStopping = true;
+		}
+		m_TimerConditionVariable.notify_one();
+		if (m_TimerThread.joinable() == true)
+		{
+			m_TimerThread.join();
+		}
+	}
+
+	//!
+	//! Task called with the current worker's instance of a context
+	//!
+	template< typename Type, typename Callable >
+	struct ContextTask
+	{
+		//! Execute the task
+		inline void operator () (void *)
+		{
+			Function(Context->Get());
+		}
+
+		//! The context
+		WorkerContext< Type > * Context;
+
+		//! The task
+		Callable Function;
+	};
+
+	//!
+	//! A context, with type erased operations
+	//!
+	struct Context
+	{
+		//! The WorkerContext
+		void * Object;
+
+		//! Destroy the instance of a worker
+		void (*Destroy)(void * object, int index);
+
+		//! Delete the WorkerContext
+		void (*Delete)(void * object);
+	};
+
+	//!
+	//! Take ownership of a context
+	//!
+	template< typename Type >
+	inline WorkerContext< Type > & AddContext(WorkerContext< Type > * object)
+	{
+		Context context = {
+			object,
+			[] (void * object, int index) { static_cast< WorkerContext< Type > * >(object)->Destroy(index); },
+			[] (void * object) { delete static_cast< WorkerContext< Type > * >(object); }
+		};
+		std::lock_guard< std::mutex > lock(m_ContextMutex);
+		object->Resize(ThreadCapacity);
+		m_Contexts.push_back(context);
+		return *object;
+	}
+
+	//!
+	//! Destroy the instances of the worker @p index. Called by the workers when they exit.
+	//!
+	inline void DestroyContexts(int index)
+	{
+		std::lock_guard< std::mutex > lock(m_ContextMutex);
+		for (Context & context : m_Contexts)
+		{
+			context.Destroy(context.Object, index);
+		}
+	}
+
+	//!
+	//! The worker thread, if the current thread is one
+	//!
+	struct Worker
+	{
+		//! The task manager owning the thread
+		TaskManager * Manager;
+
+		//! Index of the thread
+		int Index;
+	};
+
+	//!
+	//! Get the current thread's worker
+	//!
+	static inline Worker & GetWorker(void)
+	{
+		static thread_local Worker worker = { nullptr, -1 };
+		return worker;
+	}
+
+	//!
+	//! Get the index of the current thread if it's a worker of @p manager, -1 otherwise
+	//!
+	static inline int GetWorkerIndex(const TaskManager * manager)
+	{
+		const Worker & worker = GetWorker();
+		return worker.Manager == manager ? worker.Index : -1;
+	}
+
+	//!
+	//! Check if there are tasks for the worker @p index
+	//!
+	inline bool HasTasks(int index) const
+	{
+		return index < m_ReservedThreadCount ? m_PriorityTaskCount[0] > 0 : m_QueuedTaskCount > 0;
+	}
+
+	//!
+	//! Get a task to execute on the worker @p index, and its priority. Priorities are tried
+	//! in order, starting with a starving one if any (see GetStarvingPriority) Reserved workers
+	//! only take high priority tasks. Returns nullptr if no task was found.
+	//!
+	inline Task * GetTask(int index, uint32_t & random, int & level)
+	{
+		int count = index < m_ReservedThreadCount ? 1 : static_cast< int >(PriorityCount);
+		int first = count > 1 ? this->GetStarvingPriority() : 0;
+		for (int i = 0; i < count; ++i)
+		{
+			level = i == 0 ? first : (i - 1 < first ? i - 1 : i);
+			if (m_PriorityTaskCount[level] == 0)
+			{
+				continue;
+			}
+			Task * task = this->GetTask(index, level, random);
+			if (task != nullptr)
+			{
+				// the remaining tasks of the priority wait from now on (when there are none, the
+				// next push stamps it) The worker serving a starving priority already did it.
+				if (level > 0 && level != first && m_PriorityTaskCount[level] > 1)
+				{
+					m_WaitingSince[level].store(GetTime(), std::memory_order_relaxed);
+				}
+				return task;
+			}
+		}
+		return nullptr;
+	}
+
+	//!
+	//! Get a task of the priority @p level to execute on the worker @p index: its own latest
+	//! task, then the oldest task of the injection queue, then a task stolen from other
+	//! workers, starting from a random one. Returns nullptr if no task was found.
+	//!
+	inline Task * GetTask(int index, int level, uint32_t & random)
+	{
+		Task * task = m_Deques[level][index]->Pop();
+		if (task != nullptr)
+		{
+			return task;
+		}
+
+		{
+			std::lock_guard< std::mutex > lock(m_QueueMutex);
+			if (m_Queues[level].IsEmpty() == false)
+			{
+				task = m_Queues[level].Front();
+				m_Queues[level].Pop();
+				return task;
+			}
+		}
+
+		return this->StealTask(index, level, random);
+	}
+
+	//!
+	//! Steal a task of the priority @p level from the other workers than @p index (-1 to steal
+	//! from all of them)
+	//!
+	inline Task * StealTask(int index, int level, uint32_t & random)
+	{
+		int count = m_SlotCount;
+		if (count == 0)
+		{
+			return nullptr;
+		}
+
+		// xorshift
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+
+		int first = static_cast< int >(random % static_cast< uint32_t >(count));
+		for (int i = 0; i < count; ++i)
+		{
+			int victim = (first + i) % count;
+			if (victim != index)
+			{
+				Task * task = m_Deques[level][victim]->Steal();
+				if (task != nullptr)
+				{
+					return task;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	//!
+	//! Called by the worker @p index when it found no task. It first spins for a while, in
+	//! case a task is pushed soon, then sleeps until some tasks are pushed. Returns the task
+	//! it found, or nullptr when it woke up without finding one.
+	//!
+	//! @param idleTime
+	//!		Average time the worker waited for a task, updated when a task is found. The spin
+	//!		budget depends on it (see GetSpinBudget)
+	//!
+	inline Task * WaitForTask(int index, uint32_t & random, int & level, int64_t & idleTime)
+	{
+		int64_t start = GetTime();
+		int64_t budget = this->GetSpinBudget(idleTime);
+		Task * task = budget > 0 ? this->Spin(index, random, level, start + budget) : nullptr;
+		if (task == nullptr)
+		{
+			this->Park(index);
+			task = this->GetTask(index, random, level);
+		}
+		if (task != nullptr)
+		{
+			idleTime += (GetTime() - start - idleTime) / 4;
+
+			// pushers don't wake sleeping threads for the tasks spinning threads can take, so if
+			// more tasks are queued, wake another thread, which does the same in turn
+			if (m_QueuedTaskCount > 1)
+			{
+				this->WakeThreads(1, static_cast< Priority >(level));
+			}
+		}
+		return task;
+	}
+
+	//!
+	//! Get how long a worker waiting for tasks for @p idleTime on average should spin. When
+	//! tasks arrive faster than the spin time, the worker spins for twice the average wait.
+	//! Otherwise, spinning would mostly be wasted, and it only spins for a 16th of the spin
+	//! time, so that it notices when tasks start arriving faster again.
+	//!
+	inline int64_t GetSpinBudget(int64_t idleTime) const
+	{
+		int64_t spinTime = m_SpinTime;
+		if (idleTime > spinTime)
+		{
+			return spinTime / 16;
+		}
+		return std::max(std::min(2 * idleTime, spinTime), spinTime / 16);
+	}
+
+	//!
+	//! Spin until a task is available for the worker @p index, or until @p deadline. Only
+	//! a few threads spin at once (see SetMaxSpinningThreadCount) the others return nullptr
+	//! immediately. Pushers don't wake sleeping threads for the tasks that spinning threads
+	//! can take.
+	//!
+	inline Task * Spin(int index, uint32_t & random, int & level, int64_t deadline)
+	{
+		int spinning = m_SpinningThreadCount.load(std::memory_order_relaxed);
+		do
+		{
+			if (spinning >= m_MaxSpinningThreadCount)
+			{
+				return nullptr;
+			}
+		} while (m_SpinningThreadCount.compare_exchange_weak(spinning, spinning + 1) == false);
+		bool reserved = index < m_ReservedThreadCount;
+		if (reserved == true)
+		{
+			++m_SpinningReservedThreadCount;
+		}
+
+		// pause the CPU for the first iterations, then yield to the other threads
+		Task * task = nullptr;
+		for (int iteration = 0; m_State != State::Stopping && index < m_ThreadCount; ++iteration)
+		{
+			if (this->HasTasks(index) == true)
+			{
+				task = this->GetTask(index, random, level);
+				if (task != nullptr)
+				{
+					break;
+				}
+			}
+			if ((iteration & 15) == 15 && GetTime() > deadline)
+			{
+				break;
+			}
+			if (iteration < 256)
+			{
+				CpuPause();
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		// the count is updated before checking for tasks again while parking, so a pusher
+		// which saw this thread spinning doesn't need to wake anyone
+		if (reserved == true)
+		{
+			--m_SpinningReservedThreadCount;
+		}
+		--m_SpinningThreadCount;
+		return task;
+	}
+
+	//!
+	//! Sleep until some tasks are pushed for the worker @p index. The sleeping count is updated
+	//! before checking the task count, and the pushers update the task count before checking
+	//! the sleeping count, so one of them sees the other. Reserved threads only wait for high
+	//! priority tasks, and everyone wakes up when the number of reserved threads changes.
+	//!
+	inline void Park(int index)
+	{
+		std::unique_lock< std::mutex > uniqueLock(m_ConditionVariableMutex);
+		bool reserved = index < m_ReservedThreadCount;
+		std::atomic_int & sleeping = reserved == true ? m_SleepingReservedThreadCount : m_SleepingThreadCount;
+		--m_RunningThreadCount;
+		++sleeping;
+		std::condition_variable & conditionVariable = reserved == true ? m_ReservedConditionVariable : m_ConditionVariable;
+		auto wake = [&] (void) {
+			return m_State == State::Stopping || this->HasTasks(index) == true || (index < m_ReservedThreadCount) != reserved || index >= m_ThreadCount;
+		};
+		int64_t timeout = m_IdleTimeout;
+		if (timeout > 0)
+		{
+			// with auto-scaling, the thread retires if it slept long enough
+			if (conditionVariable.wait_for(uniqueLock, std::chrono::nanoseconds(timeout), wake) == false)
+			{
+				this->Retire(index);
+			}
+		}
+		else
+		{
+			conditionVariable.wait(uniqueLock, wake);
+		}
+		--sleeping;
+		++m_RunningThreadCount;
+	}
+
+	//!
+	//! Retire the worker @p index after an idle timeout, if it's the last one and the pool is
+	//! above its minimum size. The last worker retires first so that the workers stay packed.
+	//!
+	inline void Retire(int index)
+	{
+		int count = index + 1;
+		if (index > m_ReservedThreadCount && index >= m_MinThreadCount)
+		{
+			m_ThreadCount.compare_exchange_strong(count, index);
+		}
+	}
+
+	//!
+	//! Start threads until there are @p count of them. Called with m_ResizeMutex locked.
+	//!
+	inline void AddThreads(int count)
+	{
+		// without threads, the pushing threads used the instances of the slot 0
+		if (m_ThreadCount == 0)
+		{
+			this->DestroyContexts(0);
+		}
+
+		for (int index = m_ThreadCount; index < count; index = m_ThreadCount)
+		{
+			if (m_Deques[0][index] == nullptr)
+			{
+				for (int level = 0; level < PriorityCount; ++level)
+				{
+					m_Deques[level][index].reset(new WorkStealingDeque< Task >());
+				}
+				m_SlotCount = index + 1;
+			}
+
+			// the last thread may have retired meanwhile, then its slot is filled first
+			if (m_ThreadCount.compare_exchange_strong(index, index + 1) == false)
+			{
+				continue;
+			}
+
+			// the slot may still hold a retired thread. Unless it's already exiting, it goes back
+			// to work instead of waiting for it to finish its tasks. The count is updated first,
+			// so the thread sees it once it sees the new state.
+			if (m_Threads[index].joinable() == true)
+			{
+				if (m_SlotStates[index].exchange(SlotState::Reviving) != SlotState::Exiting)
+				{
+					continue;
+				}
+				m_Threads[index].join();
+			}
+			++m_RunningThreadCount;
+			m_SlotStates[index] = SlotState::Running;
+			m_Threads[index] = std::thread([this, index] (void) { this->RunWorker(index); });
+		}
+	}
+
+	//!
+	//! Retire the threads above @p count. They exit once they've run the tasks of their own
+	//! deques, or go back to work if their slot is reused before. Called with m_ResizeMutex
+	//! locked.
+	//!
+	inline void RemoveThreads(int count)
+	{
+		// without threads, tasks run on the pushing threads: finish the queued ones first
+		if (count == 0)
+		{
+			this->Wait();
+		}
+
+		m_ThreadCount = count;
+		m_ReservedThreadCount = std::min< int >(m_ReservedThreadCount, std::max(count - 1, 0));
+		this->WakeAllThreads();
+		if (count > 0)
+		{
+			return;
+		}
+
+		for (std::thread & thread : m_Threads)
+		{
+			if (thread.joinable() == true)
+			{
+				thread.join();
+			}
+		}
+
+		// tasks pushed while the threads were exiting
+		for (int level = 0; level < PriorityCount; ++level)
+		{
+			for (Task * task = this->PopQueuedTask(level); task != nullptr; task = this->PopQueuedTask(level))
+			{
+				this->ExecuteTask(task, 0, level);
+			}
+		}
+	}
+
+	//!
+	//! Pop the oldest task of the injection queue of the priority @p level, nullptr if it's empty
+	//!
+	inline Task * PopQueuedTask(int level)
+	{
+		std::lock_guard< std::mutex > lock(m_QueueMutex);
+		if (m_Queues[level].IsEmpty() == true)
+		{
+			return nullptr;
+		}
+		Task * task = m_Queues[level].Front();
+		m_Queues[level].Pop();
+		return task;
+	}
+
+	//!
+	//! The loop of the worker @p index
+	//!
+	inline void RunWorker(int index)
+	{
+		GetWorker() = { this, index };
+		this->ConfigureThread(index);
+		uint32_t random = static_cast< uint32_t >(index) * 2654435761u + 1;
+
+		// the loop should be going on until the task manager wants to stop, or
+		// we still have tasks to process.
+		int64_t idleTime = m_SpinTime;
+		while (m_State != State::Stopping || this->HasTasks(index) == true)
+		{
+			int level = 0;
+			Task * task = nullptr;
+			if (index >= m_ThreadCount)
+			{
+				// retired: only this thread pushes to its deques, so run their tasks and exit
+				for (level = 0; level < PriorityCount && task == nullptr; ++level)
+				{
+					task = m_Deques[level][index]->Pop();
+				}
+				if (task == nullptr)
+				{
+					// unless AddThreads put the slot back to work meanwhile
+					SlotState running = SlotState::Running;
+					if (m_SlotStates[index].compare_exchange_strong(running, SlotState::Exiting) == true)
+					{
+						break;
+					}
+					m_SlotStates[index] = SlotState::Running;
+					continue;
+				}
+				--level;
+			}
+			else
+			{
+				task = this->GetTask(index, random, level);
+				if (task == nullptr)
+				{
+					// nothing to do, spin for a while then sleep until some tasks are pushed
+					task = this->WaitForTask(index, random, level, idleTime);
+				}
+			}
+			if (task != nullptr)
+			{
+				// we've got a task ! execute it
+				this->ExecuteTask(task, index, level);
+			}
+		}
+
+		// the thread is no longer running
+		this->DestroyContexts(index);
+		GetWorker() = { nullptr, -1 };
+		--m_RunningThreadCount;
+	}
+
+	//!
+	//! Wake all the sleeping threads
+	//!
+	inline void WakeAllThreads(void)
+	{
+		{
+			std::lock_guard< std::mutex > lock(m_ConditionVariableMutex);
+		}
+		m_ConditionVariable.notify_all();
+		m_ReservedConditionVariable.notify_all();
+	}
+
+	//!
+	//! The loop of the auto-scaling thread. It adds a thread when tasks were queued without
+	//! any idle thread for the scaling latency, which means the tasks wait at least that long.
+	//!
+	inline void RunScaling(void)
+	{
+		std::unique_lock< std::mutex > lock(m_ScalingMutex);
+		int64_t starvingSince = 0;
+		while (m_ScalingStopping == false)
+		{
+			int64_t latency = m_ScalingLatency;
+			m_ScalingConditionVariable.wait_for(lock, std::chrono::nanoseconds(std::max< int64_t >(latency / 4, 100000)));
+			if (m_ScalingStopping == true)
+			{
+				break;
+			}
+
+			// reserved threads don't take the other tasks, so they don't count as idle
+			bool starving = m_QueuedTaskCount > 0 && m_SleepingThreadCount == 0 && m_SpinningThreadCount == m_SpinningReservedThreadCount;
+			int64_t now = GetTime();
+			if (starving == false || starvingSince == 0)
+			{
+				starvingSince = starving == true ? now : 0;
+				continue;
+			}
+			if (now - starvingSince >= latency && m_ThreadCount < m_MaxThreadCount)
+			{
+				lock.unlock();
+				{
+					std::lock_guard< std::mutex > resizeLock(m_ResizeMutex);
+					if (m_ThreadCount < m_MaxThreadCount)
+					{
+						this->AddThreads(m_ThreadCount + 1);
+					}
+				}
+				lock.lock();
+				starvingSince = 0;
+			}
+		}
+	}
+
+	//!
+	//! Stop the auto-scaling thread, if it's running
+	//!
+	inline void StopScaling(void)
+	{
+		{
+			std::lock_guard< std::mutex > lock(m_ScalingMutex);
+			m_ScalingStopping = true;
+		}
+		m_ScalingConditionVariable.notify_all();
+		if (m_ScalingThread.joinable() == true)
+		{
+			m_ScalingThread.join();
+		}
+	}
+
+	//!
+	//! A CPU, and the core it belongs to
+	//!
+	struct Cpu
+	{
+		//! Index of the CPU
+		int Index;
+
+		//! Index of the physical package (socket)
+		int Package;
+
+		//! Index of the core in its package
+		int Core;
+	};
+
+	//!
+	//! Get the CPUs the process can use, and their cores. Those are the online CPUs which are
+	//! in the process' affinity mask (restricted by taskset, cgroup cpusets, etc.) as read by
+	//! the first call. Each CPU is its own core if the topology can't be read.
+	//!
+	static inline std::vector< Cpu > GetTopology(void)
+	{
+		static const std::vector< Cpu > topology = ReadTopology();
+		return topology;
+	}
+
+	//!
+	//! Read the topology (see GetTopology)
+	//!
+	static inline std::vector< Cpu > ReadTopology(void)
+	{
+		std::vector< Cpu > cpus;
+#if defined(__linux__)
+		// the online CPUs, like "0-3,6,8-11"
+		std::ifstream online("/sys/devices/system/cpu/online");
+		std::string ranges;
+		if (std::getline(online, ranges))
+		{
+			const char * range = ranges.c_str();
+			while (*range != '\0')
+			{
+				char * end = nullptr;
+				int first = static_cast< int >(strtol(range, &end, 10));
+				int last = *end == '-' ? static_cast< int >(strtol(end + 1, &end, 10)) : first;
+				if (end == range)
+				{
+					break;
+				}
+				for (int index = first; index <= last; ++index)
+				{
+					std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(index) + "/topology/";
+					Cpu cpu = { index, 0, index };
+					std::ifstream(path + "physical_package_id") >> cpu.Package;
+					std::ifstream(path + "core_id") >> cpu.Core;
+					cpus.push_back(cpu);
+				}
+				range = *end == ',' ? end + 1 : end;
+			}
+		}
+#endif
+		if (cpus.empty() == true)
+		{
+			int count = std::max< int >(std::thread::hardware_concurrency(), 1);
+			for (int index = 0; index < count; ++index)
+			{
+				cpus.push_back({ index, 0, index });
+			}
+		}
+#if defined(__linux__)
+		// keep the CPUs the process is allowed to use
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		{
+			cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&allowed] (const Cpu & cpu) {
+				return cpu.Index < 0 || cpu.Index >= CPU_SETSIZE || CPU_ISSET(cpu.Index, &allowed) == 0;
+			}), cpus.end());
+		}
+#endif
+		return cpus;
+	}
+
+	//!
+	//! Pin the calling worker @p index and name it. Called by the workers when they start, so
+	//! that the memory they allocate first is local to their CPU.
+	//!
+	inline void ConfigureThread(int index)
+	{
+#if defined(__linux__)
+		std::lock_guard< std::mutex > lock(m_ThreadOptionsMutex);
+		// the CPUs were checked by SetAffinity, which reports the failures
+		this->ApplyAffinity(index, pthread_self(), false);
+		this->ApplyThreadName(index, pthread_self());
+#else
+		(void)index;
+#endif
+	}
+
+	//!
+	//! Pin the thread @p index to its CPU. If no CPU is set and @p reset is true, the thread
+	//! can run on any CPU the process can use again. Returns false if the thread couldn't be
+	//! pinned. m_ThreadOptionsMutex must be locked.
+	//!
+	inline bool ApplyAffinity(int index, std::thread::native_handle_type handle, bool reset)
+	{
+#if defined(__linux__)
+		if (m_Cpus.empty() == true && reset == false)
+		{
+			return true;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (m_Cpus.empty() == false)
+		{
+			int cpu = m_Cpus[index % m_Cpus.size()];
+			if (cpu < 0 || cpu >= CPU_SETSIZE)
+			{
+				return false;
+			}
+			CPU_SET(cpu, &set);
+		}
+		else
+		{
+			for (const Cpu & cpu : GetTopology())
+			{
+				CPU_SET(cpu.Index, &set);
+			}
+		}
+		return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+#else
+		(void)index;
+		(void)handle;
+		(void)reset;
+		return false;
+#endif
+	}
+
+	//!
+	//! Name the thread @p index, if a name was set. m_ThreadOptionsMutex must be locked.
+	//!
+	inline void ApplyThreadName(int index, std::thread::native_handle_type handle)
+	{
+#if defined(__linux__)
+		if (m_ThreadName.empty() == true)
+		{
+			return;
+		}
+		std::string suffix = " " + std::to_string(index);
+		std::string name = m_ThreadName.substr(0, 15 - std::min< size_t >(suffix.size(), 15)) + suffix;
+		pthread_setname_np(handle, name.substr(0, 15).c_str());
+#else
+		(void)index;
+		(void)handle;
+#endif
+	}
+
+	//!
+	//! Hint the CPU that the current thread is spinning
+	//!
+	static inline void CpuPause(void)
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(_M_IX86) || defined(_M_X64)
+		_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield");
+#endif
+	}
+
+	//!
+	//! Check if priorities higher than @p level have tasks
+	//!
+	inline bool HasHigherPriorityTasks(int level) const
+	{
+		for (int i = 0; i < level; ++i)
+		{
+			if (m_PriorityTaskCount[i] > 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//!
+	//! Get the lowest priority whose tasks waited for longer than the aging time while higher
+	//! priorities had tasks. Returns the highest priority if none is starving. Only one worker
+	//! gets a starving priority: it restarts the priority's wait, so that the other workers keep
+	//! serving the higher priorities. The clock is only read when several priorities have tasks.
+	//!
+	inline int GetStarvingPriority(void)
+	{
+		for (int level = PriorityCount - 1; level > 0; --level)
+		{
+			if (m_PriorityTaskCount[level] > 0 && this->HasHigherPriorityTasks(level) == true)
+			{
+				int64_t now = GetTime();
+				int64_t since = m_WaitingSince[level].load(std::memory_order_relaxed);
+				if (now - since > m_AgingTime && m_WaitingSince[level].compare_exchange_strong(since, now, std::memory_order_relaxed) == true)
+				{
+					return level;
+				}
+			}
+		}
+		return 0;
+	}
+
+	//!
+	//! Start the wait of the priority @p level if it has no tasks yet, before tasks are pushed
+	//! to it. The highest priority never waits.
+	//!
+	inline void StampWaiting(int level)
+	{
+		if (level > 0 && m_PriorityTaskCount[level] == 0)
+		{
+			m_WaitingSince[level].store(GetTime(), std::memory_order_relaxed);
+		}
+	}
+
 	//!
-	~TaskManager(void)
+	//! Get the current time in nanoseconds, for the aging
+	//!
+	static inline int64_t GetTime(void)
 	{
-		m_State = State::Stopping;
-		this->JoinThreads();
+		return std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
 	}
 
 	//!
-	//! Set the thread local storage for the given thread.
+	//! Allocate a queued task from the pool
 	//!
-	//! @param threadIndex
-	//!		The 0 based index of the thread. See GetNumThreads.
+	static inline Task * NewTask(Task && task)
+	{
+		return new (TaskBlockPool< sizeof(Task) >::Allocate()) Task(std::move(task));
+	}
+
 	//!
-	//! @param data
-	//!		Pointer to the storage. The TaskManager will *NOT* own
-	//!		this data, you are responsible for cleaning it.
+	//! Destroy a queued task and give it back to the pool
 	//!
-	inline void SetThreadLocalStorage(int threadIndex, void * data)
+	static inline void DeleteTask(Task * task)
 	{
-		// do nothing if we're stopping
-		if (m_State == State::Stopping)
-		{
-			return;
-		}
-
-		// set the data
-		assert(threadIndex >= 0 && threadIndex < static_cast< int >(m_ThreadLocalStorage.size()));
-		m_ThreadLocalStorage[threadIndex] = data;
+		task->~Task();
+		TaskBlockPool< sizeof(Task) >::Deallocate(task);
 	}
 
 	//!
-	//! Push a new task. The task can be anything that is castable to
-	//! a `std::function< void (void *) >`. Implicit cast will work with
-	//! lambdas and static methods / functions.
-	//!
-	//! The `void *` parameter passed to the task is a pointer to some
-	//! user data (use SetThreadLocalStorage to set this) that is shared
-	//! per-thread.
+	//! Call `body(first, last, slot)` on subranges of [begin, end) and wait until they're all
+	//! processed. The slot is the index of the worker, or -1 for the current thread if it's
+	//! not a worker.
 	//!
-	inline void PushTask(Task && task)
+	template< typename Body >
+	inline void ParallelRange(int64_t begin, int64_t end, int64_t grain, Body & body)
 	{
-		// do nothing if we're not running
-		if (m_State != State::Running)
+		if (begin >= end)
 		{
 			return;
 		}
+		grain = std::max< int64_t >(grain, 1);
 
-		// check if we have some threads
-		if (m_Threads.empty() == true)
+		// without threads, or if pushed tasks would be dropped, just do everything here
+		if (m_ThreadCount == 0 || m_State != State::Running)
 		{
-			// no jobs, just execute the task
-			task(m_ThreadLocalStorage.front());
+			body(begin, end, GetWorkerIndex(this));
+			return;
 		}
-		else
+
+		WaitGroup pending(1);
+		this->RunRange(begin, end, grain, body, pending);
+		this->Wait(pending);
+	}
+
+	//!
+	//! Process a subrange of ParallelRange, splitting it when other threads could help
+	//!
+	template< typename Body >
+	inline void RunRange(int64_t first, int64_t last, int64_t grain, Body & body, WaitGroup & pending)
+	{
+		int worker = GetWorkerIndex(this);
+		while (last - first > grain)
 		{
-			// push the job
+			bool split = worker >= 0 ? m_Deques[static_cast< int >(Priority::Normal)][worker]->IsEmpty() : m_SleepingThreadCount > 0;
+			if (split == true)
 			{
-				std::lock_guard< std::mutex > lock(m_QueueMutex);
-				m_Queue.emplace(std::move(task));
-				++m_QueuedTaskCount;
+				int64_t middle = first + (last - first) / 2;
+				pending.Add(1);
+				this->PushTask(DroppableTask< RangeTask< Body > >(RangeTask< Body >{ this, &body, &pending, middle, last, grain }));
+				last = middle;
+			}
+			else
+			{
+				body(first, first + grain, worker);
+				first += grain;
 			}
-
-			// and notify one thread that we have a job to do
-			m_ConditionVariable.notify_one();
 		}
+		body(first, last, worker);
+		pending.Done();
 	}
 
 	//!
-	//! Get the number of threads.
+	//! Quick sort [first, last) with ParallelSort. Falls back to std::sort once the depth
+	//! is exhausted, in case of bad pivots.
 	//!
-	inline int GetThreadCount(void) const
+	template< typename Iterator, typename Compare >
+	inline void SortRange(Iterator first, Iterator last, Compare & compare, int64_t grain, int depth, WaitGroup & pending)
 	{
-		return static_cast< int >(m_Threads.size());
+		typedef typename std::iterator_traits< Iterator >::value_type Value;
+		while (last - first > grain && depth > 0 && m_ThreadCount > 0 && m_State == State::Running)
+		{
+			// median of 3, then partition in 3: less than, equal to and greater than the pivot
+			Iterator middle = first + (last - first) / 2;
+			const Value & a = *first;
+			const Value & b = *middle;
+			const Value & c = *(last - 1);
+			Value pivot = compare(a, b) == true
+				? (compare(b, c) == true ? b : (compare(a, c) == true ? c : a))
+				: (compare(a, c) == true ? a : (compare(b, c) == true ? c : b));
+			Iterator lower = std::partition(first, last, [&] (const Value & value) { return compare(value, pivot); });
+			Iterator upper = std::partition(lower, last, [&] (const Value & value) { return compare(pivot, value) == false; });
+			--depth;
+
+			// give the upper part to another thread, and continue with the lower one
+			pending.Add(1);
+			this->PushTask(DroppableTask< SortTask< Iterator, Compare > >(SortTask< Iterator, Compare >{ this, &compare, &pending, upper, last, grain, depth }));
+			last = lower;
+		}
+		std::sort(first, last, compare);
+		pending.Done();
 	}
 
 	//!
-	//! Get the current number of queued tasks
+	//! Record the push of a task when the tasks are profiled, and link it to the one pushing
+	//! it. This is used by the critical path analysis (see Profiler::Output::CriticalPath)
 	//!
-	inline int GetTaskCount(void) const
+	inline Task PrepareTask(Task && task)
 	{
-		return m_QueuedTaskCount;
+#if PROFILER_ENABLE == 1
+		if (m_Profiled == true)
+		{
+			PROFILE_SCOPE("TaskManager::PushTask");
+			uint64_t id = GetNextTaskID();
+			PROFILE_ARG("task", id);
+			return ProfileTask(std::move(task), id);
+		}
+#endif
+		return std::move(task);
 	}
 
 	//!
-	//! Set the number of threads.
-	//!
-	//! @param count
-	//!		Number of threads to use. 0 will execute tasks instantly, -1 will create
-	//!		threads depending on the hardware's capabilities.
+	//! Wake up to @p count sleeping threads after pushing tasks of the given priority, minus the
+	//! spinning ones, starting with the ones reserved to high priority tasks. Taking the condition
+	//! variable's mutex ensures that a thread about to wait sees the tasks, or gets the notification.
 	//!
-	inline void SetThreadCount(int count)
+	inline void WakeThreads(int count, Priority priority)
 	{
-		// ensure we have a valid thread count
-		if (count < 0)
+		// spinning threads will take some of the tasks. Reserved ones only take high priority tasks.
+		count -= m_SpinningThreadCount - (priority == Priority::High ? 0 : m_SpinningReservedThreadCount.load());
+		if (count <= 0)
 		{
-			count = std::thread::hardware_concurrency();
+			return;
 		}
 
-		// do nothing if the number of threads is already correct
-		if (count == static_cast< int >(m_Threads.size()))
+		int reserved = priority == Priority::High ? std::min< int >(count, m_SleepingReservedThreadCount) : 0;
+		int others = std::min< int >(count - reserved, m_SleepingThreadCount);
+		if (reserved == 0 && others == 0)
 		{
 			return;
 		}
 
-		// update the state of the manager
-		m_State = State::Stopping;
-
-		// clear the queue and wait until running ones are processed and join the threads
-		this->EmptyQueue();
-		this->JoinThreads();
-
-		// clear previous data and reserve space for new ones
-		m_RunningThreadCount = count;
-		m_Threads.clear();
-		m_Threads.reserve(count);
-		m_ThreadLocalStorage.clear();
-		m_ThreadLocalStorage.resize(count == 0 ? 1 : count);
-		memset(m_ThreadLocalStorage.data(), 0, m_ThreadLocalStorage.size() * sizeof(void *));
-
-		// set the state as paused while we start the threads
-		m_State = State::Paused;
-
-		// create the threads
-		for (int i = 0; i < count; ++i)
 		{
-			m_Threads.emplace_back(std::thread([&, i] (void) {
-				// the loop should be going on until the task manager wants to stop, or
-				// we still have tasks to process.
-				while (m_State != State::Stopping || m_QueuedTaskCount > 0)
-				{
-					// lock the queue's mutex to check if there is a task to do
-					m_QueueMutex.lock();
+			std::lock_guard< std::mutex > lock(m_ConditionVariableMutex);
+		}
+		NotifyThreads(m_ReservedConditionVariable, reserved, m_SleepingReservedThreadCount);
+		NotifyThreads(m_ConditionVariable, others, m_SleepingThreadCount);
+	}
 
-					// check if we have tasks
-					if (m_Queue.empty())
-					{
-						// No task. Allow new ones to be queued
-						m_QueueMutex.unlock();
-
-						// and wait for something to do
-						std::unique_lock< std::mutex > uniqueLock(m_ConditionVariableMutex);
-						--m_RunningThreadCount;
-						m_ConditionVariable.wait(uniqueLock);
-						++m_RunningThreadCount;
-					}
-					else
-					{
-						// we've got a task ! Get it, pop it, and release the queue's lock.
-						Task task(std::move(m_Queue.front()));
-						m_Queue.pop();
-						--m_QueuedTaskCount;
-						m_QueueMutex.unlock();
-
-						// and execute it
-						task(m_ThreadLocalStorage[i]);
-					}
-				}
-			}));
+	//!
+	//! Notify @p count threads waiting on @p conditionVariable, out of @p sleeping
+	//!
+	static inline void NotifyThreads(std::condition_variable & conditionVariable, int count, int sleeping)
+	{
+		if (count > 0 && count >= sleeping)
+		{
+			conditionVariable.notify_all();
+		}
+		else
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				conditionVariable.notify_one();
+			}
 		}
+	}
 
-		// ok, we're good to go
-		m_State = State::Running;
+	//!
+	//! Execute a task of the priority @p level popped by the worker @p index, and give it back
+	//! to the pool
+	//!
+	inline void ExecuteTask(Task * task, int index, int level)
+	{
+		--m_PriorityTaskCount[level];
+		--m_QueuedTaskCount;
+		(*task)(m_ThreadLocalStorage[index]);
+		DeleteTask(task);
+		m_PendingTasks.Done();
 	}
 
+#if PROFILER_ENABLE == 1
+
 	//!
-	//! Wait until there is no longer any task queued or running.
-	//! This will stall the current thread.
+	//! Get the ID of the task executed by the current thread, 0 outside of tasks
 	//!
-	//! @param us
-	//!		Number of micro seconds to wait between 2 checks.
+	static inline uint64_t & GetCurrentTaskID(void)
+	{
+		static thread_local uint64_t id = 0;
+		return id;
+	}
+
 	//!
-	inline void Wait(uint64_t us = 1000)
+	//! Get a new task ID. Those are shared by all the task managers, and 64 bit so that they
+	//! never wrap: the critical path analysis relies on parents having smaller IDs.
+	//!
+	static inline uint64_t GetNextTaskID(void)
+	{
+		static std::atomic< uint64_t > id(1);
+		return id++;
+	}
+
+	//!
+	//! A task wrapped to profile its execution
+	//!
+	struct ProfiledTask
 	{
-		while (m_RunningThreadCount > 0)
+		//! Execute the task
+		inline void operator () (void * data)
 		{
-			std::this_thread::sleep_for(std::chrono::microseconds(us));
+			PROFILE_SCOPE("TaskManager::Task");
+			PROFILE_ARG("task", ID);
+			PROFILE_ARG("parent", Parent);
+			uint64_t & current = GetCurrentTaskID();
+			uint64_t previous = current;
+			current = ID;
+			Function(data);
+			current = previous;
 		}
-	}
+
+		//! The wrapped task
+		Task Function;
+
+		//! ID of the task
+		uint64_t ID;
+
+		//! ID of the task which pushed it
+		uint64_t Parent;
+	};
 
 	//!
-	//! Cancel every queued tasks and stall the current thread until the currently
-	//! running ones are completed.
+	//! Wrap a task to profile its execution, with its ID and the ID of the task which pushed it
 	//!
-	inline void Cancel(uint64_t us = 1000)
+	static inline Task ProfileTask(Task && task, uint64_t id)
 	{
-		m_State = State::Paused;
-		this->EmptyQueue();
-		this->Wait(us);
-		m_State = State::Running;
+		return ProfiledTask{ std::move(task), id, GetCurrentTaskID() };
 	}
 
-private:
+#endif
 
 	//!
 	//! Empty the queue.
 	//!
 	inline void EmptyQueue(void)
 	{
-		std::lock_guard< std::mutex > lock(m_QueueMutex);
-		while (m_Queue.empty() == false)
 		{
-			m_Queue.pop();
-			--m_QueuedTaskCount;
+			std::lock_guard< std::mutex > lock(m_QueueMutex);
+			for (int level = 0; level < PriorityCount; ++level)
+			{
+				while (m_Queues[level].IsEmpty() == false)
+				{
+					DeleteTask(m_Queues[level].Front());
+					m_Queues[level].Pop();
+					--m_PriorityTaskCount[level];
+					--m_QueuedTaskCount;
+					m_PendingTasks.Done();
+				}
+			}
+		}
+
+		// the workers' deques. Running tasks might push new ones, so loop until nothing's queued
+		uint32_t random = 1;
+		while (m_QueuedTaskCount > 0)
+		{
+			bool found = false;
+			for (int level = 0; level < PriorityCount; ++level)
+			{
+				Task * task = this->StealTask(-1, level, random);
+				if (task != nullptr)
+				{
+					DeleteTask(task);
+					--m_PriorityTaskCount[level];
+					--m_QueuedTaskCount;
+					m_PendingTasks.Done();
+					found = true;
+				}
+			}
+			if (found == false)
+			{
+				std::this_thread::yield();
+			}
 		}
-		assert(m_Queue.empty() == true && m_QueuedTaskCount == 0);
 	}
 
 	//!
@@ -261,23 +3967,23 @@ private:
 	{
 		assert(m_State == State::Stopping);
 
-		// no thread, easy
-		if (m_Threads.empty() == true)
-		{
-			return;
-		}
-
 		// wait until everyone's asleep
 		this->Wait();
 
-		// join threads
-		m_ConditionVariable.notify_all();
+		// join threads, including the retired ones which were not joined yet
+		this->WakeAllThreads();
 		for (std::thread & thread : m_Threads)
 		{
-			thread.join();
+			if (thread.joinable() == true)
+			{
+				thread.join();
+			}
 		}
 	}
 
+	//! Number of priorities
+	enum : int { PriorityCount = 3 };
+
 	//! The various states of the manager
 	enum class State
 		: int
@@ -292,18 +3998,41 @@ private:
 		Stopping
 	};
 
-	//! The list of threads
+	//! The threads, per slot. A retired thread stays here until its slot is reused.
 	std::vector< std::thread > m_Threads;
 
-	//! The jobs
-	std::queue< Task > m_Queue;
+	//! The states of the threads of the slots, used to revive a retired thread
+	enum class SlotState
+		: int
+	{
+		//! Running, or retired and finishing its tasks
+		Running = 0,
+
+		//! Retired and exiting, it must be joined
+		Exiting,
 
-	//! The mutex used to protect the job queue
+		//! Put back to work by AddThreads, the thread must not exit
+		Reviving
+	};
+
+	//! The state of the thread of each slot
+	std::atomic< SlotState > m_SlotStates[ThreadCapacity];
+
+	//! The jobs pushed by threads which are not workers, per priority
+	RingQueue< Task * > m_Queues[PriorityCount];
+
+	//! The mutex used to protect the job queues
 	std::mutex m_QueueMutex;
 
+	//! The per-worker jobs, per priority, allocated when a slot is used for the first time
+	std::unique_ptr< WorkStealingDeque< Task > > m_Deques[PriorityCount][ThreadCapacity];
+
 	//! Condition variable used to awake the threads when a job is available
 	std::condition_variable m_ConditionVariable;
 
+	//! Condition variable used to awake the reserved threads when a high priority job is available
+	std::condition_variable m_ReservedConditionVariable;
+
 	//! Mutex used with the condition variable
 	std::mutex m_ConditionVariableMutex;
 
@@ -313,12 +4042,257 @@ private:
 	//! Fake thread local storage
 	std::vector< void * > m_ThreadLocalStorage;
 
+	//! The per-worker contexts
+	std::vector< Context > m_Contexts;
+
+	//! Mutex protecting the list of contexts
+	std::mutex m_ContextMutex;
+
 	//! Number of tasks in the queue
 	std::atomic_int m_QueuedTaskCount;
+
+	//! Number of tasks in the queue, per priority
+	std::atomic_int m_PriorityTaskCount[PriorityCount];
+
+	//! Time since which the tasks of each priority wait: when its first task was pushed, or when
+	//! a task was last taken while others remained
+	std::atomic< int64_t > m_WaitingSince[PriorityCount];
+
+	//! The tasks queued or running
+	WaitGroup m_PendingTasks;
 	
 	//! Number of running threads
 	std::atomic_int m_RunningThreadCount;
 
+	//! Number of threads waiting for tasks
+	std::atomic_int m_SleepingThreadCount;
+
+	//! Number of reserved threads waiting for high priority tasks
+	std::atomic_int m_SleepingReservedThreadCount;
+
+	//! Number of threads reserved to high priority tasks
+	std::atomic_int m_ReservedThreadCount;
+
+	//! Time after which a priority not served because of higher ones goes first, in nanoseconds
+	std::atomic< int64_t > m_AgingTime;
+
+	//! Number of threads spinning for tasks
+	std::atomic_int m_SpinningThreadCount;
+
+	//! Number of reserved threads spinning for high priority tasks
+	std::atomic_int m_SpinningReservedThreadCount;
+
+	//! Maximum number of threads spinning at the same time
+	std::atomic_int m_MaxSpinningThreadCount;
+
+	//! Maximum time idle threads spin before sleeping, in nanoseconds
+	std::atomic< int64_t > m_SpinTime;
+
+	//! The CPUs the threads are pinned to, empty if they're not pinned
+	std::vector< int > m_Cpus;
+
+	//! Prefix of the threads' names, empty if they're not named
+	std::string m_ThreadName;
+
+	//! Mutex protecting the CPUs and the name of the threads
+	std::mutex m_ThreadOptionsMutex;
+
+	//! The delayed and periodic tasks
+	TimerWheel< Timer > m_Timers;
+
+	//! Thread pushing the tasks of the expired timers, started with the first timer
+	std::thread m_TimerThread;
+
+	//! Mutex protecting the timers
+	std::mutex m_TimerMutex;
+
+	//! Condition variable used to wake the timer thread when a timer expires earlier
+	std::condition_variable m_TimerConditionVariable;
+
+	//! Time of the tick 0 of the timers, in nanoseconds
+	int64_t m_TimerStart;
+
+	//! Tick until which the timer thread sleeps, 0 if it's not sleeping
+	uint64_t m_TimerWakeTick;
+
+	//! True when the timer thread must exit
+	bool m_TimerStopping;
+
+	//! Number of threads. The workers with a higher index are retiring.
+	std::atomic_int m_ThreadCount;
+
+	//! Number of slots with deques, the highest number of threads so far
+	std::atomic_int m_SlotCount;
+
+	//! Mutex serializing the resizes of the pool
+	std::mutex m_ResizeMutex;
+
+	//! Minimum number of threads with auto-scaling
+	std::atomic_int m_MinThreadCount;
+
+	//! Maximum number of threads with auto-scaling, 0 if it's disabled
+	std::atomic_int m_MaxThreadCount;
+
+	//! Time tasks can be queued without idle threads before a thread is added, in nanoseconds
+	std::atomic< int64_t > m_ScalingLatency;
+
+	//! Time after which a sleeping thread retires, in nanoseconds, 0 to never retire
+	std::atomic< int64_t > m_IdleTimeout;
+
+	//! Thread adding threads when tasks wait for too long
+	std::thread m_ScalingThread;
+
+	//! Mutex used with the auto-scaling condition variable
+	std::mutex m_ScalingMutex;
+
+	//! Condition variable used to stop the auto-scaling thread
+	std::condition_variable m_ScalingConditionVariable;
+
+	//! True when the auto-scaling thread must exit
+	bool m_ScalingStopping;
+
+	//! True if the tasks are profiled
+	bool m_Profiled;
+
+};
+
+
+//!
+//! Per-worker instances of @p Type, created with TaskManager::CreateContext. Tasks get the
+//! instance of the worker executing them, which makes it easy to have scratch memory or
+//! accumulators without locking. Each instance is constructed by its worker, so that its
+//! memory is local to the worker's CPU, and is aligned and padded to cache lines so that
+//! workers don't share them.
+//!
+template< typename Type >
+class WorkerContext
+{
+
+	friend class TaskManager;
+
+public:
+
+	WorkerContext(const WorkerContext &) = delete;
+	WorkerContext & operator = (const WorkerContext &) = delete;
+
+	//!
+	//! Get the instance of the current worker, constructing it if needed. This must be called
+	//! from a worker of the task manager, or from any thread if it has no threads.
+	//!
+	inline Type & Get(void)
+	{
+		int index = TaskManager::GetWorkerIndex(m_Manager);
+		if (index < 0)
+		{
+			assert(m_Manager->GetThreadCount() == 0 && "WorkerContext::Get must be called from a worker");
+			index = 0;
+		}
+		Instance & instance = m_Instances[index];
+		if (instance.Object == nullptr)
+		{
+			instance.Memory = ::operator new(Size + LineSize);
+			void * memory = reinterpret_cast< void * >((reinterpret_cast< uintptr_t >(instance.Memory) + LineSize - 1) & ~uintptr_t(LineSize - 1));
+			m_Construct(memory, index);
+			instance.Object = static_cast< Type * >(memory);
+		}
+		return *instance.Object;
+	}
+
+	//!
+	//! Call @p function with each constructed instance, for instance to merge accumulators.
+	//! The instances must not be used by tasks meanwhile.
+	//!
+	template< typename Function >
+	inline void ForEach(Function && function)
+	{
+		for (Instance & instance : m_Instances)
+		{
+			if (instance.Object != nullptr)
+			{
+				function(*instance.Object);
+			}
+		}
+	}
+
+private:
+
+	static_assert(alignof(Type) <= 64, "Over-aligned contexts are not supported");
+
+	//! Size of a cache line, and of the instances rounded to cache lines
+	enum : size_t
+	{
+		LineSize	= 64,
+		Size		= (sizeof(Type) + LineSize - 1) & ~size_t(LineSize - 1)
+	};
+
+	//!
+	//! The instance of a worker
+	//!
+	struct Instance
+	{
+		//! The instance, nullptr until the worker uses it
+		Type * Object;
+
+		//! The memory allocated for it
+		void * Memory;
+	};
+
+	//!
+	//! Constructor
+	//!
+	inline WorkerContext(TaskManager * manager, std::function< void (void *, int) > construct)
+		: m_Manager(manager)
+		, m_Construct(std::move(construct))
+	{
+	}
+
+	//!
+	//! Destructor
+	//!
+	inline ~WorkerContext(void)
+	{
+		this->Resize(0);
+	}
+
+	//!
+	//! Destroy the instance of the worker @p index
+	//!
+	inline void Destroy(int index)
+	{
+		if (index >= static_cast< int >(m_Instances.size()))
+		{
+			return;
+		}
+		Instance & instance = m_Instances[index];
+		if (instance.Object != nullptr)
+		{
+			instance.Object->~Type();
+			::operator delete(instance.Memory);
+			instance = { nullptr, nullptr };
+		}
+	}
+
+	//!
+	//! Destroy all the instances, and set the number of workers
+	//!
+	inline void Resize(int count)
+	{
+		for (int i = 0; i < static_cast< int >(m_Instances.size()); ++i)
+		{
+			this->Destroy(i);
+		}
+		m_Instances.assign(count, Instance{ nullptr, nullptr });
+	}
+
+	//! The task manager
+	TaskManager * m_Manager;
+
+	//! Construct an instance in the given memory, for the given worker
+	std::function< void (void *, int) > m_Construct;
+
+	//! The instances, per worker
+	std::vector< Instance > m_Instances;
+
 };
 
 